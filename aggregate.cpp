@@ -0,0 +1,193 @@
+#include <qalgorithms.h>
+#include <limits>
+
+#include "aggregate.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AGGREGATE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(AGGREGATE_SSE2) && defined(__GNUC__)
+#define AGGREGATE_AVX2
+#define AGGREGATE_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(AGGREGATE_SSE2) && defined(_MSC_VER)
+#define AGGREGATE_AVX2
+#define AGGREGATE_TARGET_AVX2
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+Accumulator::Accumulator() {
+	sum = 0.0;
+	min = std::numeric_limits<double>::infinity();
+	max = -std::numeric_limits<double>::infinity();
+	count = 0;
+	errorRow = -1;
+	errorColumn = -1;
+}
+
+void Accumulator::add(double value) {
+	sum += value;
+	min = qMin(min, value);
+	max = qMax(max, value);
+	++count;
+}
+
+static quint8 accumulateScalar(const double *values, const quint8 *flags,
+	int count, quint8 valid, Accumulator &acc) {
+	quint8 seen = 0;
+	for (int i = 0; i < count; ++i) {
+		seen |= flags[i];
+		if (flags[i] & valid)
+			acc.add(values[i]);
+	}
+	return seen;
+}
+
+#ifdef AGGREGATE_SSE2
+//16 slots per step: one compare turns the flag bytes into a byte mask,
+//which is widened to one 64-bit lane per double. Masked-out lanes add
+//0 and compare as +/-infinity, so whatever numbers[] holds there is
+//never read as a value.
+static quint8 accumulateSse2(const double *values, const quint8 *flags,
+	int count, quint8 valid, Accumulator &acc) {
+	const __m128i validBits = _mm_set1_epi8(char(valid));
+	const __m128d posInf = _mm_set1_pd(std::numeric_limits<double>::infinity());
+	const __m128d negInf = _mm_set1_pd(-std::numeric_limits<double>::infinity());
+	__m128i seen = _mm_setzero_si128();
+	__m128d sum = _mm_setzero_pd();
+	__m128d lo = posInf;
+	__m128d hi = negInf;
+	qint64 n = 0;
+
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i *>(flags + i));
+		seen = _mm_or_si128(seen, f);
+		__m128i m8 = _mm_cmpeq_epi8(_mm_and_si128(f, validBits), validBits);
+		n += qPopulationCount(quint32(_mm_movemask_epi8(m8)));
+
+		__m128i m16[2] = { _mm_unpacklo_epi8(m8, m8), _mm_unpackhi_epi8(m8, m8) };
+		for (int k = 0; k < 4; ++k) {
+			__m128i m32 = (k & 1) ? _mm_unpackhi_epi16(m16[k >> 1], m16[k >> 1])
+				: _mm_unpacklo_epi16(m16[k >> 1], m16[k >> 1]);
+			__m128d mask[2] = {
+				_mm_castsi128_pd(_mm_unpacklo_epi32(m32, m32)),
+				_mm_castsi128_pd(_mm_unpackhi_epi32(m32, m32))
+			};
+			for (int j = 0; j < 2; ++j) {
+				__m128d v = _mm_loadu_pd(values + i + k * 4 + j * 2);
+				__m128d kept = _mm_and_pd(mask[j], v);
+				sum = _mm_add_pd(sum, kept);
+				lo = _mm_min_pd(lo, _mm_or_pd(kept, _mm_andnot_pd(mask[j], posInf)));
+				hi = _mm_max_pd(hi, _mm_or_pd(kept, _mm_andnot_pd(mask[j], negInf)));
+			}
+		}
+	}
+
+	double sums[2], los[2], his[2];
+	_mm_storeu_pd(sums, sum);
+	_mm_storeu_pd(los, lo);
+	_mm_storeu_pd(his, hi);
+	acc.sum += sums[0] + sums[1];
+	acc.min = qMin(acc.min, qMin(los[0], los[1]));
+	acc.max = qMax(acc.max, qMax(his[0], his[1]));
+	acc.count += n;
+
+	quint8 bytes[16];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(bytes), seen);
+	quint8 result = 0;
+	for (int k = 0; k < 16; ++k)
+		result |= bytes[k];
+	return result | accumulateScalar(values + i, flags + i, count - i, valid, acc);
+}
+#endif
+
+#ifdef AGGREGATE_AVX2
+//Same as the SSE2 kernel, with four doubles per register; the byte mask
+//is sign-extended straight to 64-bit lanes.
+AGGREGATE_TARGET_AVX2
+static quint8 accumulateAvx2(const double *values, const quint8 *flags,
+	int count, quint8 valid, Accumulator &acc) {
+	const __m128i validBits = _mm_set1_epi8(char(valid));
+	const __m256d posInf = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+	const __m256d negInf = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+	__m128i seen = _mm_setzero_si128();
+	__m256d sum = _mm256_setzero_pd();
+	__m256d lo = posInf;
+	__m256d hi = negInf;
+	qint64 n = 0;
+
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i *>(flags + i));
+		seen = _mm_or_si128(seen, f);
+		__m128i m8 = _mm_cmpeq_epi8(_mm_and_si128(f, validBits), validBits);
+		n += qPopulationCount(quint32(_mm_movemask_epi8(m8)));
+
+		__m256d mask[4] = {
+			_mm256_castsi256_pd(_mm256_cvtepi8_epi64(m8)),
+			_mm256_castsi256_pd(_mm256_cvtepi8_epi64(_mm_srli_si128(m8, 4))),
+			_mm256_castsi256_pd(_mm256_cvtepi8_epi64(_mm_srli_si128(m8, 8))),
+			_mm256_castsi256_pd(_mm256_cvtepi8_epi64(_mm_srli_si128(m8, 12)))
+		};
+		for (int k = 0; k < 4; ++k) {
+			__m256d v = _mm256_loadu_pd(values + i + k * 4);
+			sum = _mm256_add_pd(sum, _mm256_and_pd(mask[k], v));
+			lo = _mm256_min_pd(lo, _mm256_blendv_pd(posInf, v, mask[k]));
+			hi = _mm256_max_pd(hi, _mm256_blendv_pd(negInf, v, mask[k]));
+		}
+	}
+
+	double sums[4], los[4], his[4];
+	_mm256_storeu_pd(sums, sum);
+	_mm256_storeu_pd(los, lo);
+	_mm256_storeu_pd(his, hi);
+	acc.sum += (sums[0] + sums[1]) + (sums[2] + sums[3]);
+	acc.min = qMin(acc.min, qMin(qMin(los[0], los[1]), qMin(los[2], los[3])));
+	acc.max = qMax(acc.max, qMax(qMax(his[0], his[1]), qMax(his[2], his[3])));
+	acc.count += n;
+
+	quint8 bytes[16];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(bytes), seen);
+	quint8 result = 0;
+	for (int k = 0; k < 16; ++k)
+		result |= bytes[k];
+	return result | accumulateScalar(values + i, flags + i, count - i, valid, acc);
+}
+
+static bool cpuHasAvx2() {
+#if defined(__GNUC__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	int info[4];
+	__cpuid(info, 1);
+	bool osSavesAvx = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+	__cpuidex(info, 7, 0);
+	return osSavesAvx && (info[1] & (1 << 5));
+#endif
+}
+#endif
+
+typedef quint8 (*Kernel)(const double *, const quint8 *, int, quint8, Accumulator &);
+
+static Kernel pickKernel() {
+#ifdef AGGREGATE_AVX2
+	if (cpuHasAvx2())
+		return accumulateAvx2;
+#endif
+#ifdef AGGREGATE_SSE2
+	return accumulateSse2;
+#else
+	return accumulateScalar;
+#endif
+}
+
+quint8 accumulateNumbers(const double *values, const quint8 *flags,
+	int count, quint8 valid, Accumulator &acc) {
+	static const Kernel kernel = pickKernel();
+	return kernel(values, flags, count, valid, acc);
+}
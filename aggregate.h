@@ -0,0 +1,28 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <qglobal.h>
+
+//Running state of SUM, AVERAGE, MIN, MAX and COUNT over any number of
+//arguments and ranges.
+struct Accumulator
+{
+	Accumulator();
+
+	void add(double value);
+
+	double sum;
+	double min;
+	double max;
+	qint64 count;
+	int errorRow;//The first error met in a range, -1 if none.
+	int errorColumn;
+};
+
+//Adds values[i] for every slot whose flags[i] has the valid bit set and
+//returns the OR of all flags seen, so callers can spot other states.
+//Runs with AVX2 or SSE2 when the CPU has them, with a scalar fallback.
+quint8 accumulateNumbers(const double *values, const quint8 *flags,
+	int count, quint8 valid, Accumulator &acc);
+
+#endif
@@ -0,0 +1,87 @@
+#include <qtconcurrentrun.h>
+
+#include "backgroundrecalc.h"
+#include "cell.h"
+#include "cellstore.h"
+#include "recalcengine.h"
+#include "tracelog.h"
+
+BackgroundRecalc::BackgroundRecalc(QObject *parent)
+	: QObject(parent) {
+	snapshot = 0;
+	progressTimer.setInterval(100);
+
+	connect(&progressTimer, SIGNAL(timeout()), this, SLOT(reportProgress()));
+	connect(&watcher, SIGNAL(finished()), this, SLOT(workerFinished()));
+}
+
+BackgroundRecalc::~BackgroundRecalc() {
+	delete stop();
+}
+
+//Takes ownership of the snapshot and evaluates its dirty cells.
+void BackgroundRecalc::start(CellStore *snapshot) {
+	Q_ASSERT(!isRunning());
+	this->snapshot = snapshot;
+	cancel.store(0);
+	done.store(0);
+	total.store(0);
+
+	watcher.setFuture(QtConcurrent::run(this, &BackgroundRecalc::run));
+	progressTimer.start();
+}
+
+//Cancels the pass and hands back its snapshot, and in cells, if given,
+//where the cells the pass took on are. Those it finished are clean in
+//the snapshot, the others still dirty. Returns 0 if nothing ran.
+CellStore *BackgroundRecalc::stop(QVector<CellRef> *cells) {
+	if (!isRunning())
+		return 0;
+
+	cancel.store(1);
+	watcher.waitForFinished();//The engine drains the current level and returns.
+	progressTimer.stop();
+
+	CellStore *result = snapshot;
+	snapshot = 0;
+	if (cells)
+		cells->swap(positions);
+	positions.clear();
+	emit progress(0, 0);
+	return result;
+}
+
+//Lets the pass run to its end; stop() then hands back a finished snapshot.
+void BackgroundRecalc::wait() {
+	watcher.waitForFinished();
+}
+
+//Runs in the worker thread. Blocks the snapshot hasn't decoded from a
+//mapped file hold no stale values; the engine loads those it needs.
+void BackgroundRecalc::run() {
+	TraceSpan span("recalculation pass");
+	QVector<Cell *> dirty;
+	snapshot->visitLoaded([this, &dirty](int row, int column, Cell *c) {
+		if (c && c->isDirty()) {
+			dirty.append(c);
+			CellRef ref = { row, column };
+			positions.append(ref);
+		}
+	});
+	total.store(dirty.size());
+
+	RecalcEngine(*snapshot, &cancel, &done, &total).evaluate(dirty, &positions);
+}
+
+void BackgroundRecalc::reportProgress() {
+	emit progress(done.load(), total.load());
+}
+
+void BackgroundRecalc::workerFinished() {
+	//A finished() queued by a pass stop() already took is stale.
+	if (!isRunning() || !watcher.isFinished() || cancel.load())
+		return;
+	progressTimer.stop();
+	emit progress(total.load(), total.load());
+	emit finished();
+}
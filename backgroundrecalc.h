@@ -0,0 +1,51 @@
+#ifndef BACKGROUNDRECALC_H
+#define BACKGROUNDRECALC_H
+
+#include <qatomic.h>
+#include <qfuturewatcher.h>
+#include <qobject.h>
+#include <qtimer.h>
+#include <qvector.h>
+
+#include "cellref.h"
+
+class CellStore;
+
+//Runs a RecalcEngine pass in a worker thread against a snapshot of the
+//sheet, so the GUI thread neither evaluates nor waits while it runs.
+//The owner stops the pass before every edit, publishes what it got,
+//and starts a new one on a fresh snapshot.
+class BackgroundRecalc : public QObject
+{
+	Q_OBJECT;
+
+public:
+	BackgroundRecalc(QObject *parent = 0);
+	~BackgroundRecalc();
+
+	bool isRunning() const { return snapshot != 0; }
+	void start(CellStore *snapshot);
+	CellStore *stop(QVector<CellRef> *cells = 0);
+	void wait();
+
+signals:
+	void progress(int done, int total);
+	void finished();
+
+private slots:
+	void reportProgress();
+	void workerFinished();
+
+private:
+	void run();
+
+	CellStore *snapshot;
+	QVector<CellRef> positions;//Of the cells the pass took on.
+	QFutureWatcher<void> watcher;
+	QTimer progressTimer;
+	QAtomicInt cancel;
+	QAtomicInt done;
+	QAtomicInt total;
+};
+
+#endif
@@ -0,0 +1,407 @@
+#include <algorithm>
+
+#include <qcommandlineparser.h>
+#include <qcoreapplication.h>
+#include <qdir.h>
+#include <qelapsedtimer.h>
+#include <qfile.h>
+#include <qjsonarray.h>
+#include <qjsondocument.h>
+#include <qjsonobject.h>
+#include <qtemporarydir.h>
+#include <qthread.h>
+#include <qthreadpool.h>
+
+#include "cellref.h"
+#include "delimitedfile.h"
+#include "searchindex.h"
+#include "spreadsheetcompare.h"
+#include "spreadsheetmodel.h"
+#include "tabseparatedtext.h"
+
+//Times the engine on synthetic sheets, headless, and writes the results
+//as JSON so runs of different releases can be compared:
+//  spreadsheetbench [--cells N] [--repeat R] [--threads T] [--dataset NAME]
+//                   [--baseline FILE] [--output FILE]
+//Each repeat pastes a fresh sheet, recalculates it on T pool threads and
+//again on one, steps through the matches of a search, sorts it on its
+//first column, writes it and reads it back, and does the same as CSV.
+
+namespace {
+
+enum {
+	DefaultCells = 1000000,
+	DefaultRepeat = 3,
+	FindSteps = 1000
+};
+
+int failures = 0;//Saves and loads that went wrong; the exit code tells.
+
+//A synthetic sheet: its shape, what each cell holds and a text that
+//turns up in a fair share of the cells.
+struct Dataset
+{
+	const char *name;
+	int rows;//0 for as many as --cells makes.
+	int columns;
+	QString (*field)(int row, int column);
+	const char *query;
+};
+
+QString denseNumber(int row, int column) {
+	return QString::number(double((row * 7919 + column * 104729) % 1000003) / 100, 'g', 15);
+}
+
+//Every column is one chain, each cell one more than the cell above.
+QString chainLink(int row, int column) {
+	if (row == 0)
+		return "1";
+	return '=' + CellRef::columnName(column) + QString::number(row) + "+1";
+}
+
+//Every cell reads A1, so editing A1 dirties the whole sheet.
+QString fanOut(int row, int column) {
+	if (row == 0 && column == 0)
+		return "1";
+	return "=A1*" + QString::number((row * 10 + column) % 97 + 1);
+}
+
+//Two columns of numbers with formulas filled down beside them, as a
+//sheet gets by dragging a formula down.
+QString filledDown(int row, int column) {
+	QString r = QString::number(row + 1);
+	switch (column) {
+	case 0:
+		return QString::number(row % 1000);
+	case 1:
+		return QString::number(row * 7 % 13 + 1);
+	case 2:
+		return "=A" + r + "*B" + r;
+	case 3:
+		return "=C" + r + "/B" + r + "-A" + r;
+	default:
+		return "=SUM(A" + r + ":D" + r + ")";
+	}
+}
+
+//Numbers down column A and across row 1; every other cell adds half the
+//cell above to the one on its left, and every tenth row sums the nine
+//above it.
+QString formulaSheet(int row, int column) {
+	if (row == 0 || column == 0)
+		return QString::number((row + 1) * (column + 1) % 100);
+	QString name = CellRef::columnName(column);
+	if (row % 10 == 9)
+		return "=SUM(" + name + QString::number(row - 8) + ':' + name + QString::number(row) + ')';
+	return '=' + CellRef::columnName(column - 1) + QString::number(row + 1)
+		+ '+' + name + QString::number(row) + "*0.5";
+}
+
+//Labels from a small vocabulary, with one unique text in ten.
+QString label(int row, int column) {
+	int n = row * 31 + column * 17;
+	if (n % 10 == 0)
+		return QString("item %1-%2").arg(row).arg(column);
+	return "label " + QString::number(n % 1000);
+}
+
+const Dataset datasets[] = {
+	{ "dense-numbers", 0, 10, denseNumber, "12" },
+	{ "long-chains", 0, 4, chainLink, "+1" },
+	{ "fan-out", 0, 10, fanOut, "A1*7" },
+	{ "fill-down", 0, 5, filledDown, "/B1" },
+	{ "string-heavy", 0, 10, label, "label 7" },
+	{ "formula-sheet", 999, 26, formulaSheet, "SUM(" }//The original 999 x 26 grid, full.
+};
+
+QString tabSeparated(const Dataset &dataset, int rows) {
+	QString text;
+	for (int row = 0; row < rows; ++row) {
+		for (int column = 0; column < dataset.columns; ++column) {
+			if (column > 0)
+				text += '\t';
+			text += dataset.field(row, column);
+		}
+		text += '\n';
+	}
+	return text;
+}
+
+//Milliseconds each repeat took, for one operation.
+class Timings
+{
+public:
+	void add(const QString &operation, qint64 nsecs) {
+		if (!times.contains(operation))
+			order.append(operation);
+		times[operation].append(nsecs / 1e6);
+	}
+
+	double median(const QString &operation) const {
+		QVector<double> ms = times.value(operation);
+		std::sort(ms.begin(), ms.end());
+		return ms.isEmpty() ? 0 : ms[ms.size() / 2];
+	}
+
+	QJsonObject toJson() const {
+		QJsonObject result;
+		foreach(const QString &operation, order) {
+			QVector<double> ms = times.value(operation);
+			std::sort(ms.begin(), ms.end());
+			double total = 0;
+			foreach(double t, ms)
+				total += t;
+			QJsonObject stats;
+			stats["min"] = ms.first();
+			stats["median"] = median(operation);
+			stats["mean"] = total / ms.size();
+			stats["max"] = ms.last();
+			result[operation] = stats;
+		}
+		return result;
+	}
+
+private:
+	QStringList order;
+	QHash<QString, QVector<double> > times;
+};
+
+QJsonObject run(const Dataset &dataset, int cells, int repeat, int threads,
+	const QDir &dir) {
+	int rows = dataset.rows;
+	if (rows == 0)
+		rows = qMax(2, qMin(cells / dataset.columns, int(CellRef::MaxRows)));
+	QString text = tabSeparated(dataset, rows);
+	QString fileName = dir.filePath(QString(dataset.name) + ".sp");
+	QString csvName = dir.filePath(QString(dataset.name) + ".csv");
+	qint64 csvBytes = 0;
+	CellRange all = { 0, 0, rows - 1, dataset.columns - 1 };
+	Timings timings;
+	QJsonObject usage;
+	int found = 0;
+	QElapsedTimer timer;
+
+	for (int r = 0; r < repeat; ++r) {
+		SpreadsheetModel model;
+		model.setAutoRecalculate(false);//Passes only run when timed.
+
+		timer.start();
+		TabSeparatedText(text).paste(model, 0, 0);
+		timings.add("paste", timer.nsecsElapsed());
+
+		timer.start();
+		model.recalculate();
+		model.finishRecalculation();
+		timings.add("recalculate", timer.nsecsElapsed());
+
+		//The same pass on one pool thread, to show what the others add.
+		QThreadPool::globalInstance()->setMaxThreadCount(1);
+		timer.start();
+		model.recalculate();
+		model.finishRecalculation();
+		timings.add("recalculateSingleThread", timer.nsecsElapsed());
+		QThreadPool::globalInstance()->setMaxThreadCount(threads);
+
+		if (r == 0) {
+			CellStore::Usage used = model.cells().usage();
+			int count = model.cells().count();
+			usage["cells"] = count;
+			usage["bytes"] = double(used.bytes);
+			usage["bytesPerCell"] = count ? double(used.bytes) / count : 0.0;
+			usage["allocations"] = double(used.allocations);
+		}
+
+		timer.start();
+		const SearchIndex &index = model.searchIndex();
+		timings.add("searchIndex", timer.nsecsElapsed());
+
+		timer.start();
+		CellRef at = { -1, -1 };
+		found = 0;
+		while (found < FindSteps && index.findNext(dataset.query, Qt::CaseInsensitive,
+			at.row, at.column, at))
+			++found;
+		timings.add("findNext", timer.nsecsElapsed());
+
+		SpreadsheetCompare compare;
+		compare.addKey(0, false);
+		timer.start();
+		model.sort(all, compare);
+		timings.add("sort", timer.nsecsElapsed());
+
+		timer.start();
+		bool written = model.startWriteFile(fileName);
+		timings.add("startWriteFile", timer.nsecsElapsed());//How long editing waits.
+		written = written && model.finishWriting();
+		timings.add("writeFile", timer.nsecsElapsed());
+		if (!written) {
+			qWarning("Cannot write %s", qPrintable(fileName));
+			++failures;
+		}
+
+		SpreadsheetModel loaded;
+		loaded.setAutoRecalculate(false);
+		timer.start();
+		if (loaded.readFile(fileName))
+			loaded.loadAll();//Mapped files decode lazily; time all of it.
+		timings.add("readFile", timer.nsecsElapsed());
+		if (loaded.cells().count() != model.cells().count()) {
+			qWarning("%s read back %d cells of %d", qPrintable(fileName),
+				loaded.cells().count(), model.cells().count());
+			++failures;
+		}
+
+		QFile csv(csvName);
+		timer.start();
+		bool exported = csv.open(QIODevice::WriteOnly)
+			&& DelimitedFile::write(csv, ',', model, DelimitedFile::Formulas);
+		csv.close();
+		timings.add("writeCsv", timer.nsecsElapsed());
+		if (!exported) {
+			qWarning("Cannot write %s", qPrintable(csvName));
+			++failures;
+		}
+		csvBytes = csv.size();
+
+		SpreadsheetModel imported;
+		imported.setAutoRecalculate(false);
+		timer.start();
+		if (csv.open(QIODevice::ReadOnly))
+			DelimitedFile::read(csv, ',', imported);
+		csv.close();
+		timings.add("readCsv", timer.nsecsElapsed());
+		if (imported.cells().count() != model.cells().count()) {
+			qWarning("%s read back %d cells of %d", qPrintable(csvName),
+				imported.cells().count(), model.cells().count());
+			++failures;
+		}
+	}
+	QFile::remove(fileName);
+	QFile::remove(csvName);
+
+	//Throughput of the median CSV run, in MB of file per second.
+	QJsonObject rates;
+	foreach(const QString &operation, QStringList() << "writeCsv" << "readCsv") {
+		double ms = timings.median(operation);
+		rates[operation] = ms > 0 ? csvBytes / 1e6 / (ms / 1e3) : 0.0;
+	}
+
+	QJsonObject result;
+	result["name"] = dataset.name;
+	result["rows"] = rows;
+	result["columns"] = dataset.columns;
+	result["memory"] = usage;
+	result["findNextSteps"] = found;
+	result["csvBytes"] = double(csvBytes);
+	result["megabytesPerSecond"] = rates;
+	result["msecs"] = timings.toJson();
+	return result;
+}
+
+//Puts the median of an earlier report next to each median of this one,
+//with how many times faster this run was, for the sheets and operations
+//both have. Reports of older builds may lack some.
+void compare(QJsonArray &results, const QJsonArray &baseline) {
+	for (int i = 0; i < results.size(); ++i) {
+		QJsonObject result = results[i].toObject();
+		QJsonObject before;
+		foreach(const QJsonValue &value, baseline) {
+			if (value.toObject().value("name") == result.value("name"))
+				before = value.toObject().value("msecs").toObject();
+		}
+		QJsonObject msecs = result.value("msecs").toObject();
+		foreach(const QString &operation, msecs.keys()) {
+			if (!before.contains(operation))
+				continue;
+			QJsonObject stats = msecs.value(operation).toObject();
+			double was = before.value(operation).toObject().value("median").toDouble();
+			double now = stats.value("median").toDouble();
+			stats["baselineMedian"] = was;
+			stats["speedup"] = now > 0 ? was / now : 0.0;
+			msecs[operation] = stats;
+		}
+		result["msecs"] = msecs;
+		results[i] = result;
+	}
+}
+
+}
+
+int main(int argc, char *argv[]) {
+	QCoreApplication app(argc, argv);
+	QCoreApplication::setApplicationName("spreadsheetbench");
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Times the spreadsheet engine on synthetic sheets.");
+	parser.addHelpOption();
+	QCommandLineOption cellsOption("cells", "Cells per sheet.", "N",
+		QString::number(DefaultCells));
+	QCommandLineOption repeatOption("repeat", "Runs per sheet.", "R",
+		QString::number(DefaultRepeat));
+	QCommandLineOption threadsOption("threads", "Pool threads for the recalculation.", "T",
+		QString::number(QThread::idealThreadCount()));
+	QCommandLineOption datasetOption("dataset", "Only run this sheet.", "NAME");
+	QCommandLineOption baselineOption("baseline",
+		"Compare with the JSON an earlier run wrote.", "FILE");
+	QCommandLineOption outputOption("output", "Write the JSON here, not to stdout.", "FILE");
+	parser.addOption(cellsOption);
+	parser.addOption(repeatOption);
+	parser.addOption(threadsOption);
+	parser.addOption(datasetOption);
+	parser.addOption(baselineOption);
+	parser.addOption(outputOption);
+	parser.process(app);
+
+	int cells = qMax(parser.value(cellsOption).toInt(), 2);
+	int repeat = qMax(parser.value(repeatOption).toInt(), 1);
+	int threads = qMax(parser.value(threadsOption).toInt(), 1);
+	QThreadPool::globalInstance()->setMaxThreadCount(threads);
+	QJsonObject baseline;
+	if (parser.isSet(baselineOption)) {
+		QFile in(parser.value(baselineOption));
+		if (in.open(QIODevice::ReadOnly))
+			baseline = QJsonDocument::fromJson(in.readAll()).object();
+		if (!baseline.contains("datasets")) {
+			qWarning("Cannot read %s", qPrintable(in.fileName()));
+			return 1;
+		}
+	}
+	QTemporaryDir dir;
+	if (!dir.isValid()) {
+		qWarning("Cannot create a temporary directory.");
+		return 1;
+	}
+
+	QJsonArray results;
+	for (size_t i = 0; i < sizeof(datasets) / sizeof(datasets[0]); ++i) {
+		if (parser.isSet(datasetOption) && parser.value(datasetOption) != datasets[i].name)
+			continue;
+		results.append(run(datasets[i], cells, repeat, threads, QDir(dir.path())));
+	}
+	if (!baseline.isEmpty())
+		compare(results, baseline.value("datasets").toArray());
+
+	QJsonObject report;
+	report["benchmark"] = "spreadsheetbench";
+	report["qtVersion"] = qVersion();
+	report["threads"] = threads;
+	report["idealThreads"] = QThread::idealThreadCount();
+	report["cells"] = cells;
+	report["repeat"] = repeat;
+	report["datasets"] = results;
+	QByteArray json = QJsonDocument(report).toJson();
+
+	QFile out;
+	if (parser.isSet(outputOption)) {
+		out.setFileName(parser.value(outputOption));
+		if (!out.open(QIODevice::WriteOnly)) {
+			qWarning("Cannot write %s", qPrintable(out.fileName()));
+			return 1;
+		}
+	}
+	else {
+		out.open(stdout, QIODevice::WriteOnly);
+	}
+	out.write(json);
+	return failures ? 1 : 0;
+}
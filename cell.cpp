@@ -1,219 +1,388 @@
+#include <qmutex.h>
+#include <qset.h>
+
 #include "cell.h"
+#include "cellstore.h"
+#include "evalprofiler.h"
+#include "formulapool.h"
 
-Cell::Cell() {
-	setDirty();
-}
+namespace {
+
+//Free cells are chained through their own storage. Slabs are kept
+//until the last cell is freed, then all given back at once.
+struct CellSlabs
+{
+	enum { SlabCells = 1024 };
+
+	CellSlabs() : freeList(0), live(0) {}
+
+	QMutex mutex;
+	QVector<char *> slabs;
+	void *freeList;
+	int live;
+};
 
-//When user use QTableWidget's Item, Item's function clone() will be called.
-//In spreadsheet.cpp, Item was translated into cell.
-//So cell's function clone will be called.
-QTableWidgetItem *Cell::clone() const {
-	return new Cell(*this);
 }
 
-void Cell::setData(int role, const QVariant &value) {
-	QTableWidgetItem::setData(role, value);
-	if (role == Qt::EditRole)
-		setDirty();
+static CellSlabs &cellSlabs() {
+	static CellSlabs slabs;
+	return slabs;
 }
 
-QVariant Cell::data(int role) const {
-	if (role == Qt::DisplayRole) { //If data's type is string(formular). 
-		if (value().isValid()) {//Function value() can charge data's type.
-			return value().toString();
-		}
-		else {
-			return "####";
-		}
-	}
-	else if (role == Qt::TextAlignmentRole) { //If data is alignment.
-		if (value().type() == QVariant::String) {
-			return int(Qt::AlignLeft | Qt::AlignVCenter);
-		}
-		else {
-			return int(Qt::AlignRight | Qt::AlignVCenter);
+void *Cell::operator new(size_t size) {
+	Q_ASSERT(size == sizeof(Cell));
+	Q_UNUSED(size);
+	CellSlabs &pool = cellSlabs();
+	QMutexLocker locker(&pool.mutex);
+	if (!pool.freeList) {
+		char *slab = static_cast<char *>(::operator new(CellSlabs::SlabCells * sizeof(Cell)));
+		pool.slabs.append(slab);
+		for (int i = CellSlabs::SlabCells - 1; i >= 0; --i) {
+			void *p = slab + i * sizeof(Cell);
+			*static_cast<void **>(p) = pool.freeList;
+			pool.freeList = p;
 		}
 	}
-	else {  // If data's type is double.
-		return QTableWidgetItem::data(role);
+	void *p = pool.freeList;
+	pool.freeList = *static_cast<void **>(p);
+	++pool.live;
+	return p;
+}
+
+void Cell::operator delete(void *p) {
+	if (!p)
+		return;
+	CellSlabs &pool = cellSlabs();
+	QMutexLocker locker(&pool.mutex);
+	*static_cast<void **>(p) = pool.freeList;
+	pool.freeList = p;
+	if (--pool.live == 0) {
+		foreach(char *slab, pool.slabs)
+			::operator delete(slab);
+		pool.slabs.clear();
+		pool.freeList = 0;
 	}
 }
 
-void Cell::setFormula(const QString &formula) {
-	setData(Qt::EditRole, formula);
+qint64 Cell::slabBytes() {
+	CellSlabs &pool = cellSlabs();
+	QMutexLocker locker(&pool.mutex);
+	return qint64(pool.slabs.size()) * CellSlabs::SlabCells * sizeof(Cell);
+}
+
+int Cell::slabCount() {
+	CellSlabs &pool = cellSlabs();
+	QMutexLocker locker(&pool.mutex);
+	return pool.slabs.size();
+}
+
+Cell::Cell() {
+	shared = 0;
+	row = 0;
+	column = 0;
+	number = 0;
+	flags = 0;
+}
+
+//The copy holds the formula too; it must be attached before use.
+Cell::Cell(const Cell &other)
+	: text(other.text), shared(other.shared), cachedValue(other.cachedValue),
+	row(other.row), column(other.column), number(other.number), flags(other.flags) {
+	if (shared)
+		shared->retain();
+}
+
+Cell::~Cell() {
+	if (shared)
+		shared->release();
+}
+
+//Binds the cell to its slot in a CellStore block. A copied cell must be
+//attached to its new slot before use.
+void Cell::attach(double *number, quint8 *flags) {
+	this->number = number;
+	this->flags = flags;
+}
+
+void Cell::setFormula(const QString &formula, int row, int column, FormulaPool &pool) {
+	this->row = row;
+	this->column = column;
+	const SharedFormula *old = shared;
+	if (formula.startsWith('=')) { //Compile once per sheet, not on every value().
+		shared = pool.intern(formula, row, column);
+		text = shared->text(row, column) == formula ? QString() : formula;
+		*flags |= CellStore::Dirty;
+	}
+	else { //Literals never change, and range scans read them raw.
+		shared = 0;
+		text = formula;
+		cache(literalValue());
+	}
+	if (old) //After interning, so a formula typed again isn't freed first.
+		old->release();
 }
 
 QString Cell::formula() const {
-	return data(Qt::EditRole).toString();
+	if (shared && text.isNull())
+		return shared->text(row, column);
+	return text;
+}
+
+//What the cell's own copy of its text takes up, header included; 0
+//when the shared formula stands in for it.
+qint64 Cell::textBytes() const {
+	if (text.isNull())
+		return 0;
+	return 24 + (text.size() + 1) * sizeof(QChar);
+}
+
+QVector<CellRef> Cell::references() const {
+	if (!shared)
+		return QVector<CellRef>();
+	return shared->program().references(row, column);
 }
 
+QVector<CellRange> Cell::rangeReferences() const {
+	if (!shared)
+		return QVector<CellRange>();
+	return shared->program().rangeReferences(row, column);
+}
+
+//Only formulas ever go stale; literal values are computed on entry.
 void Cell::setDirty() {
-	cachIsDirty = true;
+	if (isFormula())
+		*flags |= CellStore::Dirty;
 }
 
-const QVariant Invalid;
+//Kept in the slot's flags, so a snapshot can tell which blocks it
+//will write to without visiting the cells.
+bool Cell::isDirty() const {
+	return *flags & CellStore::Dirty;
+}
 
+//Stores a value computed elsewhere, e.g. by a background pass on a snapshot.
+void Cell::setValue(const QVariant &value) {
+	cache(value);
+}
 
-//Return data' value, which may be a double number or a string.
-QVariant Cell::value() const {
-	if (cachIsDirty) {
-		cachIsDirty = false;
+//Numbers go to the block's array, where range scans find them.
+//Only this cell writes its own slot, so workers need no lock.
+void Cell::cache(const QVariant &value) const {
+	*flags &= ~(CellStore::NumberValid | CellStore::Error | CellStore::Dirty);
+	if (value.type() == QVariant::Double) {
+		*number = value.toDouble();
+		*flags |= CellStore::NumberValid;
+		cachedValue = QVariant();
+	}
+	else {
+		if (FormulaError::isError(value))
+			*flags |= CellStore::Error;
+		cachedValue = value;
+	}
+}
 
-		QString formulaStr = formula();
-		if (formulaStr.startsWith('\'')) { //Data in form like'12.33900.
-			cachedValue = formulaStr.mid(1);
-		}
-		else if (formulaStr.startsWith('=')) { //Data may be a formular.
-			cachedValue = Invalid;
-			QString expr = formulaStr.mid(1);
-			expr.replace(" ", "");
-			expr.append(QChar::Null);
-
-			int pos = 0;
-			cachedValue = evalExpression(expr, pos); //Result's type should be double.
-			if (expr[pos] != QChar::Null) //Eval didn't go through the whole expression.
-				cachedValue = Invalid;
+//Resolves references through the store the cell belongs to.
+class StoreContext : public FormulaContext
+{
+public:
+	StoreContext(const CellStore &store) : store(store) {}
+
+	QVariant cellValue(int row, int column) const override {
+		if (store.contains(row, column)) {
+			return store.value(row, column);
 		}
-		else { //Data's type is double or string.
-			bool ok;
-			double d = formulaStr.toDouble(&ok);
-			if (ok) { //Data's type is double.
-				cachedValue = d;
-			}
-			else { // Data's type is string.
-				cachedValue = formulaStr;
-			}
+		else {
+			return 0.0;
 		}
 	}
-	return cachedValue;
-}
 
-QVariant Cell::evalExpression(const QString &str, int &pos) const {
-	QVariant result = evalTerm(str, pos); //Eval the firts term.
-	while (str[pos] != QChar::Null) {
-		QChar op = str[pos];
-		if (op != '+' && op != '-')
-			return result; 
-		++pos;
+	bool number(int row, int column, double &value) const override {
+		return store.number(row, column, value);
+	}
+
+	void aggregate(const CellRange &range, Accumulator &acc) const override {
+		store.aggregate(range, acc);
+	}
+
+private:
+	const CellStore &store;
+};
 
-		QVariant term = evalTerm(str, pos); //Eval the second term.
-		if (result.type() == QVariant::Double
-			&& term.type() == QVariant::Double) {
-			if (op == '+') {
-				result = result.toDouble() + term.toDouble();
+//Return data' value, which may be a double number or a string.
+QVariant Cell::value(const CellStore &store) const {
+	if (isDirty()) {
+		if (!shared->program().hasReferences()) {
+			if (EvalProfiler::isEnabled()) {
+				computeProfiled(store, EvalProfiler::now());
 			}
 			else {
-				result = result.toDouble() - term.toDouble();
+				computeValue(store);
 			}
 		}
 		else {
-			result = Invalid;
+			evaluateFormulas(store);
 		}
-	} //End while.
-	return result;
+	}
+	if (*flags & CellStore::NumberValid)
+		return *number;
+	return cachedValue;
 }
 
-QVariant Cell::evalTerm(const QString &str, int &pos) const {
-	QVariant result = evalFactor(str, pos); //Eval the first factor.
-	while (str[pos] != QChar::Null) {
-		QChar op = str[pos];
-		if (op != '*' && op != '/')
-			return result;
-		++pos;
+//The dirty formulas this cell reads, through references and ranges.
+//Range scans read the store's arrays directly, so every one of them
+//has to be computed first, even those without references.
+QVector<const Cell *> Cell::dirtyPrecedents(const CellStore &store) const {
+	QVector<const Cell *> result;
+	foreach(const CellRef &ref, references()) {
+		const Cell *c = store.cell(ref.row, ref.column);
+		if (c && c->isDirty())
+			result.append(c);
+	}
+	foreach(const CellRange &range, rangeReferences()) {
+		store.visit(range.top, range.left, range.bottom, range.right,
+			[&result](int, int, const Cell *c) {
+			if (c && c->isDirty())
+				result.append(c);
+		});
+	}
+	return result;
+}
 
-		QVariant factor = evalFactor(str, pos);//Eval the second factor.
-		if (result.type() == QVariant::Double
-			&& factor.type() == QVariant::Double) {
-			if (op == '*') {
-				result = result.toDouble() * factor.toDouble();
+//Evaluates this cell after every dirty formula it reads, precedents first.
+//The walk keeps its own stack, so a reference chain of any length needs
+//constant native stack. A reference back into the walk is a cycle:
+//every cell on it gets a FormulaError instead of a value.
+void Cell::evaluateFormulas(const CellStore &store) const {
+	struct Frame
+	{
+		const Cell *cell;
+		QVector<const Cell *> precedents;
+		int next;//The next precedent to visit.
+		qint64 started;//For the profiler's inclusive time.
+	};
+
+	bool profiling = EvalProfiler::isEnabled();
+	QVector<Frame> stack;
+	QSet<const Cell *> onStack;
+	Frame start = { this, dirtyPrecedents(store), 0, profiling ? EvalProfiler::now() : 0 };
+	stack.append(start);
+	onStack.insert(this);
+
+	while (!stack.isEmpty()) {
+		Frame &frame = stack.last();
+		const Cell *precedent = 0;
+
+		while (frame.next < frame.precedents.size()) {
+			const Cell *c = frame.precedents[frame.next++];
+			if (!c->isDirty())
+				continue;//Computed since the frame was pushed.
+
+			if (onStack.contains(c)) {
+				QVariant error = FormulaError::make(FormulaError::Cycle);
+				for (int i = stack.size() - 1; i >= 0; --i) {
+					stack[i].cell->cache(error);
+					if (stack[i].cell == c)
+						break;
+				}
+				continue;
 			}
-			else {
-				if (factor.toDouble() == 0.0) {
-					result == Invalid;
+			precedent = c;
+			break;
+		}
+
+		if (precedent) {
+			Frame next = { precedent, precedent->dirtyPrecedents(store), 0,
+				profiling ? EvalProfiler::now() : 0 };
+			stack.append(next);//Invalidates frame.
+			onStack.insert(precedent);
+		}
+		else {
+			const Cell *c = frame.cell;
+			qint64 started = frame.started;
+			stack.removeLast();
+			onStack.remove(c);
+			if (c->isDirty()) { //Cells on a cycle already hold their error.
+				if (profiling) {
+					c->computeProfiled(store, started);
 				}
 				else {
-					result = result.toDouble() / factor.toDouble();
+					c->computeValue(store);
 				}
 			}
 		}
-		else {
-			result = Invalid;
-		}
-	}//End while.
-	return result;
+	}
 }
 
-QVariant Cell::evalFactor(const QString &str, int &pos) const {
-	QVariant result;
-	bool negetive = false;
+//Computes the value from the formula; formula operands must be up to date,
+//so the references read through StoreContext never recurse further.
+void Cell::computeValue(const CellStore &store) const {
+	*flags &= ~CellStore::Dirty;
 
-	if (str[pos] == '-') {
-		negetive = true;
-		++pos;
-	}
-
-	if (str[pos] == '(') {
-		++pos;
-		result = evalExpression(str, pos);
-		if (str[pos] != ')')
-			result = Invalid;
-		++pos;
+	if (isFormula()) { //Data may be a formular.
+		cache(shared->program().evaluate(StoreContext(store), row, column));
 	}
 	else {
-		QRegExp regExp("[A-Za-z][1-9][0-9]{0,2}");
-		QString token;
+		cache(literalValue());
+	}
+}
 
-		while (str[pos].isLetterOrNumber() || str[pos] == '.') {
-			token += str[pos];
-			++pos;
-		}
+//computeValue() with its time charged to the cell: exclusive from
+//here, inclusive from walkStarted, when the walk that computed the
+//cell's precedents for it began.
+void Cell::computeProfiled(const CellStore &store, qint64 walkStarted) const {
+	qint64 started = EvalProfiler::now();
+	computeValue(store);
+	qint64 finished = EvalProfiler::now();
+	EvalProfiler::record(this, finished - qMin(walkStarted, started), finished - started);
+}
 
-		if (regExp.exactMatch(token)) { //If the factor is a positon.
-			int column = token[0].toUpper().unicode() - 'A';
-			int row = token.mid(1).toInt() - 1;
+//Computes cells sharing one formula together, Formula::Lanes at a
+//time. Lanes the shared program can't finish, and all cells of a
+//program that isn't plain arithmetic, go through computeValue().
+void Cell::computeLanes(const CellStore &store, Cell *const *cells, int count) {
+	const Formula &program = cells[0]->shared->program();
+	if (!program.isArithmetic()) {
+		for (int i = 0; i < count; ++i)
+			cells[i]->computeValue(store);
+		return;
+	}
 
-			Cell *c = static_cast<Cell *>(
-				tableWidget()->item(row, column));
-			if (c) {
-				result = c->value();
+	StoreContext context(store);
+	int rows[Formula::Lanes];
+	int columns[Formula::Lanes];
+	double results[Formula::Lanes];
+	bool done[Formula::Lanes];
+	for (int first = 0; first < count; first += Formula::Lanes) {
+		int lanes = qMin(count - first, int(Formula::Lanes));
+		for (int l = 0; l < lanes; ++l) {
+			rows[l] = cells[first + l]->row;
+			columns[l] = cells[first + l]->column;
+		}
+		program.evaluateLanes(context, rows, columns, lanes, results, done);
+		for (int l = 0; l < lanes; ++l) {
+			const Cell *c = cells[first + l];
+			if (done[l]) {
+				c->cache(results[l]);
 			}
 			else {
-				result = 0.0;
+				c->computeValue(store);
 			}
 		}
-		else { // If the factor may be a number.
-			bool ok;
-			result = token.toDouble(&ok);
-			if (!ok) 
-				result = Invalid;
-		}
 	}
-	if (negetive) {
-		if (result.type() == QVariant::Double) {
-			result = -result.toDouble();
+}
+
+QVariant Cell::literalValue() const {
+	if (text.startsWith('\'')) { //Data in form like'12.33900.
+		return text.mid(1);
+	}
+	else { //Data's type is double or string.
+		bool ok;
+		double d = text.toDouble(&ok);
+		if (ok) { //Data's type is double.
+			return d;
 		}
-		else {
-			result = Invalid;
+		else { // Data's type is string.
+			return text;
 		}
 	}
-	return result;
 }
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
@@ -1,30 +1,70 @@
 #ifndef CELL_H
 #define CELL_H
 
-#include <qtablewidget.h>
+#include <qstring.h>
+#include <qvariant.h>
 
-class Cell : public QTableWidgetItem
+#include "formula.h"
+
+class CellStore;
+class FormulaPool;
+class SharedFormula;
+
+//A formula cell, or a literal whose text a number doesn't reproduce
+//("1.50"): the text the user typed, its compiled formula and the cached
+//value. Numeric values are cached in the slot of the CellStore block
+//the cell is attached to, other values here, and so is whether the
+//value is stale. Plain text needs no Cell.
+//Formulas are shared with every cell holding the same one relative to
+//its position, as a filled-down column does; such a cell keeps its
+//text only if the shared form doesn't reproduce it ("=a1 + 1").
+class Cell
 {//Why all const?
 public:
 	Cell();
+	Cell(const Cell &other);
+	~Cell();
 
-	QTableWidgetItem *clone() const override;
-	void setData(int role, const QVariant &value) override;
-	QVariant data(int role) const override;
-	void setFormula(const QString &formula);
+	void attach(double *number, quint8 *flags);
+	void setFormula(const QString &formula, int row, int column, FormulaPool &pool);
 	QString formula() const;
+	qint64 textBytes() const;
+	bool isFormula() const { return shared != 0; }
+	QVector<CellRef> references() const;
+	QVector<CellRange> rangeReferences() const;
 	void setDirty();
+	bool isDirty() const;
+	void setValue(const QVariant &value);
+	QVariant value(const CellStore &store) const;
+
+	//Cells come from shared slabs, not one heap block each.
+	static void *operator new(size_t size);
+	static void operator delete(void *p);
+	static qint64 slabBytes();
+	static int slabCount();
 
 private:
-	QVariant value() const;
-	QVariant evalExpression(const QString &str, int &pos) const;
-	QVariant evalTerm(const QString &str, int &pos) const;
-	QVariant evalFactor(const QString &str, int &pos) const;
+	friend class RecalcEngine;
+
+	Cell &operator=(const Cell &);//Not implemented; a cell is copied into a new slot only.
+
+	QVector<const Cell *> dirtyPrecedents(const CellStore &store) const;
+	void evaluateFormulas(const CellStore &store) const;
+	void computeValue(const CellStore &store) const;
+	void computeProfiled(const CellStore &store, qint64 walkStarted) const;
+	static void computeLanes(const CellStore &store, Cell *const *cells, int count);
+	QVariant literalValue() const;
+	void cache(const QVariant &value) const;
 
-	mutable QVariant cachedValue;
-	mutable bool cachIsDirty;
+	QString text;//Null for a formula its shared form reproduces.
+	const SharedFormula *shared;//Found by setFormula(), run by value().
+	mutable QVariant cachedValue;//Non-numeric values only.
+	int row;//Where the formula's relative references start from.
+	int column;
+	double *number;//The block slot numeric values go to.
+	quint8 *flags;
 };
 
 
 
-#endif
\ No newline at end of file
+#endif
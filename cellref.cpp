@@ -0,0 +1,42 @@
+#include "cellref.h"
+
+QString CellRef::toString() const {
+	return columnName(column) + QString::number(row + 1);
+}
+
+//0 is "A", 25 is "Z", 26 is "AA" and so on.
+QString CellRef::columnName(int column) {
+	QString name;
+	for (int n = column + 1; n > 0; n = (n - 1) / 26)
+		name.prepend(QChar('A' + (n - 1) % 26));
+	return name;
+}
+
+//Letters name the column and digits the row, with no leading zero.
+bool CellRef::parse(const QString &text, CellRef &ref) {
+	int length = text.length();
+	int pos = 0;
+	int column = 0;
+	while (pos < length && pos < 3) {
+		QChar letter = text[pos].toUpper();
+		if (letter < 'A' || letter > 'Z')
+			break;
+		column = column * 26 + (letter.unicode() - 'A' + 1);
+		++pos;
+	}
+	if (pos == 0 || pos == length || text[pos] == '0' || length - pos > 7)
+		return false;
+
+	int row = 0;
+	for (; pos < length; ++pos) {
+		if (text[pos] < '0' || text[pos] > '9')
+			return false;
+		row = row * 10 + (text[pos].unicode() - '0');
+	}
+	if (column > MaxColumns || row > MaxRows)
+		return false;
+
+	ref.row = row - 1;
+	ref.column = column - 1;
+	return true;
+}
@@ -0,0 +1,36 @@
+#ifndef CELLREF_H
+#define CELLREF_H
+
+#include <qmetatype.h>
+#include <qstring.h>
+
+//A cell position, written "A1" up to "XFD1048576".
+struct CellRef
+{
+	enum { MaxRows = 1048576, MaxColumns = 16384 };
+
+	int row;
+	int column;
+
+	QString toString() const;
+
+	static QString columnName(int column);
+	static bool parse(const QString &text, CellRef &ref);
+};
+
+Q_DECLARE_METATYPE(CellRef)
+
+//A rectangle of cells, written "A1:B10"; the corners are inclusive.
+struct CellRange
+{
+	int top;
+	int left;
+	int bottom;
+	int right;
+
+	bool contains(int row, int column) const {
+		return row >= top && row <= bottom && column >= left && column <= right;
+	}
+};
+
+#endif
@@ -0,0 +1,653 @@
+#include <string.h>
+
+#include <qfileinfo.h>
+#include <qtconcurrentmap.h>
+
+#include "aggregate.h"
+#include "cell.h"
+#include "cellstore.h"
+#include "formulapool.h"
+#include "mappedsheet.h"
+
+CellStore::CellStore()
+	: strings(new StringPool), formulas(new FormulaPool) {
+	cellCount = 0;
+	listener = 0;
+}
+
+//For snapshots, which share the pools of the store they copy.
+CellStore::CellStore(const QSharedPointer<StringPool> &strings,
+	const QSharedPointer<FormulaPool> &formulas)
+	: strings(strings), formulas(formulas) {
+	cellCount = 0;
+	listener = 0;
+}
+
+CellStore::~CellStore() {
+	clear();
+}
+
+//Decodes the block first if it is still in the mapped file.
+const CellStore::Block *CellStore::block(int row, int column) const {
+	if (column < 0 || row < 0)
+		return 0;
+	for (bool loadTried = false; ; loadTried = true) {
+		if (column < columns.size()) {
+			const Column *col = columns[column];
+			int b = row / BlockSize;
+			if (col && b < col->blocks.size() && col->blocks[b])
+				return col->blocks[b];
+		}
+		if (!mapped || loadTried)
+			return 0;
+		load(row, column, row, column);
+	}
+}
+
+bool CellStore::contains(int row, int column) const {
+	const Block *b = block(row, column);
+	return b && (b->flags[row % BlockSize] & Occupied);
+}
+
+//A plain number, which has no text of its own to keep.
+bool CellStore::isNumber(int row, int column) const {
+	const Block *b = block(row, column);
+	int i = row % BlockSize;
+	return b && (b->flags[i] & Occupied) && !(b->flags[i] & Text)
+		&& !(b->cells && b->cells[i]);
+}
+
+//The side-table entry of a formula cell; 0 for plain numbers and text.
+Cell *CellStore::cell(int row, int column) const {
+	const Block *b = block(row, column);
+	return b && b->cells ? b->cells[row % BlockSize] : 0;
+}
+
+//As cell(), for changing it: a block shared with a snapshot is copied
+//first, so the snapshot keeps what it had.
+Cell *CellStore::writableCell(int row, int column) {
+	if (!cell(row, column))
+		return 0;
+	return writableSlot(row, column)->cells[row % BlockSize];
+}
+
+QString CellStore::formula(int row, int column) const {
+	const Block *b = block(row, column);
+	int i = row % BlockSize;
+	if (!b || !(b->flags[i] & Occupied))
+		return "";
+	if (b->flags[i] & Text) {
+		const QString &text = strings->text(textId(b, i));
+		return b->flags[i] & Quoted ? '\'' + text : text;
+	}
+	if (b->cells && b->cells[i])
+		return b->cells[i]->formula();
+	return QString::number(b->numbers[i], 'g', 15);
+}
+
+//The slot's number for formulas that only do arithmetic; empty slots
+//read as 0. False for text, errors, other values and formulas not yet
+//computed: those take the slower way through value().
+bool CellStore::number(int row, int column, double &value) const {
+	const Block *b = block(row, column);
+	int i = row % BlockSize;
+	if (!b || !(b->flags[i] & Occupied)) {
+		value = 0.0;
+		return true;
+	}
+	if ((b->flags[i] & (NumberValid | Dirty)) != NumberValid)
+		return false;
+	value = b->numbers[i];
+	return true;
+}
+
+//Evaluates a dirty formula on the way. Empty slots give an invalid QVariant.
+QVariant CellStore::value(int row, int column) const {
+	const Block *b = block(row, column);
+	int i = row % BlockSize;
+	if (!b || !(b->flags[i] & Occupied))
+		return QVariant();
+	if (b->flags[i] & Text)
+		return strings->text(textId(b, i));
+	if (b->cells && b->cells[i])
+		return b->cells[i]->value(*this);
+	return b->numbers[i];
+}
+
+CellStore::Block *CellStore::findOrCreateBlock(int row, int column) {
+	block(row, column);//A block from the mapped file is decoded before it changes.
+	Block *&b = writableSlot(row, column);
+	if (!b)
+		b = newBlock();
+	return b;
+}
+
+//The column, created if need be, and copied first if a snapshot
+//shares it. The copy shares the blocks in turn.
+CellStore::Column *CellStore::writableColumn(int column) {
+	Q_ASSERT(column >= 0 && column < CellRef::MaxColumns);
+
+	if (column >= columns.size())
+		columns.resize(column + 1);
+	Column *&col = columns[column];
+	if (!col) {
+		col = new Column;
+		col->count = 0;
+		col->ref.store(1);
+	}
+	else if (col->ref.load() > 1) {
+		Column *copy = new Column;
+		copy->blocks = col->blocks;
+		copy->count = col->count;
+		copy->ref.store(1);
+		foreach(Block *block, copy->blocks) {
+			if (block)
+				block->ref.ref();
+		}
+		releaseColumn(col, strings.data());
+		col = copy;
+	}
+	return col;
+}
+
+//The slot of the block holding the row, in a column and a block that
+//no snapshot shares. The slot may be empty.
+CellStore::Block *&CellStore::writableSlot(int row, int column) {
+	Q_ASSERT(row >= 0 && row < CellRef::MaxRows);
+
+	Column *col = writableColumn(column);
+	int b = row / BlockSize;
+	if (b >= col->blocks.size())
+		col->blocks.resize(b + 1);
+	Block *&slot = col->blocks[b];
+	if (slot && slot->ref.load() > 1) {
+		Block *copy = copyBlock(slot, strings.data());
+		freeBlock(slot, strings.data());
+		slot = copy;
+	}
+	return slot;
+}
+
+CellStore::Block *CellStore::newBlock() {
+	Block *block = new Block;
+	memset(block->flags, 0, sizeof(block->flags));
+	block->cells = 0;
+	block->count = 0;
+	block->ref.store(1);
+	return block;
+}
+
+//Decodes the mapped blocks inside the rectangle that aren't yet, on the
+//thread pool when there are several.
+//Only the GUI thread loads into the live store, and a worker only into
+//its own snapshot, before its evaluation fans out.
+void CellStore::load(int top, int left, int bottom, int right) const {
+	if (!mapped)
+		return;
+	CellStore *self = const_cast<CellStore *>(this);//Loading doesn't change what the store holds.
+	int firstBlock = qMax(top, 0) / BlockSize;
+	int lastBlock = bottom / BlockSize;
+	QVector<DecodedBlock> pending;
+	int i = mapped->lowerBound(qMax(left, 0), firstBlock);
+	while (i < mapped->blockCount()) {
+		int column = mapped->column(i);
+		if (column > right)
+			break;
+		if (mapped->block(i) > lastBlock) { //Skip to the next column.
+			i = mapped->lowerBound(column + 1, firstBlock);
+			continue;
+		}
+		if (!loaded.testBit(i)) {
+			DecodedBlock decoded = { i, 0 };
+			pending.append(decoded);
+		}
+		++i;
+	}
+
+	const MappedSheet *sheet = mapped.data();
+	StringPool *pool = strings.data();
+	FormulaPool *formulaPool = formulas.data();
+	if (pending.size() == 1) {
+		pending[0].block = decodeBlock(*sheet, pending[0].index, *pool, *formulaPool);
+	}
+	else if (pending.size() > 1) {
+		QtConcurrent::blockingMap(pending, [sheet, pool, formulaPool](DecodedBlock &decoded) {
+			decoded.block = decodeBlock(*sheet, decoded.index, *pool, *formulaPool);
+		});
+	}
+	foreach(const DecodedBlock &decoded, pending)
+		self->installBlock(decoded.index, decoded.block);
+}
+
+//Decodes a block of the mapped file into a new Block, or 0 if nothing
+//in it survives. Only the new block and the locked pools are touched,
+//so any thread can.
+CellStore::Block *CellStore::decodeBlock(const MappedSheet &sheet, int index,
+	StringPool &pool, FormulaPool &formulaPool) {
+	Block *block = newBlock();
+	int top = sheet.block(index) * BlockSize;
+	int column = sheet.column(index);
+	sheet.readBlock(index, [block](int i, double number) {
+		if (block->flags[i] & Occupied)
+			return;
+		block->numbers[i] = number;
+		block->flags[i] = Occupied | NumberValid;
+		++block->count;
+	}, [block, &pool, &formulaPool, top, column](int i, const QString &text) {
+		if (block->flags[i] & Occupied)
+			return;
+		bool isNumber;
+		text.toDouble(&isNumber);
+		if (storeText(block, i, text, isNumber, pool)) {
+			++block->count;
+			return;
+		}
+		if (!block->cells) {
+			block->cells = new Cell *[BlockSize];
+			memset(block->cells, 0, BlockSize * sizeof(Cell *));
+		}
+		Cell *c = new Cell;
+		c->attach(&block->numbers[i], &block->flags[i]);
+		block->flags[i] = Occupied;
+		c->setFormula(text, top + i, column, formulaPool);
+		block->cells[i] = c;
+		++block->count;
+	});
+	if (block->count == 0) {
+		freeBlock(block, &pool);
+		return 0;
+	}
+	return block;
+}
+
+//Puts a decoded block in its place and hands its formulas to the listener.
+void CellStore::installBlock(int index, Block *block) {
+	loaded.setBit(index);
+	cellCount -= mapped->count(index);//Damaged blocks decode short.
+	if (!block)
+		return;
+	int column = mapped->column(index);
+	int top = mapped->block(index) * BlockSize;
+	if (column < 0 || column >= CellRef::MaxColumns || top < 0 || top >= CellRef::MaxRows) {
+		freeBlock(block, strings.data());
+		return;
+	}
+
+	Block *&slot = writableSlot(top, column);
+	if (slot) { //A damaged index lists the block twice.
+		freeBlock(block, strings.data());
+		return;
+	}
+	slot = block;
+	cellCount += block->count;
+	columns[column]->count += block->count;
+	for (int i = 0; listener && block->cells && i < BlockSize; ++i) {
+		if (block->cells[i] && block->cells[i]->isFormula())
+			listener->cellLoaded(top + i, column, block->cells[i]);
+	}
+}
+
+//Takes over a freshly opened file. The store must be empty.
+void CellStore::map(const QSharedPointer<const MappedSheet> &sheet) {
+	Q_ASSERT(cellCount == 0);
+	mapped = sheet;
+	loaded = QBitArray(sheet->blockCount());
+	cellCount = int(sheet->cellCount());
+}
+
+bool CellStore::isMappedFrom(const QString &fileName) const {
+	return mapped && QFileInfo(mapped->fileName()) == QFileInfo(fileName);
+}
+
+//Decodes every block and lets go of the mapped file, e.g. before the
+//file is written over.
+void CellStore::loadAll() {
+	load(0, 0, CellRef::MaxRows - 1, CellRef::MaxColumns - 1);
+	mapped.clear();
+	loaded.clear();
+}
+
+//Claims the slot for a new value; the caller fills it in.
+CellStore::Block *CellStore::occupy(int row, int column) {
+	Block *block = findOrCreateBlock(row, column);
+	int i = row % BlockSize;
+	if (!(block->flags[i] & Occupied)) {
+		++block->count;
+		++columns[column]->count;
+		++cellCount;
+	}
+	else if (block->flags[i] & Text) {
+		strings->release(textId(block, i));
+	}
+	block->flags[i] = Occupied;
+	return block;
+}
+
+//Text that a number reproduces exactly is stored as that number only,
+//and text that isn't a number or a formula as an interned string;
+//anything else ("1.50", "=A1") keeps its text in a Cell.
+//Returns the Cell, or 0 for a plain number or text.
+const Cell *CellStore::setFormula(int row, int column, const QString &formula) {
+	bool ok;
+	double number = formula.toDouble(&ok);
+	if (ok && QString::number(number, 'g', 15) == formula) {
+		setNumber(row, column, number);
+		return 0;
+	}
+
+	Block *block = occupy(row, column);
+	int i = row % BlockSize;
+	if (storeText(block, i, formula, ok, *strings)) {
+		if (block->cells) {
+			delete block->cells[i];
+			block->cells[i] = 0;
+		}
+		return 0;
+	}
+	if (!block->cells) {
+		block->cells = new Cell *[BlockSize];
+		memset(block->cells, 0, BlockSize * sizeof(Cell *));
+	}
+	Cell *&c = block->cells[i];
+	if (!c) {
+		c = new Cell;
+		c->attach(&block->numbers[i], &block->flags[i]);
+	}
+	c->setFormula(formula, row, column, *formulas);
+	return c;
+}
+
+//Keeps a literal that evaluates to text as its id in the pool: "'12"
+//and "N/A" do, "1.50" and "=A1" don't, and nothing does once the pool
+//is full. The slot must be occupied and hold no Cell or text, or have
+//its Cell freed by the caller.
+bool CellStore::storeText(Block *block, int i, const QString &formula, bool isNumber,
+	StringPool &pool) {
+	quint8 flags = Occupied | Text;
+	quint64 id;
+	if (formula.startsWith('\'')) {
+		id = pool.intern(formula.mid(1));
+		flags |= Quoted;
+	}
+	else if (!isNumber && !formula.startsWith('=')) {
+		id = pool.intern(formula);
+	}
+	else {
+		return false;
+	}
+	if (id == StringPool::NoId)
+		return false;
+	memcpy(&block->numbers[i], &id, sizeof(id));
+	block->flags[i] = flags;
+	return true;
+}
+
+quint32 CellStore::textId(const Block *block, int i) {
+	quint64 id;
+	memcpy(&id, &block->numbers[i], sizeof(id));
+	return quint32(id);
+}
+
+//Stores a plain number, e.g. one an importer has already parsed.
+void CellStore::setNumber(int row, int column, double number) {
+	Block *block = occupy(row, column);
+	int i = row % BlockSize;
+	if (block->cells) {
+		delete block->cells[i];
+		block->cells[i] = 0;
+	}
+	block->numbers[i] = number;
+	block->flags[i] |= NumberValid;
+}
+
+//Frees the cell, and its block and column once they are empty.
+void CellStore::remove(int row, int column) {
+	if (!contains(row, column))
+		return;
+
+	Block *&block = writableSlot(row, column);
+	Column *&col = columns[column];
+	int i = row % BlockSize;
+	if (block->cells) {
+		delete block->cells[i];
+		block->cells[i] = 0;
+	}
+	if (block->flags[i] & Text)
+		strings->release(textId(block, i));
+	block->flags[i] = 0;
+	--cellCount;
+
+	if (--block->count == 0) {
+		freeBlock(block, strings.data());
+		block = 0;
+	}
+	if (--col->count == 0) {
+		releaseColumn(col, strings.data());
+		col = 0;
+	}
+}
+
+//Texts are released even though the pool goes with the cells: a
+//snapshot's pool is the live store's.
+void CellStore::clear() {
+	foreach(Column *col, columns)
+		releaseColumn(col, strings.data());
+	columns.clear();
+	cellCount = 0;
+	if (strings->count() > 0) //Texts of the old sheet go with it.
+		strings = QSharedPointer<StringPool>(new StringPool);
+	if (formulas->count() > 0) //So do its formulas.
+		formulas = QSharedPointer<FormulaPool>(new FormulaPool);
+	mapped.clear();
+	loaded.clear();
+}
+
+//Lets go of the block; the last store holding it frees it, on
+//whichever thread that store goes away, and releases its texts.
+void CellStore::freeBlock(Block *block, StringPool *pool) {
+	if (!block || block->ref.deref())
+		return;
+	for (int i = 0; i < BlockSize; ++i) {
+		if (block->flags[i] & Text)
+			pool->release(textId(block, i));
+	}
+	if (block->cells) {
+		for (int i = 0; i < BlockSize; ++i)
+			delete block->cells[i];
+		delete[] block->cells;
+	}
+	delete block;
+}
+
+void CellStore::releaseColumn(Column *col, StringPool *pool) {
+	if (!col || col->ref.deref())
+		return;
+	foreach(Block *block, col->blocks)
+		freeBlock(block, pool);
+	delete col;
+}
+
+//Cells copied into the new block are attached to its own arrays, and
+//its texts hold references of their own.
+CellStore::Block *CellStore::copyBlock(const Block *block, StringPool *pool) {
+	Block *copy = new Block;
+	memcpy(copy->numbers, block->numbers, sizeof(block->numbers));
+	memcpy(copy->flags, block->flags, sizeof(block->flags));
+	copy->count = block->count;
+	copy->ref.store(1);
+	copy->cells = 0;
+	for (int i = 0; i < BlockSize; ++i) {
+		if (block->flags[i] & Text)
+			pool->retain(textId(block, i));
+	}
+	if (block->cells) {
+		copy->cells = new Cell *[BlockSize];
+		for (int i = 0; i < BlockSize; ++i) {
+			copy->cells[i] = 0;
+			if (block->cells[i]) {
+				copy->cells[i] = new Cell(*block->cells[i]);
+				copy->cells[i]->attach(&copy->numbers[i], &copy->flags[i]);
+			}
+		}
+	}
+	return copy;
+}
+
+//Whether evaluating will write to the block: only stale formulas get
+//new values.
+bool CellStore::hasDirtyFormulas(const Block *block) {
+	if (!block->cells)
+		return false;
+	for (int i = 0; i < BlockSize; ++i) {
+		if (block->flags[i] & Dirty)
+			return true;
+	}
+	return false;
+}
+
+//A copy another thread can read, and evaluate, while this store keeps
+//changing. Columns and blocks are shared, not copied: whichever store
+//changes a shared one first copies it for itself, and the last store
+//holding it frees it, so readers never take a lock. Blocks with stale
+//formulas are the exception. Both sides may evaluate those, so the
+//copy gets its own right away.
+//The cost follows the columns and the blocks that hold formulas, not
+//the cells.
+CellStore *CellStore::snapshot() const {
+	//Ids stay valid, and reads need no lock; the copied cells point into
+	//the formula pool.
+	CellStore *copy = new CellStore(strings, formulas);
+	copy->columns.resize(columns.size());
+	for (int column = 0; column < columns.size(); ++column) {
+		Column *col = columns[column];
+		if (!col)
+			continue;
+		bool dirty = false;
+		for (int b = 0; b < col->blocks.size() && !dirty; ++b)
+			dirty = col->blocks[b] && hasDirtyFormulas(col->blocks[b]);
+		if (!dirty) {
+			col->ref.ref();
+			copy->columns[column] = col;
+			continue;
+		}
+
+		Column *colCopy = new Column;
+		colCopy->count = col->count;
+		colCopy->ref.store(1);
+		colCopy->blocks.resize(col->blocks.size());
+		for (int b = 0; b < col->blocks.size(); ++b) {
+			Block *block = col->blocks[b];
+			if (!block)
+				continue;
+			if (hasDirtyFormulas(block)) {
+				colCopy->blocks[b] = copyBlock(block, strings.data());
+			}
+			else {
+				block->ref.ref();
+				colCopy->blocks[b] = block;
+			}
+		}
+		copy->columns[column] = colCopy;
+	}
+	copy->cellCount = cellCount;
+	copy->mapped = mapped;//Immutable, so threads can share it.
+	copy->loaded = loaded;
+	return copy;
+}
+
+//Counts blocks, side tables, columns, the slabs Cells are taken from,
+//the interned texts and the shared formulas. Slabs are shared by every
+//store, snapshots included.
+CellStore::Usage CellStore::usage() const {
+	Usage result = { qint64(sizeof(*this)), 0 };
+	result.bytes += columns.capacity() * sizeof(Column *);
+	result.allocations += columns.isEmpty() ? 0 : 1;
+	for (int column = 0; column < columns.size(); ++column) {
+		const Column *col = columns[column];
+		if (!col)
+			continue;
+		result.bytes += sizeof(Column) + col->blocks.capacity() * sizeof(Block *);
+		result.allocations += 2;
+		foreach(const Block *block, col->blocks) {
+			if (!block)
+				continue;
+			result.bytes += sizeof(Block);
+			++result.allocations;
+			if (!block->cells)
+				continue;
+			result.bytes += BlockSize * sizeof(Cell *);
+			++result.allocations;
+			for (int i = 0; i < BlockSize; ++i) {
+				if (block->cells[i] && block->cells[i]->textBytes() > 0) { //The typed text.
+					result.bytes += block->cells[i]->textBytes();
+					++result.allocations;
+				}
+			}
+		}
+	}
+	result.bytes += Cell::slabBytes() + strings->bytes() + formulas->bytes();
+	result.allocations += Cell::slabCount() + strings->allocations() + formulas->allocations();
+	return result;
+}
+
+//Feeds the range's numbers to the SIMD kernels a block slice at a time.
+//Only allocated blocks are touched, so sparse ranges stay cheap.
+//Formulas inside the range must have been evaluated already.
+void CellStore::aggregate(const CellRange &range, Accumulator &acc) const {
+	load(range.top, range.left, range.bottom, range.right);
+	int lastColumn = qMin(range.right, columns.size() - 1);
+	for (int column = range.left; column <= lastColumn; ++column) {
+		const Column *col = columns[column];
+		if (!col)
+			continue;
+		int lastBlock = qMin(range.bottom / int(BlockSize), col->blocks.size() - 1);
+		for (int b = range.top / BlockSize; b <= lastBlock; ++b) {
+			const Block *block = col->blocks[b];
+			if (!block)
+				continue;
+			int first = qMax(range.top - b * BlockSize, 0);
+			int last = qMin(range.bottom - b * BlockSize, int(BlockSize) - 1);
+			quint8 seen = accumulateNumbers(block->numbers + first,
+				block->flags + first, last - first + 1, NumberValid, acc);
+			if ((seen & Error) && acc.errorRow == -1) {
+				int i = first;
+				while (!(block->flags[i] & Error))
+					++i;
+				acc.errorRow = b * BlockSize + i;
+				acc.errorColumn = column;
+			}
+		}
+	}
+}
+
+//One past the last occupied row and column; empty stores give (0, 0).
+CellRef CellStore::extent() const {
+	CellRef ref = { 0, 0 };
+	for (int column = 0; column < columns.size(); ++column) {
+		const Column *col = columns[column];
+		if (!col)
+			continue;
+		ref.column = qMax(ref.column, column + 1);
+		for (int b = col->blocks.size() - 1; b >= 0; --b) {
+			const Block *block = col->blocks[b];
+			if (!block)
+				continue;
+			for (int i = BlockSize - 1; i >= 0; --i) {
+				if (block->flags[i] & Occupied) {
+					ref.row = qMax(ref.row, b * BlockSize + i + 1);
+					break;
+				}
+			}
+			break;
+		}
+	}
+	for (int i = 0; mapped && i < mapped->blockCount(); ++i) {
+		if (!loaded.testBit(i)) {
+			ref.row = qMax(ref.row, mapped->block(i) * BlockSize + mapped->lastSlot(i) + 1);
+			ref.column = qMax(ref.column, mapped->column(i) + 1);
+		}
+	}
+	ref.row = qMin(int(ref.row), int(CellRef::MaxRows));
+	ref.column = qMin(int(ref.column), int(CellRef::MaxColumns));
+	return ref;
+}
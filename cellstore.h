@@ -0,0 +1,189 @@
+#ifndef CELLSTORE_H
+#define CELLSTORE_H
+
+#include <qatomic.h>
+#include <qbitarray.h>
+#include <qsharedpointer.h>
+#include <qvariant.h>
+#include <qvector.h>
+
+#include "cellref.h"
+#include "stringpool.h"
+
+class Cell;
+class FormulaPool;
+class MappedSheet;
+struct Accumulator;
+
+//Hears about the cells a CellStore loads on demand from a mapped file.
+class CellStoreListener
+{
+public:
+	virtual ~CellStoreListener() {}
+	virtual void cellLoaded(int row, int column, const Cell *cell) = 0;
+};
+
+//Sparse, columnar storage for up to MaxRows x MaxColumns cells.
+//Each column is split into blocks of BlockSize rows that are allocated
+//when their first cell is and freed with their last one, so memory
+//follows the occupied cells, not the size of the grid.
+//Inside a block, values live in a contiguous double array with a flag
+//byte per slot. A plain number costs those 9 bytes and nothing else,
+//and so does plain text: its slot holds the id of the text in the
+//sheet's StringPool, where repeated texts are kept once, for as long
+//as a slot holds them. Should the pool run out of ids, the text gets a
+//Cell like the literals below. Formulas get
+//a Cell in the block's side table and write numeric results back into
+//the array. Scans can then stream through numbers[] instead of chasing
+//a pointer per cell. The cells of a filled-down range share one
+//compiled formula from the sheet's FormulaPool.
+//A store can also be backed by a MappedSheet: its blocks are decoded
+//the first time anything reads or writes them, in parallel when a read
+//covers several.
+//Snapshots share columns and blocks with the store they were taken
+//from, the way Qt's containers share their data: each is counted, and
+//the first side to change one gets a copy of its own.
+class CellStore
+{
+public:
+	enum { BlockSize = 256 };
+	enum SlotFlag {
+		Occupied = 0x1,
+		NumberValid = 0x2,//numbers[] holds the slot's current value.
+		Error = 0x4,//The slot's formula evaluated to a FormulaError.
+		Text = 0x8,//numbers[] holds a StringPool id, not a value.
+		Quoted = 0x10,//The text was typed after a ', which isn't kept.
+		Dirty = 0x20//The slot's formula has to be evaluated again.
+	};
+
+	//What the store takes up, pool and slabs included.
+	struct Usage
+	{
+		qint64 bytes;
+		qint64 allocations;
+	};
+
+	CellStore();
+	~CellStore();
+
+	bool contains(int row, int column) const;
+	bool isNumber(int row, int column) const;
+	bool number(int row, int column, double &value) const;
+	Cell *cell(int row, int column) const;
+	Cell *writableCell(int row, int column);
+	QString formula(int row, int column) const;
+	QVariant value(int row, int column) const;
+	const Cell *setFormula(int row, int column, const QString &formula);
+	void setNumber(int row, int column, double number);
+	void remove(int row, int column);
+	void clear();
+
+	int count() const { return cellCount; }
+	CellRef extent() const;
+	CellStore *snapshot() const;
+	Usage usage() const;
+	void aggregate(const CellRange &range, Accumulator &acc) const;
+
+	void map(const QSharedPointer<const MappedSheet> &sheet);
+	void loadAll();
+	bool isMappedFrom(const QString &fileName) const;
+	void setListener(CellStoreListener *listener) { this->listener = listener; }
+
+	//Calls visitor(row, column, cell) for every occupied slot inside the
+	//rectangle, column by column, skipping unallocated blocks.
+	//cell is 0 for a plain number or text, which only live in the arrays.
+	template <typename Visitor>
+	void visit(int top, int left, int bottom, int right, Visitor visitor) const {
+		load(top, left, bottom, right);
+		visitLoaded(top, left, bottom, right, visitor);
+	}
+	template <typename Visitor>
+	void visit(Visitor visitor) const {
+		visit(0, 0, CellRef::MaxRows - 1, CellRef::MaxColumns - 1, visitor);
+	}
+	//As visit(), but blocks still in the mapped file are left alone.
+	template <typename Visitor>
+	void visitLoaded(int top, int left, int bottom, int right, Visitor visitor) const;
+	template <typename Visitor>
+	void visitLoaded(Visitor visitor) const {
+		visitLoaded(0, 0, CellRef::MaxRows - 1, CellRef::MaxColumns - 1, visitor);
+	}
+
+private:
+	struct Block
+	{
+		double numbers[BlockSize];
+		quint8 flags[BlockSize];
+		Cell **cells;//Side table for text and formulas, allocated on first use.
+		int count;
+		mutable QAtomicInt ref;//Stores sharing the block.
+	};
+
+	struct Column
+	{
+		QVector<Block *> blocks;
+		int count;
+		mutable QAtomicInt ref;
+	};
+
+	struct DecodedBlock
+	{
+		int index;//In the mapped file.
+		Block *block;
+	};
+
+	Q_DISABLE_COPY(CellStore)
+
+	CellStore(const QSharedPointer<StringPool> &strings,
+		const QSharedPointer<FormulaPool> &formulas);
+	const Block *block(int row, int column) const;
+	Block *findOrCreateBlock(int row, int column);
+	Block *occupy(int row, int column);
+	Column *writableColumn(int column);
+	Block *&writableSlot(int row, int column);
+	void load(int top, int left, int bottom, int right) const;
+	static Block *decodeBlock(const MappedSheet &sheet, int index, StringPool &pool,
+		FormulaPool &formulaPool);
+	static bool storeText(Block *block, int i, const QString &formula, bool isNumber,
+		StringPool &pool);
+	static quint32 textId(const Block *block, int i);
+	void installBlock(int index, Block *block);
+	static Block *newBlock();
+	static Block *copyBlock(const Block *block, StringPool *pool);
+	static bool hasDirtyFormulas(const Block *block);
+	static void freeBlock(Block *block, StringPool *pool);
+	static void releaseColumn(Column *col, StringPool *pool);
+
+	QVector<Column *> columns;
+	int cellCount;
+	QSharedPointer<StringPool> strings;//Shared with snapshots.
+	QSharedPointer<FormulaPool> formulas;//Likewise.
+	QSharedPointer<const MappedSheet> mapped;
+	QBitArray loaded;//Which blocks of the mapped file were decoded.
+	CellStoreListener *listener;
+};
+
+template <typename Visitor>
+void CellStore::visitLoaded(int top, int left, int bottom, int right,
+	Visitor visitor) const {
+	int lastColumn = qMin(right, columns.size() - 1);
+	for (int column = qMax(left, 0); column <= lastColumn; ++column) {
+		const Column *col = columns[column];
+		if (!col)
+			continue;
+		int lastBlock = qMin(bottom / int(BlockSize), col->blocks.size() - 1);
+		for (int b = qMax(top, 0) / BlockSize; b <= lastBlock; ++b) {
+			const Block *block = col->blocks[b];
+			if (!block)
+				continue;
+			int first = qMax(top - b * BlockSize, 0);
+			int last = qMin(bottom - b * BlockSize, int(BlockSize) - 1);
+			for (int i = first; i <= last; ++i) {
+				if (block->flags[i] & Occupied)
+					visitor(b * BlockSize + i, column, block->cells ? block->cells[i] : 0);
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,317 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include <qelapsedtimer.h>
+#include <qfileinfo.h>
+#include <qthread.h>
+#include <qtconcurrentmap.h>
+#include <qvector.h>
+
+#include "delimitedfile.h"
+#include "spreadsheetmodel.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DELIMITED_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+struct Field
+{
+	QString text;
+	double number;
+	bool isNumber;
+};
+
+typedef QVector<Field> Record;
+
+//A run of whole records in the current chunk, parsed by one worker.
+struct Slice
+{
+	const char *data;
+	const int *ends;//Offsets of the '\n' (or chunk end) closing each record.
+	int start;//Offset of the first record.
+	int count;
+	char delimiter;
+	QVector<Record> records;
+};
+
+}
+
+//Appends the offset of every '\n' that ends a record, skipping those
+//inside quoted fields. A quote counts as parseRecord() reads it: it
+//opens a quoted field only at the start of a field, and inside one a
+//lone quote closes it and a doubled one stands for itself. Elsewhere,
+//as in 5" screen, it is plain text. The scan compares 16 bytes at a
+//time and only looks at the bytes that are newlines, quotes or
+//delimiters. data starts a record.
+static void findRecordEnds(const char *data, int size, char delimiter,
+	QVector<int> &ends) {
+	bool quoted = false;
+	int fieldStart = 0;//Where a quote opens a quoted field.
+	int reopen = -1;//Right after a closing quote, where a second one escapes it.
+	auto visit = [&](int i) {
+		char c = data[i];
+		if (c == '"') {
+			if (quoted) {
+				quoted = false;
+				reopen = i + 1;
+			}
+			else if (i == fieldStart || i == reopen) {
+				quoted = true;
+			}
+		}
+		else if (!quoted) {
+			if (c == '\n')
+				ends.append(i);
+			fieldStart = i + 1;
+		}
+	};
+
+	int i = 0;
+#ifdef DELIMITED_SSE2
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i separator = _mm_set1_epi8(delimiter);
+	for (; i + 16 <= size; i += 16) {
+		__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		quint32 mask = quint32(_mm_movemask_epi8(_mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(bytes, newline), _mm_cmpeq_epi8(bytes, quote)),
+			_mm_cmpeq_epi8(bytes, separator))));
+		while (mask) {
+			int bit = qPopulationCount((mask & (0u - mask)) - 1);//Trailing zeros.
+			mask &= mask - 1;
+			visit(i + bit);
+		}
+	}
+#endif
+	for (; i < size; ++i) {
+		char c = data[i];
+		if (c == '"' || c == '\n' || c == delimiter)
+			visit(i);
+	}
+}
+
+//Splits [p, end) into fields. A quoted field may hold delimiters,
+//newlines and doubled quotes; a trailing '\r' is dropped.
+static void parseRecord(const char *p, const char *end, char delimiter,
+	Record &record) {
+	if (end > p && end[-1] == '\r')
+		--end;
+
+	QByteArray unquoted;
+	for (;;) {
+		Field field;
+		field.number = 0.0;
+		field.isNumber = false;
+		if (p < end && *p == '"') {
+			unquoted.clear();
+			++p;
+			while (p < end) {
+				if (*p == '"') {
+					if (p + 1 < end && p[1] == '"') {
+						unquoted.append('"');
+						p += 2;
+						continue;
+					}
+					++p;
+					break;
+				}
+				unquoted.append(*p++);
+			}
+			while (p < end && *p != delimiter) //Stray text after the closing quote.
+				unquoted.append(*p++);
+			field.text = QString::fromUtf8(unquoted);
+		}
+		else {
+			const char *stop = static_cast<const char *>(memchr(p, delimiter, end - p));
+			if (!stop)
+				stop = end;
+			field.text = QString::fromUtf8(p, int(stop - p));
+			if (!field.text.isEmpty()) { //Only text a number writes back the same, as typed input.
+				bool ok;
+				field.number = field.text.toDouble(&ok);
+				field.isNumber = ok && QString::number(field.number, 'g', 15) == field.text;
+			}
+			p = stop;
+		}
+		record.append(field);
+		if (p >= end)
+			break;
+		++p;//The delimiter.
+	}
+}
+
+static void parseSlice(Slice &slice) {
+	slice.records.resize(slice.count);
+	int start = slice.start;
+	for (int i = 0; i < slice.count; ++i) {
+		parseRecord(slice.data + start, slice.data + slice.ends[i],
+			slice.delimiter, slice.records[i]);
+		start = slice.ends[i] + 1;
+	}
+}
+
+double DelimitedFile::Stats::megabytesPerSecond() const {
+	return msecs > 0 ? bytes / (1024.0 * 1024.0) / (msecs / 1000.0) : 0.0;
+}
+
+//Tab for .tsv and .tab files, comma for everything else.
+char DelimitedFile::delimiterFor(const QString &fileName) {
+	QString suffix = QFileInfo(fileName).suffix().toLower();
+	return suffix == "tsv" || suffix == "tab" ? '\t' : ',';
+}
+
+//Records land from row 0 down, over whatever is there. Records past the
+//last row are dropped, and so are fields past the last column.
+void DelimitedFile::read(QIODevice &device, char delimiter,
+	SpreadsheetModel &model, Stats *stats) {
+	QElapsedTimer timer;
+	timer.start();
+	qint64 bytes = 0;
+	qint64 cells = 0;
+	int row = 0;
+	int sliceCount = qMax(1, QThread::idealThreadCount()) * 4;
+
+	QByteArray chunk;
+	QVector<int> ends;
+	QVector<Slice> slices;
+	model.beginBatch();
+	bool atEnd = false;
+	while (!atEnd && row < CellRef::MaxRows) {
+		QByteArray data = device.read(ChunkSize);
+		atEnd = data.isEmpty();
+		bytes += data.size();
+		chunk.append(data);//After the part of a record the last chunk ended with.
+
+		ends.clear();
+		findRecordEnds(chunk.constData(), chunk.size(), delimiter, ends);
+		if (atEnd && chunk.size() > (ends.isEmpty() ? 0 : ends.last() + 1))
+			ends.append(chunk.size());//The last record has no newline.
+		if (ends.isEmpty())
+			continue;//A record longer than a chunk; read on.
+
+		//Whole records only, split evenly across the workers.
+		int perSlice = (ends.size() + sliceCount - 1) / sliceCount;
+		slices.clear();
+		for (int first = 0; first < ends.size(); first += perSlice) {
+			Slice slice;
+			slice.data = chunk.constData();
+			slice.ends = ends.constData() + first;
+			slice.start = first == 0 ? 0 : ends[first - 1] + 1;
+			slice.count = qMin(perSlice, ends.size() - first);
+			slice.delimiter = delimiter;
+			slices.append(slice);
+		}
+		QtConcurrent::blockingMap(slices, parseSlice);
+
+		for (int s = 0; s < slices.size() && row < CellRef::MaxRows; ++s) {
+			foreach(const Record &record, slices[s].records) {
+				if (row >= CellRef::MaxRows)
+					break;
+				int columns = qMin(record.size(), int(CellRef::MaxColumns));
+				for (int column = 0; column < columns; ++column) {
+					const Field &field = record[column];
+					if (field.isNumber) {
+						model.setNumber(row, column, field.number);
+						++cells;
+					}
+					else if (!field.text.isEmpty()) {
+						model.setFormula(row, column, field.text);
+						++cells;
+					}
+				}
+				++row;
+			}
+		}
+		chunk.remove(0, qMin(ends.last() + 1, chunk.size()));
+	}
+	model.commitBatch();
+
+	if (stats) {
+		stats->bytes = bytes;
+		stats->cells = cells;
+		stats->msecs = timer.elapsed();
+	}
+}
+
+//Quotes a field that holds the delimiter, a quote or a line break.
+static void appendField(QByteArray &buffer, const QString &text, char delimiter) {
+	QByteArray bytes = text.toUtf8();
+	bool quote = false;
+	for (int i = 0; i < bytes.size() && !quote; ++i) {
+		char c = bytes[i];
+		quote = c == delimiter || c == '"' || c == '\n' || c == '\r';
+	}
+	if (!quote) {
+		buffer.append(bytes);
+		return;
+	}
+	buffer.append('"');
+	buffer.append(bytes.replace('"', "\"\""));
+	buffer.append('"');
+}
+
+//Rows are written a CellStore block at a time: the occupied cells of
+//the band are collected column by column, then put in row order.
+bool DelimitedFile::write(QIODevice &device, char delimiter,
+	const SpreadsheetModel &model, Content content, Stats *stats) {
+	QElapsedTimer timer;
+	timer.start();
+	qint64 bytes = 0;
+	qint64 cells = 0;
+	bool ok = true;
+
+	struct Entry
+	{
+		int row;
+		int column;
+	};
+
+	const CellStore &store = model.cells();
+	CellRef extent = store.extent();
+	QByteArray buffer;
+	buffer.reserve(FlushSize + 64 * 1024);
+	QVector<Entry> entries;
+	for (int top = 0; top < extent.row && ok; top += CellStore::BlockSize) {
+		int bottom = qMin(top + int(CellStore::BlockSize), extent.row) - 1;
+		entries.clear();
+		store.visit(top, 0, bottom, extent.column - 1,
+			[&entries](int row, int column, const Cell *) {
+			Entry entry = { row, column };
+			entries.append(entry);
+		});
+		std::stable_sort(entries.begin(), entries.end(),
+			[](const Entry &a, const Entry &b) { return a.row < b.row; });
+
+		int next = 0;
+		for (int row = top; row <= bottom; ++row) {
+			int column = 0;
+			for (; next < entries.size() && entries[next].row == row; ++next) {
+				for (; column < entries[next].column; ++column)
+					buffer.append(delimiter);
+				appendField(buffer, content == Formulas
+					? model.formula(row, column) : model.valueText(row, column),
+					delimiter);
+				++cells;
+			}
+			buffer.append('\n');
+			if (buffer.size() >= FlushSize) {
+				ok = device.write(buffer) == buffer.size();
+				bytes += buffer.size();
+				buffer.clear();
+			}
+		}
+	}
+	ok = ok && device.write(buffer) == buffer.size();
+	bytes += buffer.size();
+
+	if (stats) {
+		stats->bytes = bytes;
+		stats->cells = cells;
+		stats->msecs = timer.elapsed();
+	}
+	return ok;
+}
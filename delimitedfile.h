@@ -0,0 +1,45 @@
+#ifndef DELIMITEDFILE_H
+#define DELIMITEDFILE_H
+
+#include <qiodevice.h>
+#include <qstring.h>
+
+class SpreadsheetModel;
+
+//Streaming CSV and TSV import and export.
+//The importer reads the device in chunks, finds the record boundaries of
+//each chunk with a vectorized scan for newlines and quotes, and parses
+//slices of records in parallel. Unquoted fields that a number writes
+//back exactly become numbers; everything else goes in as typed text, so
+//"=A1" is a formula and "01234" keeps its zero. Cells are written
+//through one model batch.
+//The exporter walks the sheet a block of rows at a time and writes
+//through a fixed-size buffer.
+class DelimitedFile
+{
+public:
+	enum Content { Values, Formulas };
+
+	struct Stats
+	{
+		qint64 bytes;
+		qint64 cells;
+		qint64 msecs;
+
+		double megabytesPerSecond() const;
+	};
+
+	static char delimiterFor(const QString &fileName);
+	static void read(QIODevice &device, char delimiter, SpreadsheetModel &model,
+		Stats *stats = 0);
+	static bool write(QIODevice &device, char delimiter,
+		const SpreadsheetModel &model, Content content, Stats *stats = 0);
+
+private:
+	enum {
+		ChunkSize = 8 * 1024 * 1024,
+		FlushSize = 1024 * 1024
+	};
+};
+
+#endif
@@ -0,0 +1,153 @@
+#include "dependencygraph.h"
+
+//Replace the edges leaving (row, column) with the given references.
+void DependencyGraph::setPrecedents(int row, int column,
+	const QVector<CellRef> &refs, const QVector<CellRange> &ranges) {
+	removePrecedents(row, column);
+	Key cell = key(row, column);
+	if (!ranges.isEmpty()) {
+		rangePrecedents.insert(cell, ranges);
+		foreach(const CellRange &range, ranges)
+			addRange(cell, range);
+	}
+	if (refs.isEmpty())
+		return;
+
+	QVector<Key> &keys = precedents[cell];
+	keys.reserve(refs.size());
+	for (int i = 0; i < refs.size(); ++i) {
+		Key precedent = key(refs[i].row, refs[i].column);
+		if (!keys.contains(precedent)) {
+			keys.append(precedent);
+			dependentSets[precedent].insert(cell);
+		}
+	}
+}
+
+//The cell stays a precedent of others; only its own formula's edges go.
+void DependencyGraph::removePrecedents(int row, int column) {
+	Key cell = key(row, column);
+	QHash<Key, QVector<CellRange> >::iterator ranges = rangePrecedents.find(cell);
+	if (ranges != rangePrecedents.end()) {
+		foreach(const CellRange &range, ranges.value())
+			removeRange(cell, range);
+		rangePrecedents.erase(ranges);
+	}
+	QHash<Key, QVector<Key> >::iterator it = precedents.find(cell);
+	if (it == precedents.end())
+		return;
+
+	foreach(Key precedent, it.value()) {
+		QHash<Key, QSet<Key> >::iterator dep = dependentSets.find(precedent);
+		if (dep != dependentSets.end()) {
+			dep.value().remove(cell);
+			if (dep.value().isEmpty())
+				dependentSets.erase(dep);
+		}
+	}
+	precedents.erase(it);
+}
+
+bool DependencyGraph::isWide(const CellRange &range) {
+	qint64 rowBands = range.bottom / BucketRows - range.top / BucketRows + 1;
+	qint64 columnBands = range.right / BucketColumns - range.left / BucketColumns + 1;
+	return rowBands * columnBands > MaxBuckets;
+}
+
+//Files the range in every bucket it touches, or with the wide ones.
+void DependencyGraph::addRange(Key cell, const CellRange &range) {
+	RangeEntry entry = { range, cell };
+	if (isWide(range)) {
+		wideRanges.append(entry);
+		return;
+	}
+	for (int r = range.top / BucketRows; r <= range.bottom / BucketRows; ++r) {
+		for (int c = range.left / BucketColumns; c <= range.right / BucketColumns; ++c)
+			rangeBuckets[bucket(r, c)].append(entry);
+	}
+}
+
+void DependencyGraph::removeEntry(QVector<RangeEntry> &entries, Key cell) {
+	for (int i = 0; i < entries.size(); ++i) {
+		if (entries[i].cell == cell) {
+			entries[i] = entries.last();
+			entries.removeLast();
+			return;
+		}
+	}
+}
+
+//Drops one entry of the cell's from each bucket the range touches; the
+//cell's other ranges in a shared bucket are alike, so any one will do.
+void DependencyGraph::removeRange(Key cell, const CellRange &range) {
+	if (isWide(range)) {
+		removeEntry(wideRanges, cell);
+		return;
+	}
+	for (int r = range.top / BucketRows; r <= range.bottom / BucketRows; ++r) {
+		for (int c = range.left / BucketColumns; c <= range.right / BucketColumns; ++c) {
+			QHash<quint32, QVector<RangeEntry> >::iterator entries = rangeBuckets.find(bucket(r, c));
+			if (entries == rangeBuckets.end())
+				continue;
+			removeEntry(entries.value(), cell);
+			if (entries.value().isEmpty())
+				rangeBuckets.erase(entries);
+		}
+	}
+}
+
+QVector<DependencyGraph::Key> DependencyGraph::dependents(int row, int column) const {
+	QSet<Key> found = dependentSets.value(key(row, column));
+	QHash<quint32, QVector<RangeEntry> >::const_iterator entries =
+		rangeBuckets.find(bucket(row / BucketRows, column / BucketColumns));
+	if (entries != rangeBuckets.end()) {
+		foreach(const RangeEntry &entry, entries.value()) {
+			if (entry.range.contains(row, column))
+				found.insert(entry.cell);
+		}
+	}
+	foreach(const RangeEntry &entry, wideRanges) {
+		if (entry.range.contains(row, column))
+			found.insert(entry.cell);
+	}
+
+	QVector<Key> result;
+	result.reserve(found.size());
+	foreach(Key dependent, found)
+		result.append(dependent);
+	return result;
+}
+
+//Every cell whose value may change when (row, column) changes, itself excluded
+//unless it sits on a cycle. Cost is proportional to the size of that cone,
+//times the number of ranges sharing a bucket with each of its cells.
+QVector<DependencyGraph::Key> DependencyGraph::affectedCells(int row, int column) const {
+	return affectedCells(QVector<Key>(1, key(row, column)));
+}
+
+//The union of the cones of several changed cells, each walked once.
+QVector<DependencyGraph::Key> DependencyGraph::affectedCells(const QVector<Key> &cells) const {
+	QVector<Key> result;
+	QSet<Key> visited;
+	QVector<Key> pending = cells;
+
+	while (!pending.isEmpty()) {
+		Key cell = pending.takeLast();
+		foreach(Key dependent, dependents(row(cell), column(cell))) {
+			if (!visited.contains(dependent)) {
+				visited.insert(dependent);
+				result.append(dependent);
+				pending.append(dependent);
+			}
+		}
+	}
+	return result;
+}
+
+void DependencyGraph::clear() {
+	precedents.clear();
+	dependentSets.clear();
+	rangePrecedents.clear();
+	rangeBuckets.clear();
+	wideRanges.clear();
+}
@@ -0,0 +1,61 @@
+#ifndef DEPENDENCYGRAPH_H
+#define DEPENDENCYGRAPH_H
+
+#include <qhash.h>
+#include <qset.h>
+#include <qvector.h>
+
+#include "formula.h"
+
+//Which cells a formula reads (precedents) and which formulas read a cell (dependents).
+//Cells are keyed by position, so a formula may depend on a cell that doesn't exist yet.
+//Ranges aren't expanded into per-cell edges: a formula summing a million
+//rows keeps one rectangle. Rectangles are filed in a coarse grid of
+//buckets, BucketRows by BucketColumns cells, so a lookup only tests the
+//ranges of the bucket holding the cell. Ranges covering more than
+//MaxBuckets buckets are kept aside and tested on every lookup.
+class DependencyGraph
+{
+public:
+	typedef quint64 Key;
+
+	static Key key(int row, int column) {
+		return (Key(quint32(row)) << 32) | quint32(column);
+	}
+	static int row(Key key) { return int(key >> 32); }
+	static int column(Key key) { return int(key & 0xFFFFFFFF); }
+
+	void setPrecedents(int row, int column, const QVector<CellRef> &refs,
+		const QVector<CellRange> &ranges = QVector<CellRange>());
+	void removePrecedents(int row, int column);
+	QVector<Key> dependents(int row, int column) const;
+	QVector<Key> affectedCells(int row, int column) const;
+	QVector<Key> affectedCells(const QVector<Key> &cells) const;
+	void clear();
+
+private:
+	enum { BucketRows = 1024, BucketColumns = 16, MaxBuckets = 64 };
+
+	//A range and the formula reading it.
+	struct RangeEntry
+	{
+		CellRange range;
+		Key cell;
+	};
+
+	static quint32 bucket(int rowBand, int columnBand) {
+		return (quint32(rowBand) << 16) | quint32(columnBand);
+	}
+	static bool isWide(const CellRange &range);
+	static void removeEntry(QVector<RangeEntry> &entries, Key cell);
+	void addRange(Key cell, const CellRange &range);
+	void removeRange(Key cell, const CellRange &range);
+
+	QHash<Key, QVector<Key> > precedents;
+	QHash<Key, QSet<Key> > dependentSets;
+	QHash<Key, QVector<CellRange> > rangePrecedents;
+	QHash<quint32, QVector<RangeEntry> > rangeBuckets;
+	QVector<RangeEntry> wideRanges;
+};
+
+#endif
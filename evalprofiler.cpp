@@ -0,0 +1,62 @@
+#include <qmutex.h>
+#include <qvector.h>
+
+#include "evalprofiler.h"
+
+namespace {
+
+//The samples of one thread. Only take() reads them from elsewhere, so
+//the lock is hardly ever contended.
+struct ThreadSamples
+{
+	QMutex mutex;
+	QHash<const Cell *, EvalProfiler::Sample> samples;
+};
+
+//Buffers outlive their threads, so no sample of a pool thread that
+//has since exited is lost.
+QMutex buffersMutex;
+QVector<ThreadSamples *> buffers;
+thread_local ThreadSamples *localSamples = 0;
+
+}
+
+QAtomicInt EvalProfiler::enabled;
+QElapsedTimer EvalProfiler::clock;
+
+void EvalProfiler::setEnabled(bool on) {
+	if (on && !clock.isValid())
+		clock.start();
+	enabled.store(on ? 1 : 0);
+}
+
+void EvalProfiler::record(const Cell *cell, qint64 inclusive, qint64 exclusive) {
+	if (!localSamples) {
+		localSamples = new ThreadSamples;
+		QMutexLocker locker(&buffersMutex);
+		buffers.append(localSamples);
+	}
+	QMutexLocker locker(&localSamples->mutex);
+	Sample &sample = localSamples->samples[cell];
+	++sample.evaluations;
+	sample.inclusiveNsecs += inclusive;
+	sample.exclusiveNsecs += exclusive;
+}
+
+//Every thread's samples since the last take(), merged.
+QHash<const Cell *, EvalProfiler::Sample> EvalProfiler::take() {
+	QHash<const Cell *, Sample> result;
+	QMutexLocker locker(&buffersMutex);
+	foreach(ThreadSamples *buffer, buffers) {
+		QMutexLocker bufferLocker(&buffer->mutex);
+		for (QHash<const Cell *, Sample>::const_iterator i = buffer->samples.constBegin();
+			i != buffer->samples.constEnd(); ++i) {
+			Sample &sample = result[i.key()];
+			sample.evaluations += i.value().evaluations;
+			sample.inclusiveNsecs += i.value().inclusiveNsecs;
+			sample.exclusiveNsecs += i.value().exclusiveNsecs;
+		}
+		buffer->samples.clear();
+	}
+	return result;
+}
@@ -0,0 +1,50 @@
+#ifndef EVALPROFILER_H
+#define EVALPROFILER_H
+
+#include <qatomic.h>
+#include <qelapsedtimer.h>
+#include <qhash.h>
+
+class Cell;
+
+//What recalculation spent on one cell while profiling was on.
+//Inclusive time adds the precedents a value() walk computed for the
+//cell first; in a level-parallel pass each cell is computed on its own
+//and the two are equal.
+struct CellProfile
+{
+	int row;
+	int column;
+	quint32 evaluations;
+	quint32 redirtied;//Times an edit made the cell stale again.
+	qint64 inclusiveNsecs;
+	qint64 exclusiveNsecs;
+};
+
+//Times formula evaluations, per Cell, in a buffer per thread, so the
+//workers of a pass never contend. The owner of the cells takes the
+//samples once no pass runs and maps them to positions.
+//Switched off, which is the default, evaluation pays one relaxed load
+//and a branch. The switch is process-wide.
+class EvalProfiler
+{
+public:
+	struct Sample
+	{
+		quint32 evaluations;
+		qint64 inclusiveNsecs;
+		qint64 exclusiveNsecs;
+	};
+
+	static bool isEnabled() { return enabled.load() != 0; }
+	static void setEnabled(bool on);
+	static qint64 now() { return clock.nsecsElapsed(); }
+	static void record(const Cell *cell, qint64 inclusive, qint64 exclusive);
+	static QHash<const Cell *, Sample> take();
+
+private:
+	static QAtomicInt enabled;
+	static QElapsedTimer clock;
+};
+
+#endif
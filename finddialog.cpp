@@ -3,6 +3,7 @@
 #include <qcheckbox.h>
 #include <qpushbutton.h>
 #include <qlayout.h>
+#include <qlistwidget.h>
 
 #include "finddialog.h"
 
@@ -13,19 +14,50 @@ FindDialog::FindDialog(QWidget *parent)
 	lineEdit = new QLineEdit;
 	label->setBuddy(lineEdit);
 
+	replaceLabel = new QLabel(tr("Replace w&ith:"));
+	replaceEdit = new QLineEdit;
+	replaceLabel->setBuddy(replaceEdit);
+
 	caseCheckBox = new QCheckBox(tr("Match &case"));
 	backwardCheckBox = new QCheckBox(tr("Search &backward"));
+	regexCheckBox = new QCheckBox(tr("Regular e&xpression"));
+	wholeCellCheckBox = new QCheckBox(tr("Match w&hole cell"));
 
 	findButton = new QPushButton(tr("&Find"));
 	findButton->setDefault(true);
 	findButton->setEnabled(false);
 
+	findAllButton = new QPushButton(tr("Find &All"));
+	findAllButton->setEnabled(false);
+
+	replaceButton = new QPushButton(tr("&Replace"));
+	replaceButton->setEnabled(false);
+	replaceAllButton = new QPushButton(tr("Replace A&ll"));
+	replaceAllButton->setEnabled(false);
+
+	resultLabel = new QLabel;
+	resultList = new QListWidget;
+	resultLabel->hide();
+	resultList->hide();
+
 	closeButton = new QPushButton(tr("Close"));
 
 	connect(lineEdit, SIGNAL(textChanged(const QString &)),
-		this, SLOT(enableFindButton(const QString &)));
+		this, SLOT(enableFindButton()));
+	connect(regexCheckBox, SIGNAL(toggled(bool)),
+		this, SLOT(enableFindButton()));
+	connect(wholeCellCheckBox, SIGNAL(toggled(bool)),
+		this, SLOT(enableFindButton()));
 	connect(findButton, SIGNAL(clicked()),
 		this, SLOT(findClicked()));
+	connect(findAllButton, SIGNAL(clicked()),
+		this, SLOT(findAllClicked()));
+	connect(replaceButton, SIGNAL(clicked()),
+		this, SLOT(replaceClicked()));
+	connect(replaceAllButton, SIGNAL(clicked()),
+		this, SLOT(replaceAllClicked()));
+	connect(resultList, SIGNAL(itemActivated(QListWidgetItem *)),
+		this, SLOT(resultActivated(QListWidgetItem *)));
 	connect(closeButton, SIGNAL(clicked()),
 		this, SLOT(close()));
 
@@ -33,23 +65,37 @@ FindDialog::FindDialog(QWidget *parent)
 	topLeftLayout->addWidget(label);
 	topLeftLayout->addWidget(lineEdit);
 
+	QHBoxLayout *replaceLayout = new QHBoxLayout;
+	replaceLayout->addWidget(replaceLabel);
+	replaceLayout->addWidget(replaceEdit);
+
 	QVBoxLayout *leftLayout = new QVBoxLayout;
 	leftLayout->addLayout(topLeftLayout);
+	leftLayout->addLayout(replaceLayout);
 	leftLayout->addWidget(caseCheckBox);
 	leftLayout->addWidget(backwardCheckBox);
+	leftLayout->addWidget(regexCheckBox);
+	leftLayout->addWidget(wholeCellCheckBox);
 
 	QVBoxLayout *rightLayout = new QVBoxLayout;
 	rightLayout->addWidget(findButton);
+	rightLayout->addWidget(findAllButton);
+	rightLayout->addWidget(replaceButton);
+	rightLayout->addWidget(replaceAllButton);
 	rightLayout->addWidget(closeButton);
 	rightLayout->addStretch();
 
-	QHBoxLayout *mainLayout = new QHBoxLayout;
-	mainLayout->addLayout(leftLayout);
-	mainLayout->addLayout(rightLayout);
+	QHBoxLayout *topLayout = new QHBoxLayout;
+	topLayout->addLayout(leftLayout);
+	topLayout->addLayout(rightLayout);
+
+	QVBoxLayout *mainLayout = new QVBoxLayout;
+	mainLayout->addLayout(topLayout);
+	mainLayout->addWidget(resultLabel);
+	mainLayout->addWidget(resultList);
 	setLayout(mainLayout);
 
-	setWindowTitle(tr("Find"));
-	setFixedHeight(sizeHint().height());
+	setWindowTitle(tr("Find and Replace"));
 }
 
 void FindDialog::findClicked()
@@ -66,7 +112,129 @@ void FindDialog::findClicked()
 	}
 }
 
-void FindDialog::enableFindButton(const QString &text)
+//Plain text goes through the index. A regular expression or a whole
+//cell match is a pattern, scanned for in the background.
+void FindDialog::findAllClicked()
+{
+	QRegularExpression regex;
+	if (!isPatternSearch()) {
+		emit findAll(lineEdit->text(), caseSensitivity());
+	}
+	else if (pattern(regex)) {
+		emit findMatching(regex);
+	}
+}
+
+void FindDialog::replaceClicked()
+{
+	emit replaceNext(lineEdit->text(), caseSensitivity(), replaceEdit->text());
+}
+
+//Formulas are rewritten; a regular expression's replacement may
+//use its captures as \1, \2 and so on.
+void FindDialog::replaceAllClicked()
+{
+	QRegularExpression regex;
+	if (!isPatternSearch()) {
+		emit replaceAll(lineEdit->text(), caseSensitivity(), replaceEdit->text());
+	}
+	else if (pattern(regex)) {
+		emit replaceMatching(regex, replaceEdit->text());
+	}
+}
+
+void FindDialog::showReplaced(int count)
+{
+	resultLabel->setText(tr("%n cell(s) replaced", "", count));
+	resultLabel->show();
+}
+
+Qt::CaseSensitivity FindDialog::caseSensitivity() const
+{
+	return caseCheckBox->isChecked() ? Qt::CaseSensitive : Qt::CaseInsensitive;
+}
+
+//The search as a regular expression; reports it and returns false if
+//it doesn't compile.
+bool FindDialog::pattern(QRegularExpression &regex)
+{
+	QString pattern = regexCheckBox->isChecked()
+		? lineEdit->text() : QRegularExpression::escape(lineEdit->text());
+	QRegularExpression::PatternOptions options = QRegularExpression::NoPatternOption;
+	if (wholeCellCheckBox->isChecked()) {
+		//The searched text holds the value and the formula on lines of their own.
+		pattern = "^(?:" + pattern + ")$";
+		options |= QRegularExpression::MultilineOption;
+	}
+	if (caseSensitivity() == Qt::CaseInsensitive)
+		options |= QRegularExpression::CaseInsensitiveOption;
+
+	regex = QRegularExpression(pattern, options);
+	if (!regex.isValid()) {
+		resultLabel->setText(tr("Invalid expression: %1").arg(regex.errorString()));
+		resultLabel->show();
+		return false;
+	}
+	return true;
+}
+
+bool FindDialog::isPatternSearch() const
+{
+	return regexCheckBox->isChecked() || wholeCellCheckBox->isChecked();
+}
+
+void FindDialog::clearResults()
+{
+	results.clear();
+	resultList->clear();
+	resultLabel->setText(tr("Searching..."));
+	resultLabel->show();
+	resultList->show();
+}
+
+//One line per match, "B7: text".
+void FindDialog::addResults(const QVector<CellRef> &cells, const QStringList &texts)
+{
+	results += cells;
+	for (int i = 0; i < cells.size(); ++i)
+		resultList->addItem(cells[i].toString() + ": " + texts[i]);
+	resultLabel->setText(tr("%1 cells found so far").arg(results.size()));
+}
+
+//total counts the matches not listed too.
+void FindDialog::showTotal(int total)
+{
+	if (total > results.size()) {
+		resultLabel->setText(tr("%1 cells found, the first %2 listed")
+			.arg(total).arg(results.size()));
+	}
+	else {
+		resultLabel->setText(tr("%1 cells found").arg(total));
+	}
+}
+
+void FindDialog::resultActivated(QListWidgetItem *item)
+{
+	int i = resultList->row(item);
+	if (i >= 0 && i < results.size())
+		emit showCell(results[i].row, results[i].column);
+}
+
+//Closing the dialog stops a scan that is still running.
+void FindDialog::hideEvent(QHideEvent *event)
+{
+	emit cancelSearch();
+	QDialog::hideEvent(event);
+}
+
+//Find and Replace step through plain text matches only; patterns are
+//listed or replaced all at once.
+void FindDialog::enableFindButton()
 {
-	findButton->setEnabled(!text.isEmpty());
+	bool hasText = !lineEdit->text().isEmpty();
+	findButton->setEnabled(hasText && !isPatternSearch());
+	findAllButton->setEnabled(hasText);
+	replaceButton->setEnabled(hasText && !isPatternSearch());
+	replaceAllButton->setEnabled(hasText);
+	backwardCheckBox->setEnabled(!isPatternSearch());
 }
@@ -2,10 +2,16 @@
 #define FINDDIALOG_H
 
 #include <QDialog>
+#include <qregularexpression.h>
+#include <qvector.h>
+
+#include "cellref.h"
 
 class QCheckBox;
 class QLabel;
 class QLineEdit;
+class QListWidget;
+class QListWidgetItem;
 class QPushButton;
 
 class FindDialog : public QDialog
@@ -15,21 +21,55 @@ class FindDialog : public QDialog
 public:
 	FindDialog(QWidget *parent = 0);
 
+	public slots:
+	void clearResults();
+	void addResults(const QVector<CellRef> &cells, const QStringList &texts);
+	void showTotal(int total);
+	void showReplaced(int count);
+
 signals:
 	void findNext(const QString &str, Qt::CaseSensitivity cs);
 	void findPrevious(const QString &str, Qt::CaseSensitivity cs);
+	void findAll(const QString &str, Qt::CaseSensitivity cs);
+	void findMatching(const QRegularExpression &pattern);
+	void cancelSearch();
+	void replaceNext(const QString &str, Qt::CaseSensitivity cs, const QString &after);
+	void replaceAll(const QString &str, Qt::CaseSensitivity cs, const QString &after);
+	void replaceMatching(const QRegularExpression &pattern, const QString &after);
+	void showCell(int row, int column);
+
+protected:
+	void hideEvent(QHideEvent *event) override;
 
 	private slots:
 	void findClicked();
-	void enableFindButton(const QString &text);
+	void findAllClicked();
+	void replaceClicked();
+	void replaceAllClicked();
+	void resultActivated(QListWidgetItem *item);
+	void enableFindButton();
 
 private:
+	bool isPatternSearch() const;
+	Qt::CaseSensitivity caseSensitivity() const;
+	bool pattern(QRegularExpression &regex);
+
 	QLabel *label;
 	QLineEdit *lineEdit;
+	QLabel *replaceLabel;
+	QLineEdit *replaceEdit;
 	QCheckBox *caseCheckBox;
 	QCheckBox *backwardCheckBox;
+	QCheckBox *regexCheckBox;
+	QCheckBox *wholeCellCheckBox;
 	QPushButton *findButton;
+	QPushButton *findAllButton;
+	QPushButton *replaceButton;
+	QPushButton *replaceAllButton;
 	QPushButton *closeButton;
+	QLabel *resultLabel;
+	QListWidget *resultList;//Shown once Find All has run.
+	QVector<CellRef> results;
 };
 
 #endif
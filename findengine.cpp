@@ -0,0 +1,112 @@
+#include <qthread.h>
+#include <qtconcurrentmap.h>
+#include <qtconcurrentrun.h>
+
+#include "findengine.h"
+
+namespace {
+
+struct Entry
+{
+	SearchIndex::Key key;
+	QString text;
+};
+
+struct Slice
+{
+	int first;
+	int last;
+};
+
+}
+
+FindEngine::FindEngine(QObject *parent)
+	: QObject(parent) {
+	search = 0;
+	total = 0;
+	qRegisterMetaType<QVector<CellRef> >("QVector<CellRef>");
+
+	connect(this, SIGNAL(sliceReady(int, const QVector<CellRef> &)),
+		this, SLOT(sliceMatched(int, const QVector<CellRef> &)), Qt::QueuedConnection);
+	connect(&watcher, SIGNAL(finished()), this, SLOT(workerFinished()));
+}
+
+FindEngine::~FindEngine() {
+	cancel();
+}
+
+//Stops the running search, if any, and starts matching pattern.
+void FindEngine::start(const QHash<SearchIndex::Key, QString> &texts,
+	const QRegularExpression &pattern) {
+	cancel();
+	++search;
+	total = 0;
+	cancelled.store(0);
+
+	QRegularExpression compiled(pattern);
+	compiled.optimize();
+	watcher.setFuture(QtConcurrent::run(this, &FindEngine::run, search, texts, compiled));
+}
+
+//Waits for the scan to drain; the slices look at the flag every
+//CancelCheck cells, so this is short.
+void FindEngine::cancel() {
+	if (!watcher.isRunning())
+		return;
+	cancelled.store(1);
+	watcher.waitForFinished();
+	++search;//Reports already queued belong to the old search now.
+}
+
+//Runs in the worker thread. The texts are a shared copy of the index's,
+//so the GUI thread can keep editing while they are scanned.
+void FindEngine::run(int search, QHash<SearchIndex::Key, QString> texts,
+	QRegularExpression pattern) {
+	QVector<Entry> entries;
+	entries.reserve(texts.size());
+	for (QHash<SearchIndex::Key, QString>::const_iterator i = texts.constBegin();
+		i != texts.constEnd(); ++i) {
+		Entry entry = { i.key(), i.value() };
+		entries.append(entry);
+	}
+
+	int sliceCount = qMax(1, QThread::idealThreadCount()) * SlicesPerThread;
+	int perSlice = (entries.size() + sliceCount - 1) / sliceCount;
+	QVector<Slice> slices;
+	for (int first = 0; first < entries.size(); first += perSlice) {
+		Slice slice = { first, qMin(first + perSlice, entries.size()) };
+		slices.append(slice);
+	}
+
+	QtConcurrent::blockingMap(slices, [&](const Slice &slice) {
+		QVector<CellRef> cells;
+		for (int i = slice.first; i < slice.last; ++i) {
+			if ((i - slice.first) % CancelCheck == 0 && cancelled.load())
+				return;
+			if (pattern.match(entries[i].text).hasMatch()) {
+				CellRef ref = { DependencyGraph::row(entries[i].key),
+					DependencyGraph::column(entries[i].key) };
+				cells.append(ref);
+				if (cells.size() == ReportSize) {
+					emit sliceReady(search, cells);
+					cells.clear();
+				}
+			}
+		}
+		if (!cells.isEmpty())
+			emit sliceReady(search, cells);
+	});
+}
+
+//Reports of the slices, queued to the GUI thread.
+void FindEngine::sliceMatched(int search, const QVector<CellRef> &cells) {
+	if (search != this->search)
+		return;
+	total += cells.size();
+	emit found(cells);
+}
+
+void FindEngine::workerFinished() {
+	if (!cancelled.load())
+		emit finished(total);
+}
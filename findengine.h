@@ -0,0 +1,58 @@
+#ifndef FINDENGINE_H
+#define FINDENGINE_H
+
+#include <qatomic.h>
+#include <qfuturewatcher.h>
+#include <qhash.h>
+#include <qobject.h>
+#include <qregularexpression.h>
+#include <qvector.h>
+
+#include "cellref.h"
+#include "searchindex.h"
+
+//Matches a regular expression against the searchable text of every
+//cell, for the searches the trigram index can't answer. The texts are
+//those the SearchIndex already holds, so nothing is evaluated; they are
+//split into slices scanned on the thread pool, and matches are reported
+//in batches while the scan runs. Starting a new search or calling
+//cancel() stops the one running.
+class FindEngine : public QObject
+{
+	Q_OBJECT;
+
+public:
+	FindEngine(QObject *parent = 0);
+	~FindEngine();
+
+	bool isRunning() const { return watcher.isRunning(); }
+	void start(const QHash<SearchIndex::Key, QString> &texts,
+		const QRegularExpression &pattern);
+	void cancel();
+
+signals:
+	void found(const QVector<CellRef> &cells);
+	void finished(int total);
+	void sliceReady(int search, const QVector<CellRef> &cells);//Internal.
+
+private slots:
+	void sliceMatched(int search, const QVector<CellRef> &cells);
+	void workerFinished();
+
+private:
+	enum {
+		SlicesPerThread = 8,
+		ReportSize = 256,//Matches a slice collects before reporting them.
+		CancelCheck = 1024//Cells scanned between looks at the cancel flag.
+	};
+
+	void run(int search, QHash<SearchIndex::Key, QString> texts,
+		QRegularExpression pattern);
+
+	QFutureWatcher<void> watcher;
+	QAtomicInt cancelled;
+	int search;//Counts searches, so reports of an old one are dropped.
+	int total;
+};
+
+#endif
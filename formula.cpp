@@ -0,0 +1,419 @@
+#include <qvarlengtharray.h>
+
+#include "aggregate.h"
+#include "formula.h"
+
+const QVariant Invalid;
+
+QVariant FormulaError::make(Code code) {
+	FormulaError error;
+	error.code = code;
+	return QVariant::fromValue(error);
+}
+
+bool FormulaError::isError(const QVariant &value) {
+	return value.userType() == qMetaTypeId<FormulaError>();
+}
+
+QString FormulaError::text(const QVariant &value) {
+	switch (value.value<FormulaError>().code) {
+	case Cycle:
+		return "#CYCLE!";
+	default:
+		return "#ERROR!";
+	}
+}
+
+Formula::Formula() {
+	depth = 0;
+	valid = false;
+	arithmetic = false;
+}
+
+Formula Formula::compile(const QString &expression, int row, int column) {
+	Formula formula;
+	QString expr = expression;
+	expr.replace(" ", "");
+	expr.append(QChar::Null);
+
+	int pos = 0;
+	formula.valid = formula.compileExpression(expr, pos)
+		&& expr[pos] == QChar::Null;//Compile went through the whole expression.
+	if (!formula.valid) {
+		formula.code.clear();
+		formula.numbers.clear();
+		formula.refs.clear();
+		formula.ranges.clear();
+	}
+	for (int i = 0; i < formula.refs.size(); ++i) {
+		formula.refs[i].row -= row;
+		formula.refs[i].column -= column;
+	}
+	for (int i = 0; i < formula.ranges.size(); ++i) {
+		CellRange &range = formula.ranges[i];
+		range.top -= row;
+		range.left -= column;
+		range.bottom -= row;
+		range.right -= column;
+	}
+	formula.analyze();
+	formula.code.squeeze();
+	formula.numbers.squeeze();
+	formula.refs.squeeze();
+	formula.ranges.squeeze();
+	return formula;
+}
+
+bool Formula::compileExpression(const QString &str, int &pos) {
+	if (!compileTerm(str, pos)) //Compile the first term.
+		return false;
+	while (str[pos] == '+' || str[pos] == '-') {
+		QChar op = str[pos];
+		++pos;
+
+		if (!compileTerm(str, pos)) //Compile the second term.
+			return false;
+		append(op == '+' ? Add : Subtract);
+	}
+	return true;
+}
+
+bool Formula::compileTerm(const QString &str, int &pos) {
+	if (!compileFactor(str, pos)) //Compile the first factor.
+		return false;
+	while (str[pos] == '*' || str[pos] == '/') {
+		QChar op = str[pos];
+		++pos;
+
+		if (!compileFactor(str, pos)) //Compile the second factor.
+			return false;
+		append(op == '*' ? Multiply : Divide);
+	}
+	return true;
+}
+
+bool Formula::compileFactor(const QString &str, int &pos) {
+	bool negative = false;
+
+	if (str[pos] == '-') {
+		negative = true;
+		++pos;
+	}
+
+	if (str[pos] == '(') {
+		++pos;
+		if (!compileExpression(str, pos) || str[pos] != ')')
+			return false;
+		++pos;
+	}
+	else {
+		int start = pos;
+		while (str[pos].isLetterOrNumber() || str[pos] == '.')
+			++pos;
+		QString token = str.mid(start, pos - start);
+
+		CellRef ref;
+		if (str[pos] == '(') { //If the factor is a function call.
+			static const char *const names[] = { "SUM", "AVERAGE", "MIN", "MAX", "COUNT" };
+			int function = 0;
+			while (function <= Count
+				&& token.compare(names[function], Qt::CaseInsensitive) != 0)
+				++function;
+			if (function > Count)
+				return false;
+			++pos;
+			if (!compileCall(Function(function), str, pos))
+				return false;
+		}
+		else if (CellRef::parse(token, ref)) { //If the factor is a positon.
+			append(PushCell, refs.size());
+			refs.append(ref);
+		}
+		else { //If the factor may be a number.
+			bool ok;
+			double number = token.toDouble(&ok);
+			if (!ok)
+				return false;
+			append(PushNumber, numbers.size());
+			numbers.append(number);
+		}
+	}
+	if (negative)
+		append(Negate);
+	return true;
+}
+
+//Compiles the arguments and closing ')' of a call; there is at least one.
+bool Formula::compileCall(Function function, const QString &str, int &pos) {
+	append(BeginAggregate);
+	if (!compileArgument(str, pos))
+		return false;
+	while (str[pos] == ',') {
+		++pos;
+		if (!compileArgument(str, pos))
+			return false;
+	}
+	if (str[pos] != ')')
+		return false;
+	++pos;
+	append(EndAggregate, function);
+	return true;
+}
+
+//A range or a lone reference adds the numbers it covers, so text and
+//empty cells in it are skipped; any other argument must be a number.
+bool Formula::compileArgument(const QString &str, int &pos) {
+	int start = pos;
+	while (str[pos].isLetterOrNumber())
+		++pos;
+
+	CellRef first;
+	if (CellRef::parse(str.mid(start, pos - start), first)) {
+		CellRef last = first;
+		bool isRange = str[pos] == ':';
+		if (isRange) {
+			int second = ++pos;
+			while (str[pos].isLetterOrNumber())
+				++pos;
+			if (!CellRef::parse(str.mid(second, pos - second), last))
+				return false;
+		}
+		if (str[pos] == ',' || str[pos] == ')') {
+			CellRange range = {
+				qMin(first.row, last.row), qMin(first.column, last.column),
+				qMax(first.row, last.row), qMax(first.column, last.column)
+			};
+			append(AccumulateRange, ranges.size());
+			ranges.append(range);
+			return true;
+		}
+		if (isRange) //A range can't be an operand, as in "A1:A3+1".
+			return false;
+	}
+
+	pos = start;
+	if (!compileExpression(str, pos))
+		return false;
+	append(AccumulateValue);
+	return true;
+}
+
+void Formula::append(OpCode op, quint32 operand) {
+	Instruction instruction;
+	instruction.op = op;
+	instruction.operand = operand;
+	code.append(instruction);
+}
+
+//Finds how deep the stack gets and whether the program is plain
+//arithmetic, which evaluateLanes() can run.
+void Formula::analyze() {
+	int size = 0;
+	arithmetic = valid;
+	for (int i = 0; i < code.size(); ++i) {
+		switch (code[i].op) {
+		case PushNumber:
+		case PushCell:
+			++size;
+			break;
+		case Negate:
+			break;
+		case Add:
+		case Subtract:
+		case Multiply:
+		case Divide:
+			--size;
+			break;
+		default: //Calls run one lane at a time.
+			arithmetic = false;
+		}
+		depth = qMax(depth, size);
+	}
+}
+
+QVector<CellRef> Formula::references(int row, int column) const {
+	QVector<CellRef> result = refs;
+	for (int i = 0; i < result.size(); ++i) {
+		result[i].row += row;
+		result[i].column += column;
+	}
+	return result;
+}
+
+QVector<CellRange> Formula::rangeReferences(int row, int column) const {
+	QVector<CellRange> result = ranges;
+	for (int i = 0; i < result.size(); ++i) {
+		result[i].top += row;
+		result[i].left += column;
+		result[i].bottom += row;
+		result[i].right += column;
+	}
+	return result;
+}
+
+//Runs the program on a small stack of doubles, for the cell at row
+//and column. Only a lone reference such as "=A1" may yield a string,
+//as before.
+QVariant Formula::evaluate(const FormulaContext &context, int row, int column) const {
+	if (!valid)
+		return Invalid;
+	if (code.size() == 1 && code[0].op == PushCell) {
+		const CellRef &ref = refs[code[0].operand];
+		return context.cellValue(row + ref.row, column + ref.column);
+	}
+
+	QVarLengthArray<double, 16> stack;
+	QVarLengthArray<Accumulator, 4> accumulators;//One per open call.
+	for (int i = 0; i < code.size(); ++i) {
+		const Instruction &instruction = code[i];
+		switch (instruction.op) {
+		case PushNumber:
+			stack.append(numbers[instruction.operand]);
+			break;
+		case PushCell: {
+			const CellRef &ref = refs[instruction.operand];
+			QVariant operand = context.cellValue(row + ref.row, column + ref.column);
+			if (FormulaError::isError(operand)) //Errors spread to dependents.
+				return operand;
+			if (operand.type() != QVariant::Double)
+				return Invalid;
+			stack.append(operand.toDouble());
+			break;
+		}
+		case Negate:
+			stack[stack.size() - 1] = -stack[stack.size() - 1];
+			break;
+		case BeginAggregate:
+			accumulators.append(Accumulator());
+			break;
+		case AccumulateValue:
+			accumulators[accumulators.size() - 1].add(stack[stack.size() - 1]);
+			stack.removeLast();
+			break;
+		case AccumulateRange: {
+			Accumulator &acc = accumulators[accumulators.size() - 1];
+			CellRange range = ranges[instruction.operand];
+			range.top += row;
+			range.left += column;
+			range.bottom += row;
+			range.right += column;
+			context.aggregate(range, acc);
+			if (acc.errorRow != -1)
+				return context.cellValue(acc.errorRow, acc.errorColumn);
+			break;
+		}
+		case EndAggregate: {
+			Accumulator acc = accumulators[accumulators.size() - 1];
+			accumulators.removeLast();
+			switch (instruction.operand) {
+			case Sum:
+				stack.append(acc.sum);
+				break;
+			case Average:
+				if (acc.count == 0)
+					return Invalid;
+				stack.append(acc.sum / acc.count);
+				break;
+			case Min:
+				stack.append(acc.count ? acc.min : 0.0);
+				break;
+			case Max:
+				stack.append(acc.count ? acc.max : 0.0);
+				break;
+			default:
+				stack.append(double(acc.count));
+			}
+			break;
+		}
+		default: {
+			double rhs = stack[stack.size() - 1];
+			stack.removeLast();
+			double &lhs = stack[stack.size() - 1];
+			if (instruction.op == Add) {
+				lhs += rhs;
+			}
+			else if (instruction.op == Subtract) {
+				lhs -= rhs;
+			}
+			else if (instruction.op == Multiply) {
+				lhs *= rhs;
+			}
+			else {
+				if (rhs == 0.0)
+					return Invalid;
+				lhs /= rhs;
+			}
+		}
+		}
+	}
+	return stack[0];
+}
+
+//Runs an arithmetic program for count cells at once, cell l being at
+//rows[l] and columns[l]. Each instruction is one loop over the cells,
+//which the compiler can vectorize, rather than one interpretation per
+//cell. A lane with an operand that isn't a number, or that divides by
+//zero, gets done[l] false and is left to evaluate(), which knows what
+//to make of it.
+void Formula::evaluateLanes(const FormulaContext &context, const int *rows,
+	const int *columns, int count, double *results, bool *done) const {
+	Q_ASSERT(arithmetic && count <= Lanes);
+	QVarLengthArray<double, 4 * Lanes> stack(depth * count);
+	int size = 0;//Entries on the stack, count lanes each.
+	for (int l = 0; l < count; ++l)
+		done[l] = true;
+
+	for (int i = 0; i < code.size(); ++i) {
+		const Instruction &instruction = code[i];
+		switch (instruction.op) {
+		case PushNumber: {
+			double *top = stack.data() + size++ * count;
+			double number = numbers[instruction.operand];
+			for (int l = 0; l < count; ++l)
+				top[l] = number;
+			break;
+		}
+		case PushCell: {
+			double *top = stack.data() + size++ * count;
+			const CellRef &ref = refs[instruction.operand];
+			for (int l = 0; l < count; ++l) {
+				if (!context.number(rows[l] + ref.row, columns[l] + ref.column, top[l])) {
+					top[l] = 0.0;
+					done[l] = false;
+				}
+			}
+			break;
+		}
+		case Negate: {
+			double *top = stack.data() + (size - 1) * count;
+			for (int l = 0; l < count; ++l)
+				top[l] = -top[l];
+			break;
+		}
+		default: {
+			const double *rhs = stack.data() + --size * count;
+			double *lhs = stack.data() + (size - 1) * count;
+			if (instruction.op == Add) {
+				for (int l = 0; l < count; ++l)
+					lhs[l] += rhs[l];
+			}
+			else if (instruction.op == Subtract) {
+				for (int l = 0; l < count; ++l)
+					lhs[l] -= rhs[l];
+			}
+			else if (instruction.op == Multiply) {
+				for (int l = 0; l < count; ++l)
+					lhs[l] *= rhs[l];
+			}
+			else {
+				for (int l = 0; l < count; ++l) {
+					done[l] = done[l] && rhs[l] != 0.0;
+					lhs[l] /= rhs[l];
+				}
+			}
+		}
+		}
+	}
+	for (int l = 0; l < count; ++l)
+		results[l] = stack[l];
+}
@@ -0,0 +1,108 @@
+#ifndef FORMULA_H
+#define FORMULA_H
+
+#include <qmetatype.h>
+#include <qstring.h>
+#include <qvariant.h>
+#include <qvector.h>
+
+#include "cellref.h"
+
+struct Accumulator;
+
+//An error produced by evaluation. It travels as its own QVariant type,
+//so it can never be mistaken for text the user typed.
+struct FormulaError
+{
+	enum Code { Cycle };
+
+	int code;
+
+	static QVariant make(Code code);
+	static bool isError(const QVariant &value);
+	static QString text(const QVariant &value);
+};
+
+Q_DECLARE_METATYPE(FormulaError)
+
+//Supplies the values of referenced cells while a formula runs.
+class FormulaContext
+{
+public:
+	virtual ~FormulaContext() {}
+	virtual QVariant cellValue(int row, int column) const = 0;
+	//The number a cell holds, 0 for an empty one; false if it holds
+	//anything else.
+	virtual bool number(int row, int column, double &value) const = 0;
+	//Adds the numeric cells of the range; text and empty cells are skipped.
+	virtual void aggregate(const CellRange &range, Accumulator &acc) const = 0;
+};
+
+//A formula compiled once into a flat postfix program.
+//The text is lexed and parsed only in compile(); value() just runs the code.
+//Besides arithmetic it knows SUM, AVERAGE, MIN, MAX and COUNT, whose
+//arguments are expressions, references or ranges such as A1:B10.
+//References are kept as offsets from the cell the formula was compiled
+//for, as in R1C1 notation, so one program serves every cell of a
+//filled-down range; the cell it runs for is passed in.
+class Formula
+{
+public:
+	enum { Lanes = 256 };//Cells evaluateLanes() takes at once, at most.
+
+	enum OpCode {
+		PushNumber,//operand indexes numbers.
+		PushCell,//operand indexes refs.
+		Negate,
+		Add,
+		Subtract,
+		Multiply,
+		Divide,
+		BeginAggregate,//Starts a function call's accumulator.
+		AccumulateValue,//Adds the number on top of the stack.
+		AccumulateRange,//operand indexes ranges.
+		EndAggregate//operand is a Function; pushes its result.
+	};
+
+	enum Function { Sum, Average, Min, Max, Count };
+
+	struct Instruction
+	{
+		quint32 op;
+		quint32 operand;
+	};
+
+	Formula();
+
+	//Compiles an expression written without its leading '=', for the
+	//cell at row and column.
+	static Formula compile(const QString &expression, int row = 0, int column = 0);
+
+	bool isValid() const { return valid; }
+	QVector<CellRef> references(int row, int column) const;
+	QVector<CellRange> rangeReferences(int row, int column) const;
+	bool hasReferences() const { return !refs.isEmpty() || !ranges.isEmpty(); }
+	bool isArithmetic() const { return arithmetic; }
+	QVariant evaluate(const FormulaContext &context, int row, int column) const;
+	void evaluateLanes(const FormulaContext &context, const int *rows,
+		const int *columns, int count, double *results, bool *done) const;
+
+private:
+	bool compileExpression(const QString &str, int &pos);
+	bool compileTerm(const QString &str, int &pos);
+	bool compileFactor(const QString &str, int &pos);
+	bool compileCall(Function function, const QString &str, int &pos);
+	bool compileArgument(const QString &str, int &pos);
+	void append(OpCode op, quint32 operand = 0);
+	void analyze();
+
+	QVector<Instruction> code;
+	QVector<double> numbers;
+	QVector<CellRef> refs;//Offsets from the formula's cell.
+	QVector<CellRange> ranges;//Likewise.
+	int depth;//Of the evaluation stack.
+	bool valid;
+	bool arithmetic;//Numbers, references and operators only.
+};
+
+#endif
@@ -0,0 +1,134 @@
+#include "formulapool.h"
+
+//The typed text of the copy at row and column, as long as it was
+//written the canonical way: no spaces, column letters in capitals.
+QString SharedFormula::text(int row, int column) const {
+	QString result = "=" + pieces[0];
+	for (int i = 0; i < offsets.size(); ++i) {
+		CellRef ref = { row + offsets[i].row, column + offsets[i].column };
+		result += ref.toString();
+		result += pieces[i + 1];
+	}
+	return result;
+}
+
+//Another cell takes the formula, e.g. a copied one.
+void SharedFormula::retain() const {
+	QMutexLocker locker(&pool->mutex);
+	++refs;
+}
+
+//The cell holding the formula no longer does; the last one frees it.
+void SharedFormula::release() const {
+	FormulaPool *owner = pool;
+	QMutexLocker locker(&owner->mutex);
+	if (--refs > 0)
+		return;
+	owner->formulas.remove(key);
+	owner->formulaBytes -= FormulaPool::formulaSize(this);
+	delete this;
+}
+
+FormulaPool::FormulaPool() {
+	formulaBytes = 0;
+}
+
+FormulaPool::~FormulaPool() {
+	qDeleteAll(formulas);
+}
+
+//The shared form of a formula typed into the cell at row and column,
+//compiled the first time it is seen. The caller owns a reference to
+//it, which it gives back with SharedFormula::release().
+//The key is the text with each reference replaced by its offset in
+//brackets; a '[' of the text itself is doubled, so a formula that
+//isn't valid can't pass for one with references.
+const SharedFormula *FormulaPool::intern(const QString &formula, int row, int column) {
+	QString expression = formula.mid(1);
+	expression.replace(" ", "");
+
+	QStringList pieces;
+	QVector<CellRef> offsets;
+	QString piece;
+	QString key;
+	int pos = 0;
+	while (pos < expression.size()) {
+		QChar ch = expression[pos];
+		if (!ch.isLetterOrNumber() && ch != '.') {
+			piece += ch;
+			key += ch == '[' ? QString("[[") : QString(ch);
+			++pos;
+			continue;
+		}
+		//The same tokens Formula::compile() reads.
+		int start = pos;
+		while (pos < expression.size()
+			&& (expression[pos].isLetterOrNumber() || expression[pos] == '.'))
+			++pos;
+		QString token = expression.mid(start, pos - start);
+		CellRef ref;
+		bool isCall = pos < expression.size() && expression[pos] == '(';
+		if (!isCall && CellRef::parse(token, ref)) {
+			CellRef offset = { ref.row - row, ref.column - column };
+			pieces.append(piece);
+			piece.clear();
+			offsets.append(offset);
+			key += QString("[%1,%2]").arg(offset.row).arg(offset.column);
+		}
+		else {
+			piece += token;
+			key += token;
+		}
+	}
+	pieces.append(piece);
+
+	{
+		QMutexLocker locker(&mutex);
+		SharedFormula *found = formulas.value(key);
+		if (found) {
+			++found->refs;
+			return found;
+		}
+	}
+
+	SharedFormula *shared = new SharedFormula;
+	shared->compiled = Formula::compile(expression, row, column);
+	shared->pieces = pieces;
+	shared->offsets = offsets;
+	shared->key = key;
+	shared->pool = this;
+	shared->refs = 1;
+
+	QMutexLocker locker(&mutex);
+	SharedFormula *&slot = formulas[key];
+	if (slot) { //Another thread compiled it meanwhile.
+		delete shared;
+		++slot->refs;
+		return slot;
+	}
+	slot = shared;
+	formulaBytes += formulaSize(shared);
+	return shared;
+}
+
+//The key, the pieces and a program about as long, roughly.
+qint64 FormulaPool::formulaSize(const SharedFormula *shared) {
+	return sizeof(SharedFormula) + 3 * (24 + (shared->key.size() + 1) * sizeof(QChar))
+		+ shared->offsets.size() * sizeof(CellRef);
+}
+
+int FormulaPool::count() const {
+	QMutexLocker locker(&mutex);
+	return formulas.size();
+}
+
+qint64 FormulaPool::bytes() const {
+	QMutexLocker locker(&mutex);
+	return qint64(sizeof(*this)) + formulaBytes
+		+ qint64(formulas.capacity()) * (sizeof(void *) + 32);//A QHash node, roughly.
+}
+
+int FormulaPool::allocations() const {
+	QMutexLocker locker(&mutex);
+	return 6 * formulas.size() + 1;//Formulas, their vectors and texts, nodes, buckets.
+}
@@ -0,0 +1,64 @@
+#ifndef FORMULAPOOL_H
+#define FORMULAPOOL_H
+
+#include <qhash.h>
+#include <qmutex.h>
+#include <qstringlist.h>
+
+#include "formula.h"
+
+class FormulaPool;
+
+//A formula as every cell of a filled-down range holds it: "=A1*B1" in
+//C1 and "=A2*B2" in C2 both read the two cells to their left. It is
+//compiled once, and the text of each copy is rebuilt from the cell's
+//position, so the cells keep no text of their own.
+class SharedFormula
+{
+public:
+	const Formula &program() const { return compiled; }
+	QString text(int row, int column) const;
+	void retain() const;
+	void release() const;
+
+private:
+	friend class FormulaPool;
+
+	Formula compiled;
+	QStringList pieces;//The text between references, one more than offsets.
+	QVector<CellRef> offsets;
+	QString key;
+	FormulaPool *pool;
+	mutable int refs;//Cells holding it; the pool's mutex guards it.
+};
+
+//The SharedFormulas of a sheet, found by their R1C1 form.
+//Formulas never move, so any thread can use one it was handed without
+//a lock; interning takes a mutex, as mapped blocks are decoded on the
+//thread pool. Like the StringPool, the pool counts the cells holding
+//each formula and frees it when the last one lets go.
+//Cells must be gone before the pool is.
+class FormulaPool
+{
+public:
+	FormulaPool();
+	~FormulaPool();
+
+	const SharedFormula *intern(const QString &formula, int row, int column);
+	int count() const;
+	qint64 bytes() const;
+	int allocations() const;
+
+private:
+	friend class SharedFormula;
+
+	Q_DISABLE_COPY(FormulaPool)
+
+	static qint64 formulaSize(const SharedFormula *shared);
+
+	QHash<QString, SharedFormula *> formulas;
+	qint64 formulaBytes;
+	mutable QMutex mutex;
+};
+
+#endif
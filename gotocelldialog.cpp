@@ -8,7 +8,7 @@ GoToCellDialog::GoToCellDialog(QWidget *parent)
 	setupUi(this);
 	buttonBox->button(QDialogButtonBox::Ok)->setEnabled(false);
 
-	QRegExp regExp("[A-Za-z][1-9][0-9]{0,2}");
+	QRegExp regExp("[A-Za-z]{1,3}[1-9][0-9]{0,6}");
 	lineEdit->setValidator(new QRegExpValidator(regExp, this));
 
 	connect(buttonBox, SIGNAL(accepted()), this, SLOT(accept()));
@@ -3,17 +3,23 @@
 #include <qmenubar.h>
 #include <qtoolbar.h>
 #include <qlabel.h>
+#include <qprogressbar.h>
 #include <qstatusbar.h>
 #include <qmessagebox.h>
+#include <qfile.h>
 #include <qfiledialog.h>
 #include <qfileinfo.h>
 #include <qtablewidget.h>
 
+#include "cellref.h"
 #include "finddialog.h"
 #include "gotocelldialog.h"
 #include "mainwindow.h"
+#include "profilepanel.h"
 #include "sortdialog.h"
 #include "spreadsheet.h"
+#include "spreadsheetcompare.h"
+#include "tracelog.h"
 
 QStringList MainWindow::recentFiles;//1.1 add-in.
 
@@ -22,6 +28,12 @@ MainWindow::MainWindow() {
 	setCentralWidget(spreadsheet);
 	setAttribute(Qt::WA_DeleteOnClose);//1.1 add-in. Delete the newed object when close.
 
+	profilePanel = new ProfilePanel(spreadsheet, this);
+	addDockWidget(Qt::BottomDockWidgetArea, profilePanel);
+	profilePanel->hide();
+	connect(profilePanel, SIGNAL(showCell(int, int)),
+		spreadsheet, SLOT(showCell(int, int)));
+
 	createAction();
 	createMenus();
 	createContextMenu();
@@ -94,6 +106,60 @@ bool MainWindow::saveAs() {
 	return saveFile(fileName);
 }
 
+//Reads a CSV or TSV file into an untitled sheet.
+void MainWindow::importFile() {
+	if (!okToContinue())
+		return;
+	QString fileName = QFileDialog::getOpenFileName(this,
+		tr("Import"), ".",
+		tr("Delimited Files(*.csv *.tsv *.tab *.txt)"));
+	if (fileName.isEmpty())
+		return;
+
+	DelimitedFile::Stats stats;
+	if (!spreadsheet->importFile(fileName, &stats)) {
+		statusBar()->showMessage(tr("Import canceled"), 2000);
+		return;
+	}
+	setCurrentFile("");
+	setWindowModified(true);
+	showThroughput(tr("Imported"), stats);
+}
+
+void MainWindow::exportValues() {
+	exportFile(false);
+}
+
+void MainWindow::exportFormulas() {
+	exportFile(true);
+}
+
+void MainWindow::exportFile(bool formulas) {
+	QString fileName = QFileDialog::getSaveFileName(this,
+		tr("Export"), "./Untitled.csv",
+		tr("Comma-separated (*.csv);;Tab-separated (*.tsv)"));
+	if (fileName.isEmpty())
+		return;
+
+	DelimitedFile::Stats stats;
+	if (!spreadsheet->exportFile(fileName,
+		formulas ? DelimitedFile::Formulas : DelimitedFile::Values, &stats)) {
+		statusBar()->showMessage(tr("Export canceled"), 2000);
+		return;
+	}
+	showThroughput(tr("Exported"), stats);
+}
+
+void MainWindow::showThroughput(const QString &what,
+	const DelimitedFile::Stats &stats) {
+	statusBar()->showMessage(tr("%1 %2 cells, %3 MB in %4 ms (%5 MB/s)")
+		.arg(what)
+		.arg(stats.cells)
+		.arg(stats.bytes / (1024.0 * 1024.0), 0, 'f', 1)
+		.arg(stats.msecs)
+		.arg(stats.megabytesPerSecond(), 0, 'f', 1), 5000);
+}
+
 void MainWindow::find() {
 	if (!findDialog) {
 		findDialog = new FindDialog(this);
@@ -101,6 +167,28 @@ void MainWindow::find() {
 			spreadsheet, SLOT(findNext(const QString&, Qt::CaseSensitivity)));
 		connect(findDialog, SIGNAL(findPrevious(const QString&, Qt::CaseSensitivity)),
 			spreadsheet, SLOT(findPrevious(const QString&, Qt::CaseSensitivity)));
+		connect(findDialog, SIGNAL(findAll(const QString&, Qt::CaseSensitivity)),
+			spreadsheet, SLOT(findAll(const QString&, Qt::CaseSensitivity)));
+		connect(findDialog, SIGNAL(findMatching(const QRegularExpression&)),
+			spreadsheet, SLOT(findMatching(const QRegularExpression&)));
+		connect(findDialog, SIGNAL(cancelSearch()),
+			spreadsheet, SLOT(cancelFind()));
+		connect(findDialog, SIGNAL(replaceNext(const QString&, Qt::CaseSensitivity, const QString&)),
+			spreadsheet, SLOT(replaceNext(const QString&, Qt::CaseSensitivity, const QString&)));
+		connect(findDialog, SIGNAL(replaceAll(const QString&, Qt::CaseSensitivity, const QString&)),
+			spreadsheet, SLOT(replaceAll(const QString&, Qt::CaseSensitivity, const QString&)));
+		connect(findDialog, SIGNAL(replaceMatching(const QRegularExpression&, const QString&)),
+			spreadsheet, SLOT(replaceMatching(const QRegularExpression&, const QString&)));
+		connect(spreadsheet, SIGNAL(cellsReplaced(int)),
+			findDialog, SLOT(showReplaced(int)));
+		connect(spreadsheet, SIGNAL(searchStarted()),
+			findDialog, SLOT(clearResults()));
+		connect(spreadsheet, SIGNAL(searchFound(const QVector<CellRef>&, const QStringList&)),
+			findDialog, SLOT(addResults(const QVector<CellRef>&, const QStringList&)));
+		connect(spreadsheet, SIGNAL(searchFinished(int)),
+			findDialog, SLOT(showTotal(int)));
+		connect(findDialog, SIGNAL(showCell(int, int)),
+			spreadsheet, SLOT(showCell(int, int)));
 	}
 	//If findDialog already existed, function show() won't do anything.
 	findDialog->show();
@@ -111,42 +199,54 @@ void MainWindow::find() {
 void MainWindow::goToCell() {
 	GoToCellDialog dialog(this);
 	if (dialog.exec()) {
-		QString str = dialog.lineEdit->text().toUpper();
-		spreadsheet->setCurrentCell(str.mid(1).toInt() - 1,
-			str[0].unicode() - 'A');
+		CellRef ref;
+		if (CellRef::parse(dialog.lineEdit->text(), ref))
+			spreadsheet->setCurrentCell(ref.row, ref.column);
 	}
 }
 
 void MainWindow::sort() {
 	SortDialog dialog(this);
 	QTableWidgetSelectionRange range = spreadsheet->selectedRange();
-	dialog.setColumnRange('A' + range.leftColumn(),
-		'A' + range.rightColumn());
+	dialog.setColumnRange(range.leftColumn(), range.rightColumn());
 
 	if (dialog.exec()) {
+		//The dialog has three keys; SpreadsheetCompare takes any number.
 		SpreadsheetCompare compare;
-		compare.keys[0] =
-			dialog.primaryColumnCombo->currentIndex();
-		compare.keys[1] =
-			dialog.secondaryColumnCombo->currentIndex() - 1;
-		compare.keys[2] =
-			dialog.tertiaryColumnCombo->currentIndex() - 1;
-		compare.ascending[0] =
-			(dialog.primaryColumnCombo->currentIndex() == 0);
-		compare.ascending[1] =
-			(dialog.secondaryColumnCombo->currentIndex() == 0);
-		compare.ascending[2] =
-			(dialog.tertiaryColumnCombo->currentIndex() == 0);
+		compare.addKey(dialog.primaryColumnCombo->currentIndex(),
+			dialog.primaryOrderCombo->currentIndex() == 0);
+		compare.addKey(dialog.secondaryColumnCombo->currentIndex() - 1,
+			dialog.secondaryOrderCombo->currentIndex() == 0);
+		compare.addKey(dialog.tertiaryColumnCombo->currentIndex() - 1,
+			dialog.tertiaryOrderCombo->currentIndex() == 0);
 		spreadsheet->sort(compare);
 	}
 }
 
+//Opens in chrome://tracing or ui.perfetto.dev.
+void MainWindow::exportTrace() {
+	QString fileName = QFileDialog::getSaveFileName(this,
+		tr("Export Trace"), "./trace.json", tr("Chrome trace (*.json)"));
+	if (fileName.isEmpty())
+		return;
+
+	QFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly) || file.write(TraceLog::toJson()) == -1) {
+		QMessageBox::warning(this, tr("Spreadsheet"),
+			tr("Cannot write file %1:\n%2.")
+			.arg(file.fileName())
+			.arg(file.errorString()));
+		return;
+	}
+	statusBar()->showMessage(tr("Trace exported"), 2000);
+}
+
 void MainWindow::about() {
 	QMessageBox::about(this, tr("About MySpreadsheet"),
 		tr("<h2>MySpreadsheet 1.1<h2>"
 		"<p>MySpreadsheet is a small application that "
 		"demonstrasts QAction, QMainWindow, QMenuBar, "
-		"QStatusBar, QTableWidget, QToolBar, and many other"
+		"QStatusBar, QTableView, QToolBar, and many other"
 		"Qt classes."));
 }
 
@@ -164,9 +264,27 @@ void MainWindow::updateStatusBar() {
 	formulaLabel->setText(spreadsheet->currentFormula());
 }
 
+//Shown only while a background recalculation is running.
+void MainWindow::updateRecalcProgress(int done, int total) {
+	if (done < total) {
+		recalcProgressBar->setRange(0, total);
+		recalcProgressBar->setValue(done);
+		recalcProgressBar->show();
+	}
+	else {
+		recalcProgressBar->hide();
+	}
+}
+
 void MainWindow::spreadsheetModified() {
 	setWindowModified(true);
 	updateStatusBar();
+	updateUndoActions();
+}
+
+void MainWindow::updateUndoActions() {
+	undoAction->setEnabled(spreadsheet->canUndo());
+	redoAction->setEnabled(spreadsheet->canRedo());
 }
 
 void MainWindow::createAction() {
@@ -192,6 +310,18 @@ void MainWindow::createAction() {
 	saveAsAction->setStatusTip(tr("Save the spreadsheet under a new name"));
 	connect(saveAsAction, SIGNAL(triggered()), this, SLOT(saveAs()));
 
+	importAction = new QAction(tr("&Import..."), this);
+	importAction->setStatusTip(tr("Read a CSV or TSV file into a new sheet"));
+	connect(importAction, SIGNAL(triggered()), this, SLOT(importFile()));
+
+	exportValuesAction = new QAction(tr("Export &Values..."), this);
+	exportValuesAction->setStatusTip(tr("Write the values of the sheet to a CSV or TSV file"));
+	connect(exportValuesAction, SIGNAL(triggered()), this, SLOT(exportValues()));
+
+	exportFormulasAction = new QAction(tr("Export &Formulas..."), this);
+	exportFormulasAction->setStatusTip(tr("Write the formulas of the sheet to a CSV or TSV file"));
+	connect(exportFormulasAction, SIGNAL(triggered()), this, SLOT(exportFormulas()));
+
 	for (int i = 0; i != MaxRecentFiles; ++i) {
 		recentFileActions[i] = new QAction(this);
 		recentFileActions[i]->setVisible(false);
@@ -216,6 +346,18 @@ void MainWindow::createAction() {
 	//version 1.1:
 	connect(exitAction, SIGNAL(triggered()), qApp, SLOT(closeAllWindows()));
 
+	undoAction = new QAction(tr("&Undo"), this);
+	undoAction->setShortcut(QKeySequence::Undo);
+	undoAction->setStatusTip(tr("Undo the last change"));
+	undoAction->setEnabled(false);
+	connect(undoAction, SIGNAL(triggered()), spreadsheet, SLOT(undo()));
+
+	redoAction = new QAction(tr("&Redo"), this);
+	redoAction->setShortcut(QKeySequence::Redo);
+	redoAction->setStatusTip(tr("Redo the last change undone"));
+	redoAction->setEnabled(false);
+	connect(redoAction, SIGNAL(triggered()), spreadsheet, SLOT(redo()));
+
 	cutAction = new QAction(tr("&Cut"), this);
 	cutAction->setIcon(QIcon(":/images/cut.png"));
 	cutAction->setShortcut(QKeySequence::Cut);
@@ -274,6 +416,10 @@ void MainWindow::createAction() {
 	sortAction->setStatusTip(tr("Sort the selected cells or all the cells"));
 	connect(sortAction, SIGNAL(triggered()), this, SLOT(sort()));
 
+	exportTraceAction = new QAction(tr("Export &Trace..."), this);
+	exportTraceAction->setStatusTip(tr("Write the latest load, save, recalculation and paint timings as a Chrome trace"));
+	connect(exportTraceAction, SIGNAL(triggered()), this, SLOT(exportTrace()));
+
 	showGridAction = new QAction(tr("&Show Grid"), this);
 	showGridAction->setCheckable(true);
 	showGridAction->setChecked(spreadsheet->showGrid());
@@ -302,6 +448,10 @@ void MainWindow::createMenus() {
 	fileMenu->addAction(openAction);
 	fileMenu->addAction(saveAction);
 	fileMenu->addAction(saveAsAction);
+	fileMenu->addSeparator();
+	fileMenu->addAction(importAction);
+	fileMenu->addAction(exportValuesAction);
+	fileMenu->addAction(exportFormulasAction);
 	separatorAction = fileMenu->addSeparator();
 	for (int i = 0; i != MaxRecentFiles; ++i)
 		fileMenu->addAction(recentFileActions[i]);
@@ -310,6 +460,9 @@ void MainWindow::createMenus() {
 	fileMenu->addAction(exitAction);
 
 	editMenu = menuBar()->addMenu(tr("&Edit"));
+	editMenu->addAction(undoAction);
+	editMenu->addAction(redoAction);
+	editMenu->addSeparator();
 	editMenu->addAction(cutAction);
 	editMenu->addAction(copyAction);
 	editMenu->addAction(pasteAction);
@@ -327,6 +480,9 @@ void MainWindow::createMenus() {
 	toolsMenu = menuBar()->addMenu(tr("&Tools"));
 	toolsMenu->addAction(recalculateAction);
 	toolsMenu->addAction(sortAction);
+	toolsMenu->addSeparator();
+	toolsMenu->addAction(profilePanel->toggleViewAction());
+	toolsMenu->addAction(exportTraceAction);
 
 	optionsMenu = menuBar()->addMenu(tr("&Options"));
 	optionsMenu->addAction(showGridAction);
@@ -363,21 +519,32 @@ void MainWindow::createToolBars() {
 }
 
 void MainWindow::createStatusBar() {
-	locationlabel = new QLabel(" W999 ");
+	locationlabel = new QLabel(" XFD1048576 ");
 	locationlabel->setAlignment(Qt::AlignHCenter);
 	locationlabel->setMinimumSize(locationlabel->sizeHint());
 
 	formulaLabel = new QLabel;
 	formulaLabel->setIndent(3);
 
+	recalcProgressBar = new QProgressBar;
+	recalcProgressBar->setFormat(tr("Recalculating %p%"));
+	recalcProgressBar->setMaximumWidth(200);
+	recalcProgressBar->hide();
+
 	statusBar()->addWidget(locationlabel);
 	statusBar()->addWidget(formulaLabel, 1);
+	statusBar()->addPermanentWidget(recalcProgressBar);
 
 	//Connect the change of the selected cell' positon and the statusbar 
 	connect(spreadsheet, SIGNAL(currentCellChanged(int, int, int, int)),
 		this, SLOT(updateStatusBar()));
 	//Connect the change of the selected cell' text and the statusbar
 	connect(spreadsheet, SIGNAL(modified()), this, SLOT(spreadsheetModified()));
+	//Connect the end of a background save and the statusbar
+	connect(spreadsheet, SIGNAL(fileWritten(bool)), this, SLOT(fileWritten(bool)));
+	//Connect the background recalculation and the statusbar
+	connect(spreadsheet, SIGNAL(recalculationProgress(int, int)),
+		this, SLOT(updateRecalcProgress(int, int)));
 
 	updateStatusBar();
 }
@@ -403,6 +570,10 @@ void MainWindow::readSettings() {
 
 	bool autoRecalc = settings.value("autoRecalc", true).toBool();
 	autoRecalcAtion->setChecked(autoRecalc);
+
+	//Undo history kept in memory, in MB; older steps go to a temporary file.
+	undoMemoryLimit = qMax(settings.value("undoMemoryLimit", 64).toInt(), 1);
+	spreadsheet->setUndoMemoryLimit(qint64(undoMemoryLimit) * 1024 * 1024);
 }
 
 void MainWindow::writeSettings() {
@@ -412,17 +583,19 @@ void MainWindow::writeSettings() {
 	settings.setValue("recentFiles", recentFiles);
 	settings.setValue("showGrid", showGridAction->isChecked());
 	settings.setValue("autoRecalc", autoRecalcAtion->isChecked());
+	settings.setValue("undoMemoryLimit", undoMemoryLimit);
 };
 
 
 bool MainWindow::okToContinue() {
+	spreadsheet->finishWriting();//A save that failed leaves the window modified.
 	if (isWindowModified()) {
 		int r = QMessageBox::warning(this, tr("MySpreadsheet"),
 			tr("The document has been modified.\n"
 			"Do you want to save your changes?"),
 			QMessageBox::Yes | QMessageBox::No | QMessageBox::Cancel);
 		if (r == QMessageBox::Yes) {
-			return save();
+			return save() && spreadsheet->finishWriting();
 		}
 		else if (r == QMessageBox::Cancel) {
 			return false;
@@ -449,13 +622,30 @@ bool MainWindow::saveFile(const QString &fileName) {
 	}
 
 	setCurrentFile(fileName);
-	statusBar()->showMessage(tr("File saved"), 2000);
+	if (spreadsheet->isWriting()) { //Editing goes on meanwhile.
+		statusBar()->showMessage(tr("Saving..."));
+	}
+	else {
+		statusBar()->showMessage(tr("File saved"), 2000);
+	}
 	return true;
 }
 
+//A background save is done; if it failed, the changes are unsaved again.
+void MainWindow::fileWritten(bool ok) {
+	if (ok) {
+		statusBar()->showMessage(tr("File saved"), 2000);
+	}
+	else {
+		setWindowModified(true);
+		statusBar()->showMessage(tr("Saving failed"), 2000);
+	}
+}
+
 void MainWindow::setCurrentFile(const QString &fileName) {
 	curFile = fileName;
 	setWindowModified(false);
+	updateUndoActions();
 
 	QString shownName = tr("Untitle");
 	if (!curFile.isEmpty()) {
@@ -3,9 +3,13 @@
 
 #include <qmainwindow.h>
 
+#include "delimitedfile.h"
+
 class QAction;
 class QLabel;
+class QProgressBar;
 class FindDialog;
+class ProfilePanel;
 class Spreadsheet;
 
 class MainWindow : public  QMainWindow
@@ -23,13 +27,19 @@ protected:
 	void open();
 	bool save();
 	bool saveAs();
+	void importFile();
+	void exportValues();
+	void exportFormulas();
 	void find();
 	void goToCell();
 	void sort();
+	void exportTrace();
 	void about();
 	void openRecentFile();
 	void updateStatusBar();
+	void updateRecalcProgress(int done, int total);
 	void spreadsheetModified();
+	void fileWritten(bool ok);
 
 private:
 	void createAction();
@@ -42,16 +52,22 @@ private:
 	bool okToContinue();
 	bool loadFile(const QString &fileName);
 	bool saveFile(const QString &fileName);
+	void exportFile(bool formulas);
+	void showThroughput(const QString &what, const DelimitedFile::Stats &stats);
 	void setCurrentFile(const QString &fileName);
+	void updateUndoActions();
 	void updateRecentFileActions();
 	QString strippedName(const QString &fullName);
 
 	Spreadsheet *spreadsheet;
 	FindDialog *findDialog;
+	ProfilePanel *profilePanel;
 	QLabel *locationlabel;
 	QLabel *formulaLabel;
+	QProgressBar *recalcProgressBar;
 	static QStringList recentFiles;//1.1 add-in.
 	QString curFile;
+	int undoMemoryLimit;//In MB.
 
 	enum { MaxRecentFiles = 5 };
 	QAction *recentFileActions[MaxRecentFiles];
@@ -69,8 +85,13 @@ private:
 	QAction *openAction;
 	QAction *saveAction;
 	QAction *saveAsAction;
+	QAction *importAction;
+	QAction *exportValuesAction;
+	QAction *exportFormulasAction;
 	QAction *closeAction;//Added in in version 1.1
 	QAction *exitAction;
+	QAction *undoAction;
+	QAction *redoAction;
 	QAction *cutAction;
 	QAction *copyAction;
 	QAction *pasteAction;
@@ -82,6 +103,7 @@ private:
 	QAction *goToCellAction;
 	QAction *recalculateAction;
 	QAction *sortAction;
+	QAction *exportTraceAction;
 	QAction *showGridAction;
 	QAction *autoRecalcAtion;
 	QAction *aboutAction;
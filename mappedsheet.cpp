@@ -0,0 +1,351 @@
+#include <limits.h>
+
+#include <qtconcurrentmap.h>
+
+#include "cell.h"
+#include "cellstore.h"
+#include "mappedsheet.h"
+
+namespace {
+
+enum {
+	BatchBlocks = 512,//Blocks compressed together before any is written.
+	CompressionLevel = 1//Fast zlib; the blocks are small and mostly numbers.
+};
+
+//A block on its way to the file: encoded while the store is walked,
+//then compressed and checksummed on the thread pool.
+struct EncodedBlock
+{
+	int column;
+	int number;
+	int count;
+	int lastSlot;
+	QByteArray bytes;
+	quint32 rawSize;//0 if bytes didn't compress.
+	quint32 checksum;
+};
+
+struct CrcTable
+{
+	quint32 entries[256];
+
+	CrcTable() {
+		for (quint32 i = 0; i < 256; ++i) {
+			quint32 c = i;
+			for (int k = 0; k < 8; ++k)
+				c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			entries[i] = c;
+		}
+	}
+};
+
+}
+
+//CRC-32 as in zip and PNG.
+static quint32 crc32(const uchar *data, qint64 length) {
+	static const CrcTable table;
+	quint32 crc = 0xFFFFFFFFu;
+	for (qint64 i = 0; i < length; ++i)
+		crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFFu;
+}
+
+static void append16(QByteArray &bytes, quint16 value) {
+	uchar le[2];
+	qToLittleEndian(value, le);
+	bytes.append(reinterpret_cast<const char *>(le), sizeof(le));
+}
+
+static void append32(QByteArray &bytes, quint32 value) {
+	uchar le[4];
+	qToLittleEndian(value, le);
+	bytes.append(reinterpret_cast<const char *>(le), sizeof(le));
+}
+
+static void append64(QByteArray &bytes, quint64 value) {
+	uchar le[8];
+	qToLittleEndian(value, le);
+	bytes.append(reinterpret_cast<const char *>(le), sizeof(le));
+}
+
+MappedSheet::MappedSheet() {
+	data = 0;
+	size = 0;
+	blocks = 0;
+	cells = 0;
+	indexOffset = 0;
+	entrySize = EntrySize;
+}
+
+MappedSheet::~MappedSheet() {
+}
+
+//Checks the header and the index bounds only; nothing is decoded here.
+//Falls back to reading the file into memory where it can't be mapped.
+bool MappedSheet::open(const QString &fileName) {
+	file.setFileName(fileName);
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+	size = file.size();
+	data = file.map(0, size);
+	if (!data) {
+		buffer = file.readAll();
+		data = reinterpret_cast<const uchar *>(buffer.constData());
+		size = buffer.size();
+	}
+	if (size < HeaderSize
+		|| qFromLittleEndian<quint32>(data) != quint32(MagicNumber)
+		|| qFromLittleEndian<quint32>(data + 8) != quint32(CellStore::BlockSize))
+		return false;
+	quint32 version = qFromLittleEndian<quint32>(data + 4);
+	if (version == Version) {
+		entrySize = EntrySize;
+	}
+	else if (version == UncompressedVersion) {
+		entrySize = UncompressedEntrySize;
+	}
+	else {
+		return false;
+	}
+
+	quint32 count = qFromLittleEndian<quint32>(data + 12);
+	cells = qint64(qFromLittleEndian<quint64>(data + 16));
+	quint64 offset = qFromLittleEndian<quint64>(data + 24);
+	if (offset > quint64(size) || count > (quint64(size) - offset) / quint32(entrySize))
+		return false;
+	blocks = int(count);
+	indexOffset = qint64(offset);
+	return true;
+}
+
+//The first index entry at or after (column, block).
+int MappedSheet::lowerBound(int column, int block) const {
+	int first = 0;
+	int last = blocks;
+	while (first < last) {
+		int middle = (first + last) / 2;
+		int c = this->column(middle);
+		if (c < column || (c == column && this->block(middle) < block)) {
+			first = middle + 1;
+		}
+		else {
+			last = middle;
+		}
+	}
+	return first;
+}
+
+//The index entry of (column, block), or -1 if the file has no such block.
+int MappedSheet::find(int column, int block) const {
+	int i = lowerBound(column, block);
+	if (i < blocks && this->column(i) == column && this->block(i) == block)
+		return i;
+	return -1;
+}
+
+//Points bytes at the decoded block of index, after checking its bounds
+//and checksum. A compressed block is inflated into buffer.
+bool MappedSheet::blockData(int index, const uchar *&bytes, quint64 &length,
+	QByteArray &buffer) const {
+	quint64 offset = field64(index, 16);
+	length = field64(index, 24);
+	if (offset > quint64(size) || length > quint64(size) - offset)
+		return false;
+	bytes = data + offset;
+	if (entrySize == UncompressedEntrySize)
+		return true;
+
+	quint32 rawSize = field32(index, 32);
+	if (crc32(bytes, qint64(length)) != field32(index, 36))
+		return false;
+	if (rawSize == 0)
+		return true;
+	buffer = qUncompress(bytes, int(qMin(length, quint64(INT_MAX))));
+	if (quint32(buffer.size()) != rawSize)
+		return false;
+	bytes = reinterpret_cast<const uchar *>(buffer.constData());
+	length = rawSize;
+	return true;
+}
+
+static void compressBlock(EncodedBlock &block) {
+	QByteArray compressed = qCompress(block.bytes, CompressionLevel);
+	block.rawSize = 0;
+	if (compressed.size() < block.bytes.size()) {
+		block.rawSize = block.bytes.size();
+		block.bytes = compressed;
+	}
+	block.checksum = crc32(reinterpret_cast<const uchar *>(block.bytes.constData()),
+		block.bytes.size());
+}
+
+//Writes the occupied cells of the store block by block, in the order
+//CellStore::visit() meets them, so the index comes out sorted. Blocks
+//are encoded during the walk and compressed a batch at a time.
+bool MappedSheet::write(QFileDevice &file, const CellStore &store) {
+	bool ok = file.write(QByteArray(HeaderSize, 0)) == HeaderSize;
+
+	QByteArray index;
+	QByteArray records;
+	QByteArray text;
+	QVector<EncodedBlock> batch;
+	int blockColumn = -1;
+	int blockNumber = -1;
+	int count = 0;
+	int lastSlot = 0;
+	quint64 offset = HeaderSize;
+	quint32 blockTotal = 0;
+	quint64 cellTotal = 0;
+
+	auto writeBatch = [&]() {
+		QtConcurrent::blockingMap(batch, compressBlock);
+		foreach(const EncodedBlock &block, batch) {
+			ok = ok && file.write(block.bytes) == block.bytes.size();
+			int padding = (8 - block.bytes.size() % 8) % 8;
+			ok = ok && file.write(QByteArray(padding, 0)) == padding;
+
+			append32(index, block.column);
+			append32(index, block.number);
+			append32(index, block.count);
+			append32(index, block.lastSlot);
+			append64(index, offset);
+			append64(index, block.bytes.size());
+			append32(index, block.rawSize);
+			append32(index, block.checksum);
+
+			offset += block.bytes.size() + padding;
+			++blockTotal;
+			cellTotal += block.count;
+		}
+		batch.clear();
+	};
+
+	auto flush = [&]() {
+		if (count == 0)
+			return;
+		EncodedBlock block;
+		block.column = blockColumn;
+		block.number = blockNumber;
+		block.count = count;
+		block.lastSlot = lastSlot;
+		block.bytes.reserve(8 + records.size() + text.size());
+		append32(block.bytes, count);
+		append32(block.bytes, 0);
+		block.bytes.append(records);
+		block.bytes.append(text);
+		batch.append(block);
+		if (batch.size() >= BatchBlocks)
+			writeBatch();
+
+		records.clear();
+		text.clear();
+		count = 0;
+	};
+
+	store.visit([&](int row, int column, const Cell *) {
+		int number = row / CellStore::BlockSize;
+		if (column != blockColumn || number != blockNumber) {
+			flush();
+			blockColumn = column;
+			blockNumber = number;
+		}
+		lastSlot = row % CellStore::BlockSize;
+		append16(records, quint16(lastSlot));
+		if (!store.isNumber(row, column)) {
+			QString formula = store.formula(row, column);
+			append16(records, TextKind);
+			append32(records, formula.size());
+			append64(records, text.size());
+			for (int i = 0; i < formula.size(); ++i)
+				append16(text, formula[i].unicode());
+		}
+		else { //A plain number.
+			double d = store.value(row, column).toDouble();
+			quint64 bits;
+			memcpy(&bits, &d, sizeof(bits));
+			append16(records, NumberKind);
+			append32(records, 0);
+			append64(records, bits);
+		}
+		++count;
+	});
+	flush();
+	writeBatch();
+	ok = ok && file.write(index) == index.size();
+
+	QByteArray header;
+	append32(header, MagicNumber);
+	append32(header, Version);
+	append32(header, CellStore::BlockSize);
+	append32(header, blockTotal);
+	append64(header, cellTotal);
+	append64(header, offset);
+	append64(header, 0);
+	return ok && file.seek(0) && file.write(header) == header.size();
+}
+
+//The bytes of journal after the base image of an open version 2 file,
+//or -1 if the file isn't one. baseSize gets the size of the base image.
+qint64 MappedSheet::journalSize(QFile &file, qint64 *baseSize) {
+	uchar header[HeaderSize];
+	if (!file.seek(0) || file.read(reinterpret_cast<char *>(header), HeaderSize) != HeaderSize
+		|| qFromLittleEndian<quint32>(header) != quint32(MagicNumber))
+		return -1;
+	quint32 version = qFromLittleEndian<quint32>(header + 4);
+	if (version != Version && version != UncompressedVersion)
+		return -1;
+
+	quint64 base = qFromLittleEndian<quint64>(header + 24)
+		+ quint64(qFromLittleEndian<quint32>(header + 12))
+		* (version == Version ? EntrySize : UncompressedEntrySize);
+	if (base > quint64(file.size()))
+		return -1;
+	if (baseSize)
+		*baseSize = qint64(base);
+	return file.size() - qint64(base);
+}
+
+//Appends one segment with the current formula of each changed cell,
+//or its bits if it is a plain number, as the base image keeps it.
+//The file is cut back to its old size if the segment can't be written
+//whole, so a failed save never hides the segments of later ones.
+bool MappedSheet::appendJournal(QFile &file, const CellStore &store,
+	const QVector<CellRef> &changed) {
+	if (changed.isEmpty())
+		return true;
+
+	QByteArray segment;
+	segment.reserve(SegmentHeaderSize + changed.size() * (JournalRecordSize + 16));
+	append32(segment, NumberJournalMagic);
+	append32(segment, changed.size());
+	append64(segment, 0);
+	foreach(const CellRef &ref, changed) {
+		append32(segment, ref.row);
+		append32(segment, ref.column);
+		if (!store.contains(ref.row, ref.column)) {
+			append32(segment, quint32(RemovedRecord));
+			continue;
+		}
+		if (store.isNumber(ref.row, ref.column)) {
+			double d = store.value(ref.row, ref.column).toDouble();
+			quint64 bits;
+			memcpy(&bits, &d, sizeof(bits));
+			append32(segment, quint32(NumberRecord));
+			append64(segment, bits);
+			continue;
+		}
+		QString formula = store.formula(ref.row, ref.column);
+		append32(segment, formula.size());
+		for (int i = 0; i < formula.size(); ++i)
+			append16(segment, formula[i].unicode());
+	}
+	qToLittleEndian(quint64(segment.size() - SegmentHeaderSize),
+		reinterpret_cast<uchar *>(segment.data() + 8));
+
+	qint64 end = file.size();
+	if (file.seek(end) && file.write(segment) == segment.size() && file.flush())
+		return true;
+	file.resize(end);
+	return false;
+}
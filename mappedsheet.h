@@ -0,0 +1,204 @@
+#ifndef MAPPEDSHEET_H
+#define MAPPEDSHEET_H
+
+#include <string.h>
+
+#include <qbytearray.h>
+#include <qendian.h>
+#include <qfile.h>
+#include <qstring.h>
+#include <qvector.h>
+
+#include "cellref.h"
+
+class CellStore;
+
+//The version 3 file format, laid out to be read through a memory map:
+//
+//  header  magic, version, block size, block count, cell count, index offset
+//  blocks  per block: the cell count, a record per cell (slot, kind,
+//          length, value) and the UTF-16 text of its text and formula
+//          cells; a number is the record's value, a text its offset.
+//          Each block is stored compressed unless that doesn't shrink it
+//  index   per block: column, block number, cell count, last slot,
+//          offset, stored size, uncompressed size (0 if stored as is)
+//          and a CRC-32 of the stored bytes, sorted by column and block
+//  journal segments appended by later saves: magic, record count and
+//          byte length, then per changed cell its row, column and the
+//          length and UTF-16 text of its formula, -1 for a removed
+//          cell, or -2 and the 8 bytes of a plain number
+//
+//All integers are little-endian. Opening only checks the header; a block
+//is checked and decoded the first time the CellStore it is mapped into
+//touches it. Blocks are independent, so they are compressed and
+//decompressed on the thread pool.
+//The journal is replayed over the blocks, oldest segment first.
+//Segments that may hold numbers have a magic of their own, so readers
+//that predate them stop there instead of misreading them.
+//Version 2 files are the same without compression and checksums, with
+//32-byte index entries.
+class MappedSheet
+{
+public:
+	enum {
+		MagicNumber = 0x7F51C885,
+		Version = 3,
+		JournalMagic = 0x4C4E524A,//Text records only.
+		NumberJournalMagic = 0x4E4E524A
+	};
+
+	MappedSheet();
+	~MappedSheet();
+
+	bool open(const QString &fileName);
+	QString fileName() const { return file.fileName(); }
+	static bool write(QFileDevice &file, const CellStore &store);
+	static qint64 journalSize(QFile &file, qint64 *baseSize = 0);
+	static bool appendJournal(QFile &file, const CellStore &store,
+		const QVector<CellRef> &changed);
+
+	int blockCount() const { return blocks; }
+	qint64 cellCount() const { return cells; }
+	int column(int index) const { return int(field32(index, 0)); }
+	int block(int index) const { return int(field32(index, 4)); }
+	int count(int index) const { return int(field32(index, 8)); }
+	int lastSlot(int index) const { return int(field32(index, 12)); }
+	int find(int column, int block) const;
+	int lowerBound(int column, int block) const;
+
+	//Calls number(slot, value) for each number of block index and
+	//text(slot, text) for everything else. A damaged block reads as
+	//empty, or is cut short at the first bad record.
+	//Blocks may be read from several threads at once.
+	template <typename NumberVisitor, typename TextVisitor>
+	void readBlock(int index, NumberVisitor number, TextVisitor text) const;
+
+	//Calls number(row, column, value) for each journal record of a
+	//plain number and text(row, column, formula) for the others, with
+	//an empty formula for a removed cell. Reading stops at a segment
+	//cut short by an interrupted save.
+	template <typename NumberVisitor, typename TextVisitor>
+	void readJournal(NumberVisitor number, TextVisitor text) const;
+
+private:
+	enum {
+		UncompressedVersion = 2,
+		HeaderSize = 40,
+		UncompressedEntrySize = 32,
+		EntrySize = 40,
+		RecordSize = 16,
+		SegmentHeaderSize = 16,
+		JournalRecordSize = 12,
+		RemovedRecord = -1,//In place of a journal record's length.
+		NumberRecord = -2,
+		NumberKind = 0,
+		TextKind = 1
+	};
+
+	Q_DISABLE_COPY(MappedSheet)
+
+	quint32 field32(int index, int offset) const {
+		return qFromLittleEndian<quint32>(data + indexOffset + qint64(index) * entrySize + offset);
+	}
+	quint64 field64(int index, int offset) const {
+		return qFromLittleEndian<quint64>(data + indexOffset + qint64(index) * entrySize + offset);
+	}
+	bool blockData(int index, const uchar *&bytes, quint64 &length,
+		QByteArray &buffer) const;
+	static QString readText(const uchar *p, quint32 chars) {
+		QString str(chars, Qt::Uninitialized);
+		QChar *out = str.data();
+		for (quint32 k = 0; k < chars; ++k, p += 2)
+			out[k] = QChar(qFromLittleEndian<quint16>(p));
+		return str;
+	}
+
+	QFile file;
+	QByteArray buffer;//Holds the file when it can't be mapped.
+	const uchar *data;
+	qint64 size;
+	int blocks;
+	qint64 cells;
+	qint64 indexOffset;
+	int entrySize;
+};
+
+template <typename NumberVisitor, typename TextVisitor>
+void MappedSheet::readBlock(int index, NumberVisitor number, TextVisitor text) const {
+	QByteArray buffer;
+	const uchar *bytes;
+	quint64 length;
+	quint32 count = field32(index, 8);
+	if (!blockData(index, bytes, length, buffer)
+		|| count > (length - qMin(length, quint64(8))) / RecordSize)
+		return;
+
+	const uchar *record = bytes + 8;
+	const uchar *textArea = record + quint64(count) * RecordSize;
+	quint64 textLength = length - 8 - quint64(count) * RecordSize;
+	for (quint32 i = 0; i < count; ++i, record += RecordSize) {
+		int slot = qFromLittleEndian<quint16>(record);
+		int kind = qFromLittleEndian<quint16>(record + 2);
+		quint32 chars = qFromLittleEndian<quint32>(record + 4);
+		quint64 value = qFromLittleEndian<quint64>(record + 8);
+		if (slot > 0xFF)
+			return;
+
+		if (kind == NumberKind) {
+			double d;
+			memcpy(&d, &value, sizeof(d));
+			number(slot, d);
+		}
+		else {
+			if (value > textLength || chars > (textLength - value) / 2)
+				return;
+			text(slot, readText(textArea + value, chars));
+		}
+	}
+}
+
+template <typename NumberVisitor, typename TextVisitor>
+void MappedSheet::readJournal(NumberVisitor number, TextVisitor text) const {
+	qint64 pos = indexOffset + qint64(blocks) * entrySize;
+	while (size - pos >= SegmentHeaderSize) {
+		const uchar *segment = data + pos;
+		quint32 count = qFromLittleEndian<quint32>(segment + 4);
+		quint64 length = qFromLittleEndian<quint64>(segment + 8);
+		quint32 magic = qFromLittleEndian<quint32>(segment);
+		if ((magic != quint32(JournalMagic) && magic != quint32(NumberJournalMagic))
+			|| length > quint64(size - pos - SegmentHeaderSize))
+			return;
+
+		const uchar *p = segment + SegmentHeaderSize;
+		const uchar *end = p + length;
+		for (quint32 i = 0; i < count; ++i) {
+			if (end - p < JournalRecordSize)
+				return;
+			int row = int(qFromLittleEndian<quint32>(p));
+			int column = int(qFromLittleEndian<quint32>(p + 4));
+			qint32 chars = qFromLittleEndian<qint32>(p + 8);
+			p += JournalRecordSize;
+			if (chars == NumberRecord) {
+				if (end - p < 8)
+					return;
+				quint64 bits = qFromLittleEndian<quint64>(p);
+				double d;
+				memcpy(&d, &bits, sizeof(d));
+				number(row, column, d);
+				p += 8;
+				continue;
+			}
+			if (chars < 0) {
+				text(row, column, QString());
+				continue;
+			}
+			if ((end - p) / 2 < chars)
+				return;
+			text(row, column, readText(p, quint32(chars)));
+			p += qint64(chars) * 2;
+		}
+		pos += SegmentHeaderSize + qint64(length);
+	}
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include <qcheckbox.h>
+#include <qfile.h>
+#include <qfiledialog.h>
+#include <qheaderview.h>
+#include <qlabel.h>
+#include <qlayout.h>
+#include <qmessagebox.h>
+#include <qpushbutton.h>
+#include <qtablewidget.h>
+#include <qtextstream.h>
+#include <qtimer.h>
+
+#include "cellref.h"
+#include "profilepanel.h"
+#include "spreadsheet.h"
+
+ProfilePanel::ProfilePanel(Spreadsheet *spreadsheet, QWidget *parent)
+	: QDockWidget(tr("Recalc profile"), parent) {
+	this->spreadsheet = spreadsheet;
+	setObjectName("recalcProfile");//For saveState().
+
+	profileCheckBox = new QCheckBox(tr("&Profile evaluations"));
+	profileCheckBox->setChecked(spreadsheet->isProfiling());
+	refreshButton = new QPushButton(tr("Re&fresh"));
+	resetButton = new QPushButton(tr("R&eset"));
+	exportButton = new QPushButton(tr("E&xport CSV..."));
+	summaryLabel = new QLabel;
+
+	table = new QTableWidget(0, 6);
+	table->setHorizontalHeaderLabels(QStringList() << tr("Cell") << tr("Formula")
+		<< tr("Evaluations") << tr("Exclusive ms") << tr("Inclusive ms") << tr("Re-dirtied"));
+	table->setEditTriggers(QAbstractItemView::NoEditTriggers);
+	table->setSelectionBehavior(QAbstractItemView::SelectRows);
+	table->verticalHeader()->hide();
+	table->horizontalHeader()->setStretchLastSection(true);
+
+	connect(profileCheckBox, SIGNAL(toggled(bool)), this, SLOT(setProfiling(bool)));
+	connect(refreshButton, SIGNAL(clicked()), this, SLOT(refresh()));
+	connect(resetButton, SIGNAL(clicked()), this, SLOT(reset()));
+	connect(exportButton, SIGNAL(clicked()), this, SLOT(exportCsv()));
+	connect(table, SIGNAL(itemActivated(QTableWidgetItem *)),
+		this, SLOT(itemActivated(QTableWidgetItem *)));
+	connect(spreadsheet, SIGNAL(recalculationProgress(int, int)),
+		this, SLOT(recalculationProgress(int, int)));
+
+	QHBoxLayout *buttonLayout = new QHBoxLayout;
+	buttonLayout->addWidget(profileCheckBox);
+	buttonLayout->addStretch();
+	buttonLayout->addWidget(refreshButton);
+	buttonLayout->addWidget(resetButton);
+	buttonLayout->addWidget(exportButton);
+
+	QVBoxLayout *mainLayout = new QVBoxLayout;
+	mainLayout->addLayout(buttonLayout);
+	mainLayout->addWidget(summaryLabel);
+	mainLayout->addWidget(table);
+
+	QWidget *contents = new QWidget;
+	contents->setLayout(mainLayout);
+	setWidget(contents);
+}
+
+//Lists the costliest cells; numbers are stored as numbers, so clicking
+//a header sorts them as such.
+void ProfilePanel::refresh() {
+	QVector<CellProfile> profile = spreadsheet->profile();
+	qint64 total = 0;
+	foreach(const CellProfile &entry, profile)
+		total += entry.exclusiveNsecs;
+	summaryLabel->setText(tr("%1 cells, %2 ms evaluating")
+		.arg(profile.size()).arg(total / 1e6, 0, 'f', 1));
+
+	int rows = qMin(profile.size(), int(MaxListedCells));
+	table->setSortingEnabled(false);
+	table->setRowCount(rows);
+	for (int i = 0; i < rows; ++i) {
+		const CellProfile &entry = profile[i];
+		CellRef ref = { entry.row, entry.column };
+		QTableWidgetItem *cellItem = new QTableWidgetItem(ref.toString());
+		cellItem->setData(Qt::UserRole, entry.row);
+		cellItem->setData(Qt::UserRole + 1, entry.column);
+		table->setItem(i, 0, cellItem);
+		table->setItem(i, 1, new QTableWidgetItem(spreadsheet->formula(entry.row, entry.column)));
+
+		QTableWidgetItem *items[4] = {
+			new QTableWidgetItem, new QTableWidgetItem,
+			new QTableWidgetItem, new QTableWidgetItem
+		};
+		items[0]->setData(Qt::DisplayRole, entry.evaluations);
+		items[1]->setData(Qt::DisplayRole, entry.exclusiveNsecs / 1e6);
+		items[2]->setData(Qt::DisplayRole, entry.inclusiveNsecs / 1e6);
+		items[3]->setData(Qt::DisplayRole, entry.redirtied);
+		for (int j = 0; j < 4; ++j)
+			table->setItem(i, j + 2, items[j]);
+	}
+	table->setSortingEnabled(true);
+	table->sortByColumn(3, Qt::DescendingOrder);
+}
+
+void ProfilePanel::setProfiling(bool on) {
+	spreadsheet->setProfiling(on);
+	if (!on)
+		refresh();
+}
+
+void ProfilePanel::reset() {
+	spreadsheet->resetProfile();
+	refresh();
+}
+
+//One line per profiled cell, costliest first, times in milliseconds.
+void ProfilePanel::exportCsv() {
+	QString fileName = QFileDialog::getSaveFileName(this,
+		tr("Export Recalc Profile"), "./profile.csv", tr("Comma-separated (*.csv)"));
+	if (fileName.isEmpty())
+		return;
+	QFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+		QMessageBox::warning(this, tr("Spreadsheet"),
+			tr("Cannot write file %1:\n%2.")
+			.arg(file.fileName())
+			.arg(file.errorString()));
+		return;
+	}
+
+	QTextStream out(&file);
+	out << "cell,formula,evaluations,exclusive_ms,inclusive_ms,redirtied\n";
+	foreach(const CellProfile &entry, spreadsheet->profile()) {
+		CellRef ref = { entry.row, entry.column };
+		QString formula = spreadsheet->formula(entry.row, entry.column);
+		formula.replace('"', "\"\"");
+		out << ref.toString() << ",\"" << formula << "\","
+			<< entry.evaluations << ','
+			<< QString::number(entry.exclusiveNsecs / 1e6, 'f', 3) << ','
+			<< QString::number(entry.inclusiveNsecs / 1e6, 'f', 3) << ','
+			<< entry.redirtied << '\n';
+	}
+}
+
+void ProfilePanel::itemActivated(QTableWidgetItem *item) {
+	QTableWidgetItem *cellItem = table->item(item->row(), 0);
+	emit showCell(cellItem->data(Qt::UserRole).toInt(),
+		cellItem->data(Qt::UserRole + 1).toInt());
+}
+
+//A pass that ends while profiling lists what it cost, once the sheet
+//has taken its results.
+void ProfilePanel::recalculationProgress(int done, int total) {
+	if (isVisible() && spreadsheet->isProfiling() && total > 0 && done == total)
+		QTimer::singleShot(0, this, SLOT(refresh()));
+}
@@ -0,0 +1,48 @@
+#ifndef PROFILEPANEL_H
+#define PROFILEPANEL_H
+
+#include <qdockwidget.h>
+
+class QCheckBox;
+class QLabel;
+class QPushButton;
+class QTableWidget;
+class QTableWidgetItem;
+class Spreadsheet;
+
+//The "Recalc profile" dock: what each formula cost while profiling was
+//on, costliest first. Only the top rows are listed; Export writes them
+//all as CSV.
+class ProfilePanel : public QDockWidget
+{
+	Q_OBJECT;
+
+public:
+	ProfilePanel(Spreadsheet *spreadsheet, QWidget *parent = 0);
+
+	public slots:
+	void refresh();
+
+signals:
+	void showCell(int row, int column);
+
+	private slots:
+	void setProfiling(bool on);
+	void reset();
+	void exportCsv();
+	void itemActivated(QTableWidgetItem *item);
+	void recalculationProgress(int done, int total);
+
+private:
+	enum { MaxListedCells = 1000 };
+
+	Spreadsheet *spreadsheet;
+	QCheckBox *profileCheckBox;
+	QPushButton *refreshButton;
+	QPushButton *resetButton;
+	QPushButton *exportButton;
+	QLabel *summaryLabel;
+	QTableWidget *table;
+};
+
+#endif
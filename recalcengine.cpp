@@ -0,0 +1,141 @@
+#include <qhash.h>
+#include <qtconcurrentmap.h>
+#include <qthread.h>
+
+#include "cell.h"
+#include "cellstore.h"
+#include "evalprofiler.h"
+#include "recalcengine.h"
+#include "tracelog.h"
+
+RecalcEngine::RecalcEngine(const CellStore &store, const QAtomicInt *cancel,
+	QAtomicInt *progress, QAtomicInt *total)
+	: store(store), cancel(cancel), progress(progress), total(total) {
+}
+
+//All cells must be dirty. Results are in the cells' caches on return,
+//so the following repaint only reads them.
+//Dirty precedents missing from the list join the pass: these are cells
+//of blocks that a mapped file decodes while the edges are built, so all
+//loading is over before the levels fan out.
+//positions, if given, holds where each of dirtyCells is; those of the
+//cells that join are appended.
+//Returns false if the pass was cancelled; cells computed until then keep their values.
+bool RecalcEngine::evaluate(const QVector<Cell *> &dirtyCells, QVector<CellRef> *positions) {
+	QVector<Cell *> cells = dirtyCells;
+	QHash<const Cell *, int> index;
+	index.reserve(cells.size());
+	for (int i = 0; i < cells.size(); ++i)
+		index.insert(cells[i], i);
+
+	//pending[i] counts the dirty operands cell i still waits for.
+	QVector<int> pending(cells.size(), 0);
+	QVector<QVector<int> > dependents(cells.size());
+	for (int i = 0; i < cells.size(); ++i) {
+		auto addEdge = [&](int row, int column, Cell *c) {
+			int j = c ? index.value(c, -1) : -1;
+			if (j == -1 && c && c->isDirty()) {
+				j = cells.size();
+				cells.append(c);
+				if (positions) {
+					CellRef ref = { row, column };
+					positions->append(ref);
+				}
+				index.insert(c, j);
+				pending.append(0);
+				dependents.append(QVector<int>());
+			}
+			if (j != -1) {
+				++pending[i];
+				dependents[j].append(i);
+			}
+		};
+		foreach(const CellRef &ref, cells[i]->references())
+			addEdge(ref.row, ref.column, store.cell(ref.row, ref.column));
+		foreach(const CellRange &range, cells[i]->rangeReferences())
+			store.visit(range.top, range.left, range.bottom, range.right, addEdge);
+	}
+
+	if (total) //Before any is counted done.
+		total->fetchAndAddRelaxed(cells.size() - dirtyCells.size());
+
+	QVector<int> level;
+	for (int i = 0; i < cells.size(); ++i) {
+		if (pending[i] == 0)
+			level.append(i);
+	}
+
+	QVector<Cell *> batch;
+	while (!level.isEmpty()) {
+		if (canceled())
+			return false;
+
+		batch.resize(level.size());
+		for (int i = 0; i < level.size(); ++i)
+			batch[i] = cells[level[i]];
+
+		TraceSpan span("recalc level");
+		if (batch.size() < ParallelThreshold) {
+			compute(batch.constData(), batch.size());
+		}
+		else {
+			//The pool takes a few chunks per thread rather than single
+			//cells, so each worker's share of the level is one span.
+			int chunkSize = qMax(int(MinChunk),
+				batch.size() / (QThread::idealThreadCount() * 4) + 1);
+			QVector<int> chunks;
+			for (int first = 0; first < batch.size(); first += chunkSize)
+				chunks.append(first);
+			QtConcurrent::blockingMap(chunks, [&](int first) {
+				TraceSpan span("recalc chunk");
+				compute(batch.constData() + first, qMin(chunkSize, batch.size() - first));
+			});
+		}
+		if (progress)
+			progress->fetchAndAddRelaxed(batch.size());
+
+		QVector<int> next;
+		foreach(int i, level) {
+			foreach(int dependent, dependents[i]) {
+				if (--pending[dependent] == 0)
+					next.append(dependent);
+			}
+		}
+		level.swap(next);
+	}
+	return !canceled();
+}
+
+//Cells come column by column, so a filled-down formula arrives as a
+//run of cells sharing one program; long runs are computed a lane per
+//cell. The profiler times cells one by one, so it turns that off.
+void RecalcEngine::compute(Cell *const *cells, int count) const {
+	bool profiling = EvalProfiler::isEnabled();
+	for (int i = 0; i < count; ) {
+		int run = 1;
+		while (i + run < count && cells[i + run]->shared == cells[i]->shared)
+			++run;
+		if (run >= MinLanes && !profiling && cells[i]->shared) {
+			if (canceled())
+				return;
+			Cell::computeLanes(store, cells + i, run);
+		}
+		else {
+			for (int j = i; j < i + run; ++j)
+				compute(cells[j]);
+		}
+		i += run;
+	}
+}
+
+//Every operand of the cell is clean, so this reads caches only.
+void RecalcEngine::compute(Cell *cell) const {
+	if (canceled()) //Lets a cancelled level drain quickly.
+		return;
+	if (EvalProfiler::isEnabled()) {
+		cell->computeProfiled(store, EvalProfiler::now());
+	}
+	else {
+		cell->computeValue(store);
+	}
+}
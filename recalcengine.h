@@ -0,0 +1,44 @@
+#ifndef RECALCENGINE_H
+#define RECALCENGINE_H
+
+#include <qatomic.h>
+#include <qvector.h>
+
+#include "cellref.h"
+
+class Cell;
+class CellStore;
+
+//Evaluates a set of dirty cells on the global thread pool.
+//Cells are grouped into dependency levels: a level only reads cells of
+//earlier levels, so all of its cells can run at once without locking.
+//Cells on a cycle never become ready; they are left dirty for
+//Cell::value() to report. Cells of a level that share a formula are
+//computed together, see Cell::computeLanes().
+//A pass can be cancelled through a flag another thread sets, and
+//reports how many cells it has computed so far, and out of how many.
+class RecalcEngine
+{
+public:
+	RecalcEngine(const CellStore &store, const QAtomicInt *cancel = 0,
+		QAtomicInt *progress = 0, QAtomicInt *total = 0);
+
+	bool evaluate(const QVector<Cell *> &dirtyCells, QVector<CellRef> *positions = 0);
+
+private:
+	bool canceled() const { return cancel && cancel->load(); }
+	void compute(Cell *const *cells, int count) const;
+	void compute(Cell *cell) const;
+
+	const CellStore &store;
+	const QAtomicInt *cancel;
+	QAtomicInt *progress;
+	QAtomicInt *total;//Grows by the cells that join the pass.
+	enum {
+		ParallelThreshold = 256,//Smaller levels run inline.
+		MinChunk = 64,//Cells a pool thread takes at once, at least.
+		MinLanes = 8//Shorter runs of one formula go cell by cell.
+	};
+};
+
+#endif
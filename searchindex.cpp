@@ -0,0 +1,129 @@
+#include <algorithm>
+
+#include "searchindex.h"
+
+SearchIndex::SearchIndex() {
+	lastCase = Qt::CaseSensitive;
+	lastValid = false;
+}
+
+//The distinct trigrams of text, case folded.
+QSet<quint64> SearchIndex::trigrams(const QString &text) {
+	QString folded = text.toCaseFolded();
+	QSet<quint64> grams;
+	for (int i = 0; i + GramSize <= folded.size(); ++i) {
+		grams.insert((quint64(folded[i].unicode()) << 32)
+			| (quint64(folded[i + 1].unicode()) << 16)
+			| quint64(folded[i + 2].unicode()));
+	}
+	return grams;
+}
+
+//Replaces what the cell is found by; an empty text drops it.
+void SearchIndex::setText(int row, int column, const QString &text) {
+	Key key = DependencyGraph::key(row, column);
+	QHash<Key, QString>::iterator old = texts.find(key);
+	if (old != texts.end()) {
+		if (old.value() == text)
+			return;
+		foreach(quint64 gram, trigrams(old.value())) {
+			QHash<quint64, QSet<Key> >::iterator posting = postings.find(gram);
+			posting->remove(key);
+			if (posting->isEmpty())
+				postings.erase(posting);
+		}
+		texts.erase(old);
+	}
+	if (!text.isEmpty()) {
+		texts.insert(key, text);
+		foreach(quint64 gram, trigrams(text))
+			postings[gram].insert(key);
+	}
+	lastValid = false;
+}
+
+void SearchIndex::clear() {
+	texts.clear();
+	postings.clear();
+	lastMatches.clear();
+	lastValid = false;
+}
+
+//The cells whose text contains str, in row-major order.
+const QVector<SearchIndex::Key> &SearchIndex::matches(const QString &str,
+	Qt::CaseSensitivity cs) const {
+	if (lastValid && lastQuery == str && lastCase == cs)
+		return lastMatches;
+	lastMatches.clear();
+	lastQuery = str;
+	lastCase = cs;
+	lastValid = true;
+	if (str.isEmpty())
+		return lastMatches;
+
+	if (str.size() < GramSize) {
+		for (QHash<Key, QString>::const_iterator i = texts.constBegin();
+			i != texts.constEnd(); ++i) {
+			if (i.value().contains(str, cs))
+				lastMatches.append(i.key());
+		}
+	}
+	else {
+		QVector<const QSet<Key> *> sets;
+		foreach(quint64 gram, trigrams(str)) {
+			QHash<quint64, QSet<Key> >::const_iterator posting = postings.find(gram);
+			if (posting == postings.constEnd())
+				return lastMatches;//No cell has this trigram.
+			sets.append(&posting.value());
+		}
+		std::sort(sets.begin(), sets.end(),
+			[](const QSet<Key> *a, const QSet<Key> *b) { return a->size() < b->size(); });
+
+		foreach(Key key, *sets.first()) {
+			bool candidate = true;
+			for (int i = 1; i < sets.size() && candidate; ++i)
+				candidate = sets[i]->contains(key);
+			if (candidate && texts.value(key).contains(str, cs))
+				lastMatches.append(key);
+		}
+	}
+	std::sort(lastMatches.begin(), lastMatches.end());
+	return lastMatches;
+}
+
+QVector<SearchIndex::Key> SearchIndex::findAll(const QString &str,
+	Qt::CaseSensitivity cs) const {
+	return matches(str, cs);
+}
+
+//The first match after (row, column) in row-major order. A negative
+//row or column starts before the sheet or the row.
+bool SearchIndex::findNext(const QString &str, Qt::CaseSensitivity cs,
+	int row, int column, CellRef &found) const {
+	const QVector<Key> &keys = matches(str, cs);
+	Key from = 0;
+	if (row >= 0)
+		from = column < 0 ? DependencyGraph::key(row, 0) : DependencyGraph::key(row, column) + 1;
+	QVector<Key>::const_iterator i = std::lower_bound(keys.begin(), keys.end(), from);
+	if (i == keys.end())
+		return false;
+	found.row = DependencyGraph::row(*i);
+	found.column = DependencyGraph::column(*i);
+	return true;
+}
+
+//The last match before (row, column) in row-major order.
+bool SearchIndex::findPrevious(const QString &str, Qt::CaseSensitivity cs,
+	int row, int column, CellRef &found) const {
+	if (row < 0)
+		return false;
+	const QVector<Key> &keys = matches(str, cs);
+	QVector<Key>::const_iterator i = std::lower_bound(keys.begin(), keys.end(),
+		DependencyGraph::key(row, qMax(column, 0)));
+	if (i == keys.begin())
+		return false;
+	--i;
+	found.row = DependencyGraph::row(*i);
+	found.column = DependencyGraph::column(*i);
+	return true;
+}
@@ -0,0 +1,53 @@
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include <qhash.h>
+#include <qset.h>
+#include <qstring.h>
+#include <qvector.h>
+
+#include "cellref.h"
+#include "dependencygraph.h"
+
+//An inverted index from the trigrams of each cell's searchable text to
+//the cells holding them, kept up to date one cell at a time.
+//A query intersects the postings of its trigrams, starting with the
+//rarest, and checks the few candidates left against the text itself.
+//The sorted matches of the last query are kept until the index
+//changes, so stepping through them is a binary search.
+//Trigrams are taken from case-folded text and serve either case
+//sensitivity. Queries shorter than a trigram scan every cell.
+class SearchIndex
+{
+public:
+	typedef DependencyGraph::Key Key;
+
+	SearchIndex();
+
+	void setText(int row, int column, const QString &text);
+	void clear();
+	int count() const { return texts.size(); }
+	const QHash<Key, QString> &cellTexts() const { return texts; }
+
+	QVector<Key> findAll(const QString &str, Qt::CaseSensitivity cs) const;
+	bool findNext(const QString &str, Qt::CaseSensitivity cs,
+		int row, int column, CellRef &found) const;
+	bool findPrevious(const QString &str, Qt::CaseSensitivity cs,
+		int row, int column, CellRef &found) const;
+
+private:
+	enum { GramSize = 3 };
+
+	static QSet<quint64> trigrams(const QString &text);
+	const QVector<Key> &matches(const QString &str, Qt::CaseSensitivity cs) const;
+
+	QHash<Key, QString> texts;
+	QHash<quint64, QSet<Key> > postings;
+
+	mutable QVector<Key> lastMatches;
+	mutable QString lastQuery;
+	mutable Qt::CaseSensitivity lastCase;
+	mutable bool lastValid;
+};
+
+#endif
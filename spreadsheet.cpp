@@ -1,32 +1,62 @@
+#include <algorithm>
+
 #include <qabstractitemview.h>
 #include <qmessagebox.h>
 #include <qfile.h>
 #include <qapplication.h>
 #include <qclipboard.h>
+#include <qtconcurrentmap.h>
 
-#include "spreadsheet.h"
 #include "cell.h"
+#include "findengine.h"
+#include "spreadsheet.h"
+#include "spreadsheetmodel.h"
+#include "tabseparatedtext.h"
+#include "tracelog.h"
 
 Spreadsheet::Spreadsheet(QWidget *parent)
-	: QTableWidget(parent) {
-	autoRecalc = true;//Should wirte in spreadsheet.h.
-
-	//The table widget will use the cell's clone function 
-	//when it needs to create a new table item
-	setItemPrototype(new Cell);
+	: QTableView(parent) {
+	//The cells live in a sparse model; the view only asks for what it shows.
+	model = new SpreadsheetModel(this);
+	setModel(model);
 	//The cells can be selected by dragging a range with the mouse
 	setSelectionMode(ContiguousSelection);
 
 
-	connect(this, SIGNAL(itemChanged(QTableWidgetItem*)),
-		this, SLOT(somethingChanged()));
+	connect(model, SIGNAL(modified()), this, SLOT(somethingChanged()));
+	connect(model, SIGNAL(recalculationProgress(int, int)),
+		this, SIGNAL(recalculationProgress(int, int)));
+	connect(model, SIGNAL(fileWritten(bool, const QString &)),
+		this, SLOT(writeFinished(bool, const QString &)));
+
+	findEngine = new FindEngine(this);
+	listedResults = 0;
+	connect(findEngine, SIGNAL(found(const QVector<CellRef> &)),
+		this, SLOT(listResults(const QVector<CellRef> &)));
+	connect(findEngine, SIGNAL(finished(int)), this, SIGNAL(searchFinished(int)));
 
 	clear();
 }
 
+bool Spreadsheet::autoRecalculate() const {
+	return model->autoRecalculate();
+}
+
+int Spreadsheet::currentRow() const {
+	return currentIndex().row();
+}
+
+int Spreadsheet::currentColumn() const {
+	return currentIndex().column();
+}
+
+void Spreadsheet::setCurrentCell(int row, int column) {
+	setCurrentIndex(model->index(row, column));
+}
+
 //Connected with StatusBar.
 QString Spreadsheet::currentLocation() const {
-	return QChar('A' + currentColumn())
+	return CellRef::columnName(currentColumn())
 		+ QString::number(currentRow() + 1);
 }
 
@@ -36,35 +66,90 @@ QString Spreadsheet::currentFormula() const {
 }
 
 QTableWidgetSelectionRange Spreadsheet::selectedRange() const {
-	//Using function selectedRanges() to return the selected ranges 
-	//no matter in what ways they were selected.	
-
-	//In fact, ranges will never be empty, 
-	//because the selectionMode ContiguousSelection will assume the current cell 
-	//as the selected cell. 	
-	QList<QTableWidgetSelectionRange> ranges = selectedRanges();
-	if (ranges.isEmpty())
+	//Using the selection model to return the selected range 
+	//no matter in what ways it was selected.	
+
+	//The selectionMode ContiguousSelection keeps it to a single rectangle.
+	QItemSelection selection = selectionModel()->selection();
+	if (selection.isEmpty())
+		return QTableWidgetSelectionRange();
+	const QItemSelectionRange &range = selection.first();
+	return QTableWidgetSelectionRange(range.top(), range.left(),
+		range.bottom(), range.right());
+}
+
+//Clips a range to the occupied part of the sheet, so "select all"
+//on a 1M x 16K grid doesn't walk billions of empty slots.
+QTableWidgetSelectionRange Spreadsheet::usedRange(
+	const QTableWidgetSelectionRange &range) const {
+	CellRef extent = model->cells().extent();
+	int bottom = qMin(range.bottomRow(), extent.row - 1);
+	int right = qMin(range.rightColumn(), extent.column - 1);
+	if (range.rowCount() == 0 || bottom < range.topRow()
+		|| right < range.leftColumn())
 		return QTableWidgetSelectionRange();
-	return ranges.first();
+	return QTableWidgetSelectionRange(range.topRow(), range.leftColumn(),
+		bottom, right);
 }
 
 
 void Spreadsheet::clear() {
-	setRowCount(0);
-	setColumnCount(0);//Clear the whole spreadsheet.
-	setRowCount(RowCount);
-	setColumnCount(ColumnCount);
-
-	for (int i = 0; i < ColumnCount; ++i) {
-		QTableWidgetItem *item = new QTableWidgetItem;
-		item->setText(QString(QChar('A' + i)));
-		setHorizontalHeaderItem(i, item);
-	}
-
+	findEngine->cancel();
+	model->clear();//Clear the whole spreadsheet.
 	setCurrentCell(0, 0);
 }
 
 bool Spreadsheet::readFile(const QString &fileName) {
+	TraceSpan span("readFile");
+	findEngine->cancel();
+	QString error;
+	QApplication::setOverrideCursor(Qt::WaitCursor);
+	bool ok = model->readFile(fileName, &error);
+	QApplication::restoreOverrideCursor();
+	if (!ok) {
+		QMessageBox::warning(this, tr("Spreadsheet"), error);
+		return false;
+	}
+	setCurrentCell(0, 0);
+	return true;
+}
+
+//Starts the save; a whole file is written in the background, and
+//fileWritten() tells when it is done. Returns false if it couldn't start.
+bool Spreadsheet::writeFile(const QString &fileName) {
+	TraceSpan span("writeFile");
+	QString error;
+	QApplication::setOverrideCursor(Qt::WaitCursor);
+	bool ok = model->startWriteFile(fileName, &error);
+	QApplication::restoreOverrideCursor();
+	if (!ok)
+		QMessageBox::warning(this, tr("Spreadsheet"), error);
+	return ok;
+}
+
+bool Spreadsheet::isWriting() const {
+	return model->isWriting();
+}
+
+//Waits for the save in flight, if any. A failure has been reported
+//when this returns false.
+bool Spreadsheet::finishWriting() {
+	if (!model->isWriting())
+		return true;
+	QApplication::setOverrideCursor(Qt::WaitCursor);
+	bool ok = model->finishWriting();
+	QApplication::restoreOverrideCursor();
+	return ok;
+}
+
+void Spreadsheet::writeFinished(bool ok, const QString &error) {
+	if (!ok)
+		QMessageBox::warning(this, tr("Spreadsheet"), error);
+	emit fileWritten(ok);
+}
+
+//Replaces the sheet with the records of a CSV or TSV file.
+bool Spreadsheet::importFile(const QString &fileName, DelimitedFile::Stats *stats) {
 	QFile file(fileName);
 	if (!file.open(QIODevice::ReadOnly)) {
 		QMessageBox::warning(this, tr("Spreadsheet"),
@@ -73,33 +158,25 @@ bool Spreadsheet::readFile(const QString &fileName) {
 			.arg(file.errorString()));
 		return false;
 	}
-	QDataStream in(&file);
-	in.setVersion(QDataStream::Qt_5_5);
-
-	quint32 magic;
-	in >> magic;
-	if (magic != MagicNumber) {
-		QMessageBox::warning(this, tr("Spreadsheet"),
-			tr("This file isn't a spreadsheet file."));
-		return false;
-	}
 	clear();
 
-	quint16 row;
-	quint16 column;
-	QString str;
-
 	QApplication::setOverrideCursor(Qt::WaitCursor);
-	while (!in.atEnd()) {
-		in >> row >> column >> str;
-		setFormula(row, column, str);
-	}
+	model->suspendUndo();
+	DelimitedFile::read(file, DelimitedFile::delimiterFor(fileName), *model, stats);
+	model->resumeUndo();
 	QApplication::restoreOverrideCursor();
+	if (file.error() != QFile::NoError) {
+		QMessageBox::warning(this, tr("Spreadsheet"),
+			tr("Cannot read file %1:\n%2.")
+			.arg(file.fileName())
+			.arg(file.errorString()));
+		return false;
+	}
 	return true;
 }
 
-
-bool Spreadsheet::writeFile(const QString &fileName) {
+bool Spreadsheet::exportFile(const QString &fileName,
+	DelimitedFile::Content content, DelimitedFile::Stats *stats) {
 	QFile file(fileName);
 	if (!file.open(QIODevice::WriteOnly)) {
 		QMessageBox::warning(this, tr("Spreadsheet"),
@@ -108,105 +185,154 @@ bool Spreadsheet::writeFile(const QString &fileName) {
 			.arg(file.errorString()));
 		return false;
 	}
-	QDataStream out(&file);
-	out.setVersion(QDataStream::Qt_5_5);
-
-	out << quint32(MagicNumber);
 
 	QApplication::setOverrideCursor(Qt::WaitCursor);
-	QString str;
-	for (int row = 0; row < RowCount; ++row) {
-		for (int column = 0; column < ColumnCount; ++column) {
-			str = formula(row, column);
-			if (!str.isEmpty())
-				out << quint16(row) << quint16(column) << str;
-		}
-	}
+	bool ok = DelimitedFile::write(file, DelimitedFile::delimiterFor(fileName),
+		*model, content, stats);
 	QApplication::restoreOverrideCursor();
-	return true;
+	if (!ok) {
+		QMessageBox::warning(this, tr("Spreadsheet"),
+			tr("Cannot write file %1\n%2.")
+			.arg(file.fileName())
+			.arg(file.errorString()));
+	}
+	return ok;
 }
 
+//Sorts the rows of the selection by their values.
 void Spreadsheet::sort(const SpreadsheetCompare &compare) {
-	QList<QStringList> rows;
-	QTableWidgetSelectionRange range = selectedRange();
-
-	for (int i = 0; i < range.rowCount(); ++i) {
-		QStringList row;
-		for (int j = 0; j < range.columnCount(); ++j) {
-			row.append(formula(range.topRow() + i, range.leftColumn() + j));
-		}
-		rows.append(row);
-	}
-
-	qStableSort(rows.begin(), rows.end(), compare);
-
-	for (int i = 0; i < range.rowCount(); ++i) {
-		for (int j = 0; j < range.columnCount(); ++j) {
-			setFormula(range.topRow() + i, range.leftColumn() + j, rows[i][j]);
-		}
+	TraceSpan span("sort");
+	QTableWidgetSelectionRange selection = usedRange(selectedRange());
+	if (selection.rowCount() > 1) {
+		CellRange range = { selection.topRow(), selection.leftColumn(),
+			selection.bottomRow(), selection.rightColumn() };
+		model->sort(range, compare);
 	}
-
 	clearSelection();
-	somethingChanged();
 }
+
 void Spreadsheet::cut() {
 	copy();
 	del();
 }
 
+//Writes the range as tab-separated formulas, a block of rows at a time:
+//the occupied cells of the band are visited, put in row order and
+//appended to a buffer sized for the range up front.
 void Spreadsheet::copy() {
-	QTableWidgetSelectionRange range = selectedRange();
-	QString str;
+	struct Entry
+	{
+		int row;
+		int column;
+	};
 
-	for (int i = 0; i < range.rowCount(); ++i) {
-		if (i > 0)
-			str += "\n";
-		for (int j = 0; j < range.columnCount(); ++j) {
-			if (j > 0)
-				str += "\t";
-			str += formula(range.topRow() + i, range.leftColumn() + j);
+	QTableWidgetSelectionRange range = usedRange(selectedRange());
+	QString str;
+	str.reserve(int(qMin(qint64(range.rowCount()) * range.columnCount() * 4,
+		qint64(MaxCopyReserve))));
+
+	QVector<Entry> entries;
+	for (int top = range.topRow(); top <= range.bottomRow(); top += CellStore::BlockSize) {
+		int bottom = qMin(top + int(CellStore::BlockSize) - 1, range.bottomRow());
+		entries.clear();
+		model->cells().visit(top, range.leftColumn(), bottom, range.rightColumn(),
+			[&entries](int row, int column, const Cell *) {
+			Entry entry = { row, column };
+			entries.append(entry);
+		});
+		std::stable_sort(entries.begin(), entries.end(),
+			[](const Entry &a, const Entry &b) { return a.row < b.row; });
+
+		int next = 0;
+		for (int row = top; row <= bottom; ++row) {
+			if (row > range.topRow())
+				str += '\n';
+			int column = range.leftColumn();
+			for (; next < entries.size() && entries[next].row == row; ++next) {
+				for (; column < entries[next].column; ++column)
+					str += '\t';
+				str += formula(row, column);
+			}
+			for (; column < range.rightColumn(); ++column)
+				str += '\t';
 		}
 	}
 	QApplication::clipboard()->setText(str);
 }
 
+//Pastes tab-separated text, which must fit the selection unless a
+//single cell is selected.
 void Spreadsheet::paste() {
+	TraceSpan span("paste");
 	QTableWidgetSelectionRange range = selectedRange();
-	QString str = QApplication::clipboard()->text();
-	QStringList rows = str.split('\n');
-	int numRows = rows.count();
-	int numColunms = rows.first().count('\t') + 1;
-
+	TabSeparatedText text(QApplication::clipboard()->text());
 	if (range.rowCount() * range.columnCount() != 1 //Effect remains unknowned.
-		&& (range.rowCount() != numRows
-		|| range.columnCount() != numColunms)) {
+		&& (range.rowCount() != text.rowCount()
+		|| range.columnCount() != text.columnCount())) {
 		QMessageBox::information(this, tr("MySpreadsheet"),
 			tr("The information cannot be pasted because the copy"
 			"and paste areas aren't the same size."));
 		return;
 	}
 
-	QStringList columns;
-	int row, column;
-	for (int i = 0; i != numRows; ++i) {
-		columns = rows[i].split('\t');
-		for (int j = 0; j != numColunms; ++j) {
-			row = range.topRow() + i;
-			column = range.leftColumn() + j;
-			if (row < RowCount && column < ColumnCount)
-				setFormula(row, column, columns[j]);
-		}
-	}
-	somethingChanged();
+	QApplication::setOverrideCursor(Qt::WaitCursor);
+	text.paste(*model, range.topRow(), range.leftColumn());
+	QApplication::restoreOverrideCursor();
 }
 
 void Spreadsheet::del() {
-	QList<QTableWidgetItem *> items = selectedItems();
-	if (!items.isEmpty()) {
-		foreach(QTableWidgetItem *item, items)
-			delete item;
-		somethingChanged();
-	}
+	QTableWidgetSelectionRange range = usedRange(selectedRange());
+	QVector<CellRef> occupied;
+	model->cells().visit(range.topRow(), range.leftColumn(),
+		range.bottomRow(), range.rightColumn(),
+		[&occupied](int row, int column, const Cell *) {
+		CellRef ref = { row, column };
+		occupied.append(ref);
+	});
+	model->beginBatch();
+	foreach(const CellRef &ref, occupied)
+		model->removeCell(ref.row, ref.column);
+	model->commitBatch();
+}
+
+bool Spreadsheet::isProfiling() const {
+	return model->isProfiling();
+}
+
+void Spreadsheet::setProfiling(bool on) {
+	model->setProfiling(on);
+}
+
+QVector<CellProfile> Spreadsheet::profile() {
+	return model->profile();
+}
+
+void Spreadsheet::resetProfile() {
+	model->resetProfile();
+}
+
+bool Spreadsheet::canUndo() const {
+	return model->canUndo();
+}
+
+bool Spreadsheet::canRedo() const {
+	return model->canRedo();
+}
+
+void Spreadsheet::setUndoMemoryLimit(qint64 bytes) {
+	model->setUndoMemoryLimit(bytes);
+}
+
+void Spreadsheet::undo() {
+	QApplication::setOverrideCursor(Qt::WaitCursor);
+	model->undo();
+	QApplication::restoreOverrideCursor();
+}
+
+void Spreadsheet::redo() {
+	QApplication::setOverrideCursor(Qt::WaitCursor);
+	model->redo();
+	QApplication::restoreOverrideCursor();
 }
 
 void Spreadsheet::selectCurrentRow() {
@@ -217,98 +343,195 @@ void Spreadsheet::selectCurrentColumn() {
 	selectColumn(currentColumn());
 }
 
+//The pass itself is traced on the worker thread that runs it.
 void Spreadsheet::recalculate() {
-	for (int row = 0; row < RowCount; ++row) {
-		for (int column = 0; column < ColumnCount; ++column) {
-			if (cell(row, column))
-				cell(row, column)->setDirty();
-		}
-	}
-	viewport()->update();
+	TraceSpan span("recalculate");
+	model->recalculate();
 }
 
 void Spreadsheet::setAutoRecalculate(bool recalc) {
-	autoRecalc = recalc;
-	if (autoRecalc)
-		recalculate();
+	model->setAutoRecalculate(recalc);
 }
 
+//Searches go through the model's index, so a hop costs a binary search
+//over the matches and no cell is evaluated to be looked at.
 void Spreadsheet::findNext(const QString &str, Qt::CaseSensitivity cs) {
-	int row = currentRow();
-	int column = currentColumn() + 1;
-
-	while (row < RowCount) {
-		while (column < ColumnCount) {
-			if (text(row, column).contains(str, cs)) {
-				clearSelection();
-				setCurrentCell(row, column);
-				activateWindow();//Activates spreadsheet window(from finddialog).
-				return;
-			}
-			++column;
-		}
-		column = 0;
-		++row;
+	TraceSpan span("findNext");
+	CellRef found;
+	if (model->searchIndex().findNext(str, cs, currentRow(), currentColumn(), found)) {
+		showCell(found.row, found.column);
+		activateWindow();//Activates spreadsheet window(from finddialog).
+		return;
 	}
 	QApplication::beep();//When the software can not find the content.
 }
 
 void Spreadsheet::findPrevious(const QString &str, Qt::CaseSensitivity cs) {
+	CellRef found;
 	int row = currentRow();
-	int column = currentColumn() - 1;
-
-	while (row >= 0) {
-		while (column >= 0) {
-			if (text(row, column).contains(str, cs)) {
-				clearSelection();
-				setCurrentCell(row, column);
-				activateWindow();
-			}
-			--column;
-		}
-		column = ColumnCount - 1;
-		--row;
+	int column = currentColumn();
+	if (row < 0) { //Nothing current: search back from the end.
+		row = CellRef::MaxRows;
+		column = 0;
+	}
+	if (model->searchIndex().findPrevious(str, cs, row, column, found)) {
+		showCell(found.row, found.column);
+		activateWindow();
+		return;
 	}
 	QApplication::beep();
 }
 
-void Spreadsheet::somethingChanged() {
-	if (autoRecalc)
-		recalculate();
-	emit modified();
+//Lists every cell containing str. Results, here and from
+//findMatching(), go out as searchStarted(), searchFound() for each
+//batch and searchFinished() with the total.
+void Spreadsheet::findAll(const QString &str, Qt::CaseSensitivity cs) {
+	findEngine->cancel();
+	QVector<SearchIndex::Key> keys = model->searchIndex().findAll(str, cs);
+	QVector<CellRef> cells;
+	for (int i = 0; i < keys.size() && i < MaxFindResults; ++i) {
+		CellRef ref = { DependencyGraph::row(keys[i]), DependencyGraph::column(keys[i]) };
+		cells.append(ref);
+	}
+	listedResults = 0;
+	emit searchStarted();
+	listResults(cells);
+	emit searchFinished(keys.size());
 }
 
+//Matches pattern against every cell on the thread pool; results stream
+//in while the GUI stays live.
+void Spreadsheet::findMatching(const QRegularExpression &pattern) {
+	listedResults = 0;
+	emit searchStarted();
+	findEngine->start(model->searchIndex().cellTexts(), pattern);
+}
 
-Cell *Spreadsheet::cell(int row, int column) const {
-	return static_cast<Cell*>(item(row, column));
+void Spreadsheet::cancelFind() {
+	findEngine->cancel();
 }
 
+//Passes matches on with their text, until MaxFindResults are listed.
+void Spreadsheet::listResults(const QVector<CellRef> &cells) {
+	int count = qMin(cells.size(), MaxFindResults - listedResults);
+	if (count <= 0)
+		return;
+	QStringList texts;
+	for (int i = 0; i < count; ++i)
+		texts.append(text(cells[i].row, cells[i].column));
+	listedResults += count;
+	emit searchFound(cells.mid(0, count), texts);
+}
+
+namespace {
+
+struct Replacement
+{
+	int row;
+	int column;
+	QString formula;
+	bool changed;
+};
 
-void Spreadsheet::setFormula(int row, int column, const QString &formula) {
-	Cell *c = cell(row, column);
-	if (!c) {
-		c = new Cell;
-		setItem(row, column, c);//Sets c to the table's item which locates at (row, column).
-	}
-	c->setFormula(formula);
 }
 
-QString Spreadsheet::formula(int row, int column) const {
-	Cell *c = cell(row, column);
-	if (c) {
-		return c->formula();
+//Computes the new formulas of the candidate cells on the thread pool,
+//then writes the ones that changed in one batch: one dependents walk,
+//one background pass and one modified().
+template <typename Replace>
+static int replaceCells(SpreadsheetModel &model, const QVector<SearchIndex::Key> &keys,
+	Replace replace) {
+	QVector<Replacement> work;
+	work.reserve(keys.size());
+	foreach(SearchIndex::Key key, keys) {
+		Replacement r = { DependencyGraph::row(key), DependencyGraph::column(key),
+			QString(), false };
+		r.formula = model.formula(r.row, r.column);
+		work.append(r);
 	}
-	else {
-		return "";
+	QtConcurrent::blockingMap(work, [&replace](Replacement &r) {
+		QString before = r.formula;
+		replace(r.formula);
+		r.changed = r.formula != before;
+	});
+
+	int count = 0;
+	model.beginBatch();
+	foreach(const Replacement &r, work) {
+		if (r.changed) {
+			model.setFormula(r.row, r.column, r.formula);
+			++count;
+		}
 	}
+	model.commitBatch();
+	return count;
 }
 
-QString Spreadsheet::text(int row, int column) const {
-	Cell *c = cell(row, column);
-	if (c) {
-		return c->text();
-	}
-	else {
-		return "";
+//Replaces str in the formulas of the cells the index finds it in.
+void Spreadsheet::replaceAll(const QString &str, Qt::CaseSensitivity cs,
+	const QString &after) {
+	findEngine->cancel();
+	int count = replaceCells(*model, model->searchIndex().findAll(str, cs),
+		[&](QString &formula) { formula.replace(str, after, cs); });
+	emit cellsReplaced(count);
+}
+
+//As replaceAll(), with a pattern; after may refer to captures as \1.
+void Spreadsheet::replaceMatching(const QRegularExpression &pattern,
+	const QString &after) {
+	findEngine->cancel();
+	QVector<SearchIndex::Key> keys = model->searchIndex().cellTexts().keys().toVector();
+	int count = replaceCells(*model, keys,
+		[&](QString &formula) { formula.replace(pattern, after); });
+	emit cellsReplaced(count);
+}
+
+//Replaces str in the current cell if it holds it, then moves on.
+void Spreadsheet::replaceNext(const QString &str, Qt::CaseSensitivity cs,
+	const QString &after) {
+	int row = currentRow();
+	int column = currentColumn();
+	if (row >= 0 && column >= 0) {
+		QString before = formula(row, column);
+		QString replaced = before;
+		replaced.replace(str, after, cs);
+		if (replaced != before) {
+			setFormula(row, column, replaced);
+			emit cellsReplaced(1);
+		}
 	}
-}
\ No newline at end of file
+	findNext(str, cs);
+}
+
+void Spreadsheet::showCell(int row, int column) {
+	clearSelection();
+	setCurrentCell(row, column);
+}
+
+void Spreadsheet::paintEvent(QPaintEvent *event) {
+	TraceSpan span("paint");
+	QTableView::paintEvent(event);
+}
+
+void Spreadsheet::somethingChanged() {
+	emit modified();
+}
+
+void Spreadsheet::currentChanged(const QModelIndex &current,
+	const QModelIndex &previous) {
+	QTableView::currentChanged(current, previous);
+	emit currentCellChanged(current.row(), current.column(),
+		previous.row(), previous.column());
+}
+
+void Spreadsheet::setFormula(int row, int column, const QString &formula) {
+	model->setFormula(row, column, formula);
+}
+
+QString Spreadsheet::formula(int row, int column) const {
+	return model->formula(row, column);
+}
+
+QString Spreadsheet::text(int row, int column) const {
+	return model->text(row, column);
+}
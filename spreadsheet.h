@@ -1,28 +1,54 @@
 #ifndef SPREADSHEET_H
 #define SPREADSHEET_H
 
+#include <qregularexpression.h>
+#include <qtableview.h>
 #include <qtablewidget.h>
 
-class Cell;
+#include "cellref.h"
+#include "delimitedfile.h"
+#include "evalprofiler.h"
+
+class CellStore;
+class FindEngine;
 class SpreadsheetCompare;
+class SpreadsheetModel;
 
-class Spreadsheet : public QTableWidget
+class Spreadsheet : public QTableView
 {
 	Q_OBJECT;
 
 public:
 	Spreadsheet(QWidget *parent = 0);
 
-	bool autoRecalculate() const { return autoRecalc; }
+	bool autoRecalculate() const;
+	int currentRow() const;
+	int currentColumn() const;
+	void setCurrentCell(int row, int column);
 	QString currentLocation() const;
 	QString currentFormula() const;
 	QTableWidgetSelectionRange selectedRange() const;
 	void clear();
 	bool readFile(const QString &fileName);
 	bool writeFile(const QString &fileName);
+	bool isWriting() const;
+	bool finishWriting();
+	bool importFile(const QString &fileName, DelimitedFile::Stats *stats = 0);
+	bool exportFile(const QString &fileName, DelimitedFile::Content content,
+		DelimitedFile::Stats *stats = 0);
 	void sort(const SpreadsheetCompare &compare);
+	QString formula(int row, int column) const;
+	bool isProfiling() const;
+	void setProfiling(bool on);
+	QVector<CellProfile> profile();
+	void resetProfile();
+	bool canUndo() const;
+	bool canRedo() const;
+	void setUndoMemoryLimit(qint64 bytes);
 
 	public slots:
+	void undo();
+	void redo();
 	void cut();
 	void copy();
 	void paste();
@@ -33,37 +59,52 @@ public:
 	void setAutoRecalculate(bool recalc);
 	void findNext(const QString &str, Qt::CaseSensitivity cs);
 	void findPrevious(const QString &str, Qt::CaseSensitivity cs);
+	void findAll(const QString &str, Qt::CaseSensitivity cs);
+	void findMatching(const QRegularExpression &pattern);
+	void cancelFind();
+	void replaceNext(const QString &str, Qt::CaseSensitivity cs, const QString &after);
+	void replaceAll(const QString &str, Qt::CaseSensitivity cs, const QString &after);
+	void replaceMatching(const QRegularExpression &pattern, const QString &after);
+	void showCell(int row, int column);
 
 signals:
 	void modified();
+	void currentCellChanged(int currentRow, int currentColumn,
+		int previousRow, int previousColumn);
+	void recalculationProgress(int done, int total);
+	void searchStarted();
+	void searchFound(const QVector<CellRef> &cells, const QStringList &texts);
+	void searchFinished(int total);
+	void cellsReplaced(int count);
+	void fileWritten(bool ok);
+
+protected:
+	void paintEvent(QPaintEvent *event) override;
+
+protected slots:
+	void currentChanged(const QModelIndex &current,
+		const QModelIndex &previous) override;
 
 private slots:
 	void somethingChanged();
+	void listResults(const QVector<CellRef> &cells);
+	void writeFinished(bool ok, const QString &error);
 
 private:
-	Cell *cell(int row, int column) const;
+	QTableWidgetSelectionRange usedRange(const QTableWidgetSelectionRange &range) const;
 	QString text(int row, int column) const;
-	QString formula(int row, int column) const;
 	void setFormula(int row, int column, const QString &formula);
 
-	bool autoRecalc;
-	const int MagicNumber = 0x7F51C883;
-	const int RowCount = 999;
-	const int ColumnCount = 26;
+	SpreadsheetModel *model;
+	FindEngine *findEngine;
+	int listedResults;//Of the current search.
+	const int MaxFindResults = 10000;
+	const int MaxCopyReserve = 64 * 1024 * 1024;//Characters reserved up front at most.
 };
 
-class SpreadsheetCompare
-{
-public:
-	bool operator()(const QStringList &row1,
-		const QStringList &row2) const;
-	enum { KeyCount = 3 };
-	int keys[KeyCount];
-	bool ascending[KeyCount];
-};
 
 
 
 
 
-#endif
\ No newline at end of file
+#endif
@@ -1,23 +1,231 @@
-#include "spreadsheet.h"
+#include <string.h>
 
+#include <algorithm>
 
-//If ascending, what makes row1 < row2 should be true.
-//else, what makes row1 > row2 should be true.
-bool SpreadsheetCompare::operator()(const QStringList &row1,
-	const QStringList &row2) const {
-	for (int i = 0; i < KeyCount; ++i) {
-		int column = keys[i];
-		if (column != -1) {//If key != None.
-			if (row1[column] != row2[column]) {
-				if (ascending[i]) {
-					return row1[column] < row2[column];
-				}
-				else {
-					return row1[column] > row2[column];
-				}
-			}
+#include <qthread.h>
+#include <qtconcurrentmap.h>
+
+#include "cellstore.h"
+#include "formula.h"
+#include "spreadsheetcompare.h"
+
+namespace {
+
+enum KeyKind { NumberKey, TextKey, ErrorKey, EmptyKey };
+
+enum {
+	RadixBits = 16,
+	ParallelSortSize = 65536//Smaller ranges are sorted on one thread.
+};
+
+//The evaluated values of one key column, one entry per row of the range.
+struct KeyColumn
+{
+	QVector<quint8> kinds;
+	QVector<quint64> numbers;//Bits that order like the doubles they hold.
+	QVector<QString> texts;//Only allocated once a text or error turns up.
+	bool ascending;
+	bool numeric;//Numbers and empty cells only.
+};
+
+//Two sorted neighbours in a pass of the merge sort.
+struct Run
+{
+	int *first;
+	int *middle;
+	int *last;
+	int *out;
+};
+
+}
+
+static quint64 orderedBits(double d) {
+	quint64 bits;
+	memcpy(&bits, &d, sizeof(bits));
+	return bits & Q_UINT64_C(0x8000000000000000) ? ~bits : bits | Q_UINT64_C(0x8000000000000000);
+}
+
+//Evaluates the key column once. Occupied rows are collected before any
+//value is read, as evaluating a formula may decode other blocks.
+static KeyColumn extractKeys(const CellStore &store, const CellRange &range,
+	int column, bool ascending) {
+	int rows = range.bottom - range.top + 1;
+	KeyColumn keys;
+	keys.kinds.fill(EmptyKey, rows);
+	keys.numbers.fill(0, rows);
+	keys.ascending = ascending;
+	keys.numeric = true;
+
+	QVector<int> occupied;
+	store.visit(range.top, column, range.bottom, column,
+		[&occupied](int row, int, const Cell *) {
+		occupied.append(row);
+	});
+	foreach(int row, occupied) {
+		int i = row - range.top;
+		QVariant value = store.value(row, column);
+		if (value.type() == QVariant::Double) {
+			keys.kinds[i] = NumberKey;
+			keys.numbers[i] = orderedBits(value.toDouble());
+			continue;
+		}
+		if (keys.numeric) {
+			keys.numeric = false;
+			keys.texts.resize(rows);
+		}
+		if (!value.isValid() || FormulaError::isError(value)) {
+			keys.kinds[i] = ErrorKey;
+			keys.texts[i] = value.isValid() ? FormulaError::text(value) : QString();
+		}
+		else {
+			keys.kinds[i] = TextKey;
+			keys.texts[i] = value.toString();
+		}
+	}
+	return keys;
+}
+
+//Numbers before text before errors; empty cells last in either order.
+static int compareKeys(const KeyColumn &keys, int a, int b) {
+	int kindA = keys.kinds[a];
+	int kindB = keys.kinds[b];
+	if (kindA == EmptyKey || kindB == EmptyKey)
+		return (kindA == EmptyKey) - (kindB == EmptyKey);
+
+	int result;
+	if (kindA != kindB) {
+		result = kindA < kindB ? -1 : 1;
+	}
+	else if (kindA == NumberKey) {
+		result = keys.numbers[a] < keys.numbers[b] ? -1 : keys.numbers[a] > keys.numbers[b];
+	}
+	else {
+		result = QString::compare(keys.texts[a], keys.texts[b]);
+	}
+	return keys.ascending ? result : -result;
+}
+
+//A stable LSD radix sort of order by one numeric key column, 16 bits a
+//pass; a pass is skipped when every row has the same digit. Empty cells
+//are then moved to the end, keeping their order.
+static void radixSort(QVector<int> &order, const KeyColumn &keys) {
+	int n = order.size();
+	QVector<quint64> bits(n);
+	for (int i = 0; i < n; ++i) {
+		quint64 b = keys.numbers[order[i]];
+		bits[i] = keys.ascending ? b : ~b;
+	}
+
+	QVector<int> orderBuffer(n);
+	QVector<quint64> bitsBuffer(n);
+	QVector<int> counts(1 << RadixBits);
+	for (int shift = 0; shift < 64; shift += RadixBits) {
+		counts.fill(0);
+		for (int i = 0; i < n; ++i)
+			++counts[int((bits[i] >> shift) & ((1 << RadixBits) - 1))];
+		if (counts[int((bits[0] >> shift) & ((1 << RadixBits) - 1))] == n)
+			continue;
+
+		int total = 0;
+		for (int d = 0; d < counts.size(); ++d) {
+			int count = counts[d];
+			counts[d] = total;
+			total += count;
+		}
+		for (int i = 0; i < n; ++i) {
+			int at = counts[int((bits[i] >> shift) & ((1 << RadixBits) - 1))]++;
+			orderBuffer[at] = order[i];
+			bitsBuffer[at] = bits[i];
 		}
+		order.swap(orderBuffer);
+		bits.swap(bitsBuffer);
 	}
-	return false;
+
+	std::stable_partition(order.begin(), order.end(),
+		[&keys](int row) { return keys.kinds[row] != EmptyKey; });
 }
 
+//Sorts chunks on the thread pool, then merges neighbours pairwise, each
+//pass's merges again in parallel. std::merge keeps the sort stable.
+template <typename LessThan>
+static void mergeSort(QVector<int> &order, LessThan lessThan) {
+	int n = order.size();
+	int threads = qMax(1, QThread::idealThreadCount());
+	if (n < ParallelSortSize || threads == 1) {
+		std::stable_sort(order.begin(), order.end(), lessThan);
+		return;
+	}
+
+	int width = (n + threads - 1) / threads;
+	QVector<Run> runs;
+	for (int start = 0; start < n; start += width) {
+		Run run = { order.data() + start, 0, order.data() + qMin(start + width, n), 0 };
+		runs.append(run);
+	}
+	QtConcurrent::blockingMap(runs, [&lessThan](Run &run) {
+		std::stable_sort(run.first, run.last, lessThan);
+	});
+
+	QVector<int> buffer(n);
+	int *from = order.data();
+	int *to = buffer.data();
+	for (; width < n; width *= 2) {
+		runs.clear();
+		for (int start = 0; start < n; start += 2 * width) {
+			Run run = { from + start, from + qMin(start + width, n),
+				from + qMin(start + 2 * width, n), to + start };
+			runs.append(run);
+		}
+		QtConcurrent::blockingMap(runs, [&lessThan](Run &run) {
+			std::merge(run.first, run.middle, run.middle, run.last, run.out, lessThan);
+		});
+		qSwap(from, to);
+	}
+	if (from != order.data())
+		memcpy(order.data(), from, n * sizeof(int));
+}
+
+//A negative column, the dialog's "None", adds no key.
+void SpreadsheetCompare::addKey(int column, bool ascending) {
+	if (column < 0)
+		return;
+	Key key = { column, ascending };
+	keys.append(key);
+}
+
+//The sorted order of the rows of range: the row at offset result[i]
+//belongs at offset i. Each key column is evaluated once; when all keys
+//are numeric the rows are radix sorted, one column at a time from the
+//least significant key, and otherwise merge sorted on the typed keys.
+QVector<int> SpreadsheetCompare::sortedRows(const CellStore &store,
+	const CellRange &range) const {
+	QVector<int> order(range.bottom - range.top + 1);
+	for (int i = 0; i < order.size(); ++i)
+		order[i] = i;
+
+	QVector<KeyColumn> columns;
+	bool numeric = true;
+	foreach(const Key &key, keys) {
+		if (range.left + key.column > range.right)
+			continue;
+		columns.append(extractKeys(store, range, range.left + key.column, key.ascending));
+		numeric = numeric && columns.last().numeric;
+	}
+	if (columns.isEmpty() || order.size() < 2)
+		return order;
+
+	if (numeric) {
+		for (int k = columns.size() - 1; k >= 0; --k)
+			radixSort(order, columns[k]);
+		return order;
+	}
+	mergeSort(order, [&columns](int a, int b) {
+		for (int k = 0; k < columns.size(); ++k) {
+			int result = compareKeys(columns[k], a, b);
+			if (result != 0)
+				return result < 0;
+		}
+		return false;
+	});
+	return order;
+}
@@ -0,0 +1,27 @@
+#ifndef SPREADSHEETCOMPARE_H
+#define SPREADSHEETCOMPARE_H
+
+#include <qvector.h>
+
+#include "cellref.h"
+
+class CellStore;
+
+//The keys of a sort, most significant first, on the evaluated values.
+//Columns are offsets into the sorted range.
+class SpreadsheetCompare
+{
+public:
+	struct Key
+	{
+		int column;
+		bool ascending;
+	};
+
+	void addKey(int column, bool ascending);
+	QVector<int> sortedRows(const CellStore &store, const CellRange &range) const;
+
+	QVector<Key> keys;
+};
+
+#endif
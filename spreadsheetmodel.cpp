@@ -0,0 +1,894 @@
+#include <algorithm>
+
+#include <qdatastream.h>
+#include <qfile.h>
+#include <qsavefile.h>
+#include <qtconcurrentrun.h>
+
+#include "backgroundrecalc.h"
+#include "cell.h"
+#include "evalprofiler.h"
+#include "mappedsheet.h"
+#include "spreadsheetcompare.h"
+#include "spreadsheetmodel.h"
+#include "tracelog.h"
+
+SpreadsheetModel::SpreadsheetModel(QObject *parent)
+	: QAbstractTableModel(parent), undoLog(store) {
+	autoRecalc = true;
+	undoSuspended = 0;
+	batchDepth = 0;
+	batchResume = false;
+	searchBuilt = false;
+	writing = 0;
+	writeOk = true;
+	backgroundRecalc = new BackgroundRecalc(this);
+	store.setListener(this);
+
+	connect(backgroundRecalc, SIGNAL(progress(int, int)),
+		this, SIGNAL(recalculationProgress(int, int)));
+	connect(backgroundRecalc, SIGNAL(finished()), this, SLOT(recalculationFinished()));
+	connect(&writer, SIGNAL(finished()), this, SLOT(writerFinished()));
+}
+
+//A write in flight is let finish; nobody is left to hear how it went.
+SpreadsheetModel::~SpreadsheetModel() {
+	writer.waitForFinished();
+	delete writing;
+}
+
+int SpreadsheetModel::rowCount(const QModelIndex &parent) const {
+	return parent.isValid() ? 0 : CellRef::MaxRows;
+}
+
+int SpreadsheetModel::columnCount(const QModelIndex &parent) const {
+	return parent.isValid() ? 0 : CellRef::MaxColumns;
+}
+
+QVariant SpreadsheetModel::data(const QModelIndex &index, int role) const {
+	int row = index.row();
+	int column = index.column();
+	if (!store.contains(row, column))
+		return QVariant();
+	TraceSpan span("data", SlowDataNsecs);
+
+	//While a background pass runs, the GUI thread never evaluates:
+	//cells it hasn't reached yet show a pending marker.
+	const Cell *c = store.cell(row, column);
+	bool pending = c && c->isDirty() && backgroundRecalc->isRunning();
+
+	if (role == Qt::DisplayRole) {
+		if (pending)
+			return "...";
+		return valueText(row, column);
+	}
+	else if (role == Qt::EditRole) {
+		return store.formula(row, column);
+	}
+	else if (role == Qt::TextAlignmentRole) {
+		if (!pending && store.value(row, column).type() == QVariant::String) {
+			return int(Qt::AlignLeft | Qt::AlignVCenter);
+		}
+		else {
+			return int(Qt::AlignRight | Qt::AlignVCenter);
+		}
+	}
+	return QVariant();
+}
+
+bool SpreadsheetModel::setData(const QModelIndex &index,
+	const QVariant &value, int role) {
+	if (!index.isValid() || role != Qt::EditRole)
+		return false;
+	setFormula(index.row(), index.column(), value.toString());
+	return true;
+}
+
+Qt::ItemFlags SpreadsheetModel::flags(const QModelIndex &index) const {
+	return QAbstractTableModel::flags(index) | Qt::ItemIsEditable;
+}
+
+QVariant SpreadsheetModel::headerData(int section,
+	Qt::Orientation orientation, int role) const {
+	if (role != Qt::DisplayRole)
+		return QAbstractTableModel::headerData(section, orientation, role);
+	if (orientation == Qt::Horizontal) {
+		return CellRef::columnName(section);
+	}
+	else {
+		return section + 1;
+	}
+}
+
+QString SpreadsheetModel::formula(int row, int column) const {
+	return store.formula(row, column);
+}
+
+//The value as shown, evaluated now if need be. Empty cells give "".
+QString SpreadsheetModel::valueText(int row, int column) const {
+	if (!store.contains(row, column))
+		return "";
+	QVariant value = store.value(row, column);
+	if (FormulaError::isError(value)) {
+		return FormulaError::text(value);
+	}
+	else if (value.isValid()) {
+		return value.toString();
+	}
+	else {
+		return "####";
+	}
+}
+
+QString SpreadsheetModel::text(int row, int column) const {
+	return data(index(row, column), Qt::DisplayRole).toString();
+}
+
+//Every edit goes through here. An empty formula frees the cell.
+void SpreadsheetModel::setFormula(int row, int column, const QString &formula) {
+	if (formula.isEmpty()) {
+		removeCell(row, column);
+		return;
+	}
+	recordUndo(row, column);
+	if (batchDepth > 0) {
+		storeFormula(row, column, formula);
+		batchChanged.insert(DependencyGraph::key(row, column));
+		return;
+	}
+
+	bool resume = interruptRecalculation();
+	storeFormula(row, column, formula);
+	unsaved.insert(DependencyGraph::key(row, column));
+	updateSearch(row, column);
+	undoLog.commit();
+
+	QModelIndex changed = index(row, column);
+	emit dataChanged(changed, changed);
+	bool stale = false;
+	if (autoRecalc)
+		stale = recalculateDependents(row, column) || isDirty(row, column);
+	if (resume || stale) //The cone is evaluated off the GUI thread.
+		backgroundRecalc->start(store.snapshot());
+	emit modified();
+}
+
+//A number that is already parsed, e.g. by an importer.
+void SpreadsheetModel::setNumber(int row, int column, double number) {
+	beginBatch();
+	recordUndo(row, column);
+	graph.removePrecedents(row, column);
+	store.setNumber(row, column, number);
+	batchChanged.insert(DependencyGraph::key(row, column));
+	commitBatch();
+}
+
+void SpreadsheetModel::removeCell(int row, int column) {
+	if (!store.contains(row, column))
+		return;
+	recordUndo(row, column);
+	if (batchDepth > 0) {
+		graph.removePrecedents(row, column);
+		store.remove(row, column);
+		batchChanged.insert(DependencyGraph::key(row, column));
+		return;
+	}
+
+	bool resume = interruptRecalculation();
+	graph.removePrecedents(row, column);
+	store.remove(row, column);
+	unsaved.insert(DependencyGraph::key(row, column));
+	updateSearch(row, column);
+	undoLog.commit();
+
+	QModelIndex changed = index(row, column);
+	emit dataChanged(changed, changed);
+	if (resume || (autoRecalc && recalculateDependents(row, column))) //Evaluated off the GUI thread.
+		backgroundRecalc->start(store.snapshot());
+	emit modified();
+}
+
+//Sorts the rows of range by their values. The rows are moved in one
+//batch, and only the cells that change place are written.
+void SpreadsheetModel::sort(const CellRange &range, const SpreadsheetCompare &compare) {
+	beginBatch();//No pass runs while the keys are read.
+	permuteRows(range, compare.sortedRows(store, range));
+	commitBatch();
+}
+
+//Moves the rows of range around: the row at offset order[i] ends up at
+//offset i. A column is read once, then the rows that move are written.
+void SpreadsheetModel::permuteRows(const CellRange &range, const QVector<int> &order) {
+	enum { Empty, Number, Text };
+
+	int rows = order.size();
+	QVector<quint8> kinds(rows);
+	QVector<double> numbers(rows);
+	QVector<QString> formulas(rows);
+	beginBatch();
+	if (undoSuspended == 0)
+		undoLog.addRowOrder(range, order);
+	++undoSuspended;//The order is all undo needs.
+	for (int column = range.left; column <= range.right; ++column) {
+		kinds.fill(Empty);
+		store.visit(range.top, column, range.top + rows - 1, column,
+			[&](int row, int, const Cell *) {
+			int i = row - range.top;
+			if (!store.isNumber(row, column)) {
+				kinds[i] = Text;
+				formulas[i] = store.formula(row, column);
+			}
+			else {
+				kinds[i] = Number;
+				numbers[i] = store.value(row, column).toDouble();
+			}
+		});
+		for (int i = 0; i < rows; ++i) {
+			int from = order[i];
+			if (from == i)
+				continue;
+			int row = range.top + i;
+			if (kinds[from] == Number) {
+				setNumber(row, column, numbers[from]);
+			}
+			else if (kinds[from] == Text) {
+				setFormula(row, column, formulas[from]);
+			}
+			else {
+				removeCell(row, column);
+			}
+		}
+	}
+	--undoSuspended;
+	commitBatch();
+}
+
+void SpreadsheetModel::storeFormula(int row, int column, const QString &formula) {
+	const Cell *c = store.setFormula(row, column, formula);
+	if (c) {
+		graph.setPrecedents(row, column, c->references(), c->rangeReferences());
+	}
+	else { //A plain number or text.
+		graph.removePrecedents(row, column);
+	}
+}
+
+//Batches nest; only the outermost commit does the work.
+void SpreadsheetModel::beginBatch() {
+	if (batchDepth++ == 0)
+		batchResume = interruptRecalculation();
+}
+
+//One dependents walk over all changed cells, one background pass,
+//one repaint and one modified(), however many cells the batch wrote.
+void SpreadsheetModel::commitBatch() {
+	Q_ASSERT(batchDepth > 0);
+	if (--batchDepth > 0)
+		return;
+
+	QVector<DependencyGraph::Key> changed;
+	changed.reserve(batchChanged.size());
+	int written = 0;
+	bool stale = false;//Some formula needs the pass.
+	foreach(DependencyGraph::Key key, batchChanged) {
+		int row = DependencyGraph::row(key);
+		int column = DependencyGraph::column(key);
+		changed.append(key);
+		if (store.contains(row, column))
+			++written;
+		stale = stale || isDirty(row, column);
+		updateSearch(row, column);
+	}
+	unsaved.unite(batchChanged);
+	batchChanged.clear();
+	undoLog.commit();//The whole batch undoes as one.
+
+	//When the batch wrote every occupied cell, as readFile() does, all
+	//formulas are new and dirty already, and the walk can be skipped.
+	if (autoRecalc && written < store.count()) {
+		foreach(DependencyGraph::Key key, graph.affectedCells(changed)) {
+			int row = DependencyGraph::row(key);
+			int column = DependencyGraph::column(key);
+			setDirty(row, column);
+			stale = stale || isDirty(row, column);
+		}
+	}
+	if (batchResume || (autoRecalc && stale))
+		backgroundRecalc->start(store.snapshot());
+	batchResume = false;
+
+	if (!changed.isEmpty()) {
+		emit dataChanged(index(0, 0), index(rowCount() - 1, columnCount() - 1));
+		emit modified();
+	}
+}
+
+void SpreadsheetModel::clear() {
+	delete backgroundRecalc->stop();
+	discardProfile();
+	beginResetModel();
+	graph.clear();
+	store.clear();
+	unsaved.clear();
+	undoLog.clear();
+	search.clear();
+	searchBuilt = false;
+	staleSearch.clear();
+	journalFile.clear();
+	writingFile.clear();//A write in flight no longer holds this sheet.
+	writingCells.clear();
+	endResetModel();
+}
+
+static void setError(QString *error, const QString &message) {
+	if (error)
+		*error = message;
+}
+
+//Reads a sheet written by writeFile(), or by the versions that wrote a
+//record per cell. On failure error says why; a file that isn't a
+//spreadsheet leaves the sheet as it was.
+bool SpreadsheetModel::readFile(const QString &fileName, QString *error) {
+	finishWriting();//It may be writing this very file.
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly)) {
+		setError(error, tr("Cannot read file %1:\n%2.")
+			.arg(file.fileName())
+			.arg(file.errorString()));
+		return false;
+	}
+	QDataStream in(&file);
+	in.setVersion(QDataStream::Qt_5_5);
+
+	quint32 magic;
+	in.setByteOrder(QDataStream::LittleEndian);
+	in >> magic;
+	in.setByteOrder(QDataStream::BigEndian);
+	if (magic == MappedSheet::MagicNumber) { //Mapped, and decoded as the view scrolls.
+		file.close();
+		if (!openMapped(fileName)) {
+			setError(error, tr("The file %1 is damaged.").arg(fileName));
+			return false;
+		}
+		journalFile = fileName;
+		return true;
+	}
+	in.device()->seek(0);
+	in >> magic;
+	if (magic != MagicNumber && magic != WideMagicNumber) {
+		setError(error, tr("This file isn't a spreadsheet file."));
+		return false;
+	}
+	clear();
+
+	quint32 row;
+	quint32 column;
+	QString str;
+
+	suspendUndo();//Loading isn't an edit.
+	beginBatch();
+	while (!in.atEnd()) {
+		if (magic == MagicNumber) { //Files written before the grid grew.
+			quint16 shortRow;
+			quint16 shortColumn;
+			in >> shortRow >> shortColumn >> str;
+			row = shortRow;
+			column = shortColumn;
+		}
+		else {
+			in >> row >> column >> str;
+		}
+		if (row < quint32(CellRef::MaxRows) && column < quint32(CellRef::MaxColumns))
+			setFormula(row, column, str);
+	}
+	commitBatch();//Evaluates in the background, not in the first paint.
+	resumeUndo();
+	return true;
+}
+
+//Saves and waits for the file to be written.
+bool SpreadsheetModel::writeFile(const QString &fileName, QString *error) {
+	return startWriteFile(fileName, error) && finishWriting(error);
+}
+
+//Saving back to the file the sheet came from appends the cells changed
+//since, so a small edit makes a small write, there and then. Once the
+//journal outgrows half the base image the file is rewritten whole,
+//which compacts it. A whole file is written from a snapshot in a worker
+//thread; fileWritten() tells how it went. Returns false if the save
+//couldn't start.
+bool SpreadsheetModel::startWriteFile(const QString &fileName, QString *error) {
+	finishWriting();//How it went is told by fileWritten().
+	if (fileName == journalFile) {
+		QFile file(fileName);
+		qint64 baseSize = 0;
+		qint64 journalSize = -1;
+		if (file.open(QIODevice::ReadWrite))
+			journalSize = MappedSheet::journalSize(file, &baseSize);
+		QVector<CellRef> changed = unsavedCells();
+		qint64 growth = qint64(changed.size()) * 16;//At least a record per cell.
+		if (journalSize >= 0 && journalSize + growth < qMax(baseSize / 2, MinJournalLimit)) {
+			if (!MappedSheet::appendJournal(file, store, changed)) {
+				setError(error, tr("Cannot write file %1\n%2.")
+					.arg(file.fileName())
+					.arg(file.errorString()));
+				return false;
+			}
+			markSaved();
+			return true;
+		}
+	}
+
+	//Written next to the old file and renamed over it once whole, so a
+	//failed save leaves the old one, and the sheet can stay mapped from
+	//it: the snapshot decodes what it still needs as it writes.
+	QSaveFile *file = new QSaveFile(fileName);
+	if (!file->open(QIODevice::WriteOnly)) {
+		setError(error, tr("Cannot write file %1\n%2.")
+			.arg(file->fileName())
+			.arg(file->errorString()));
+		delete file;
+		return false;
+	}
+
+	writingFile = fileName;
+	writingCells = unsaved;
+	markSaved();
+	writeSnapshot(file);
+	return true;
+}
+
+//Writes the sheet into file in a worker thread, and renames it into
+//place once whole. The snapshot shares the sheet's blocks, so taking it
+//doesn't copy the cells, and edits made meanwhile copy only the blocks
+//they change.
+void SpreadsheetModel::writeSnapshot(QSaveFile *file) {
+	writing = file;
+	CellStore *snapshot = store.snapshot();
+	writer.setFuture(QtConcurrent::run([file, snapshot]() {
+		TraceSpan span("write snapshot");
+		bool ok = MappedSheet::write(*file, *snapshot);//Occupied cells, column by column.
+		delete snapshot;
+		if (!ok) {
+			file->cancelWriting();
+			return false;
+		}
+		return file->commit();
+	}));
+}
+
+//Waits for the write in flight, for callers that need the file whole
+//or the sheet to stay: reading a file, quitting. Returns false if that
+//write failed.
+bool SpreadsheetModel::finishWriting(QString *error) {
+	if (!writing)
+		return true;
+	while (writing) { //The write may be retried once.
+		writer.waitForFinished();
+		writerFinished();
+	}
+	if (!writeOk)
+		setError(error, writeError);
+	return writeOk;
+}
+
+//Takes in the outcome of the background write; a second call, or a
+//stale signal from an earlier write, finds nothing to do.
+void SpreadsheetModel::writerFinished() {
+	if (!writing || !writer.isFinished())
+		return;
+	writeOk = writer.result();
+	writeError.clear();
+	if (!writeOk && writing->error() == QFileDevice::RenameError
+		&& store.isMappedFrom(writingFile)) {
+		//Some systems won't rename over a file that is mapped, and the
+		//sheet is mapped from this one. Let go of it and write again in
+		//the background; any other failure is reported as it is.
+		QSaveFile *retry = new QSaveFile(writingFile);
+		if (retry->open(QIODevice::WriteOnly)) {
+			delete writing;
+			loadAll();
+			writeSnapshot(retry);
+			return;
+		}
+		delete retry;
+	}
+	if (writeOk) {
+		journalFile = writingFile;
+	}
+	else {
+		writeError = tr("Cannot write file %1\n%2.")
+			.arg(writing->fileName())
+			.arg(writing->errorString());
+		journalFile.clear();
+		unsaved.unite(writingCells);
+	}
+	delete writing;
+	writing = 0;
+	writingFile.clear();
+	writingCells.clear();
+	emit fileWritten(writeOk, writeError);
+}
+
+//Opens a version 2 file in constant time. Cells are decoded when a view
+//or a formula first reads them, and come in dirty, so nothing needs
+//recalculating up front. Only the cells the journal touches are
+//decoded to replay it.
+bool SpreadsheetModel::openMapped(const QString &fileName) {
+	QSharedPointer<MappedSheet> sheet(new MappedSheet);
+	if (!sheet->open(fileName))
+		return false;
+	delete backgroundRecalc->stop();
+	discardProfile();
+	beginResetModel();
+	graph.clear();
+	store.clear();
+	store.map(sheet);
+	search.clear();
+	searchBuilt = false;
+	staleSearch.clear();
+	undoLog.clear();
+	endResetModel();
+
+	++undoSuspended;
+	beginBatch();
+	sheet->readJournal([this](int row, int column, double number) {
+		if (quint32(row) < quint32(CellRef::MaxRows)
+			&& quint32(column) < quint32(CellRef::MaxColumns))
+			setNumber(row, column, number);
+	}, [this](int row, int column, const QString &formula) {
+		if (quint32(row) < quint32(CellRef::MaxRows)
+			&& quint32(column) < quint32(CellRef::MaxColumns))
+			setFormula(row, column, formula);
+	});
+	commitBatch();
+	--undoSuspended;
+	unsaved.clear();
+	return true;
+}
+
+//What a journal save has to write: every cell set or removed since the
+//sheet was last loaded or saved.
+QVector<CellRef> SpreadsheetModel::unsavedCells() const {
+	QVector<CellRef> cells;
+	cells.reserve(unsaved.size());
+	foreach(DependencyGraph::Key key, unsaved) {
+		CellRef ref = { DependencyGraph::row(key), DependencyGraph::column(key) };
+		cells.append(ref);
+	}
+	return cells;
+}
+
+void SpreadsheetModel::markSaved() {
+	unsaved.clear();
+}
+
+//Puts back what the last command changed, in one batch. Steps are
+//undone last first; a sort by applying the inverse of its order.
+void SpreadsheetModel::undo() {
+	QVector<UndoStep> steps;
+	if (!undoLog.undo(steps))
+		return;
+	++undoSuspended;
+	beginBatch();
+	for (int s = steps.size() - 1; s >= 0; --s) {
+		const UndoStep &step = steps[s];
+		if (step.kind == UndoStep::Cells) {
+			for (int i = 0; i < step.cells.size(); ++i)
+				restore(step.cells[i].row, step.cells[i].column, step.before[i]);
+		}
+		else {
+			QVector<int> inverse(step.order.size());
+			for (int i = 0; i < step.order.size(); ++i)
+				inverse[step.order[i]] = i;
+			permuteRows(step.range, inverse);
+		}
+	}
+	commitBatch();
+	--undoSuspended;
+}
+
+void SpreadsheetModel::redo() {
+	QVector<UndoStep> steps;
+	if (!undoLog.redo(steps))
+		return;
+	++undoSuspended;
+	beginBatch();
+	foreach(const UndoStep &step, steps) {
+		if (step.kind == UndoStep::Cells) {
+			for (int i = 0; i < step.cells.size(); ++i)
+				restore(step.cells[i].row, step.cells[i].column, step.after[i]);
+		}
+		else {
+			permuteRows(step.range, step.order);
+		}
+	}
+	commitBatch();
+	--undoSuspended;
+}
+
+//Loading a file or importing one isn't an edit to undo.
+void SpreadsheetModel::suspendUndo() {
+	++undoSuspended;
+}
+
+void SpreadsheetModel::resumeUndo() {
+	--undoSuspended;
+}
+
+void SpreadsheetModel::recordUndo(int row, int column) {
+	if (undoSuspended == 0 && !undoLog.isTouched(row, column))
+		undoLog.touch(row, column);
+}
+
+//Puts back a value undo or redo hands over; numbers go in exactly.
+void SpreadsheetModel::restore(int row, int column, const UndoValue &value) {
+	if (value.isNumber) {
+		setNumber(row, column, value.number);
+	}
+	else {
+		setFormula(row, column, value.formula);
+	}
+}
+
+//Built over the whole sheet the first time it is asked for, which
+//decodes a mapped file, then kept up to date cell by cell.
+const SearchIndex &SpreadsheetModel::searchIndex() {
+	if (!searchBuilt) {
+		loadAll();
+		searchBuilt = true;
+		store.visit([this](int row, int column, const Cell *) {
+			search.setText(row, column, searchText(row, column));
+		});
+	}
+	else {
+		reindexStale();
+	}
+	return search;
+}
+
+//What Find looks through: the text shown and, where it differs, the
+//formula. A formula is found by its value once that is computed, so
+//searching never evaluates anything.
+QString SpreadsheetModel::searchText(int row, int column) const {
+	if (!store.contains(row, column))
+		return QString();
+	QString formula = store.formula(row, column);
+	const Cell *c = store.cell(row, column);
+	if (c && c->isFormula() && c->isDirty())
+		return formula;
+	QString shown = valueText(row, column);
+	return shown == formula ? shown : shown + '\n' + formula;
+}
+
+void SpreadsheetModel::updateSearch(int row, int column) {
+	if (!searchBuilt)
+		return;
+	search.setText(row, column, searchText(row, column));
+	const Cell *c = store.cell(row, column);
+	if (!c || !c->isDirty())
+		staleSearch.remove(DependencyGraph::key(row, column));
+}
+
+//Formulas views evaluated since they were dirtied never told the index,
+//so their entries still hold the formula or the old value. They are
+//brought up to date before a query reads it; those still dirty stay
+//listed until something computes them.
+void SpreadsheetModel::reindexStale() {
+	QMutableSetIterator<DependencyGraph::Key> i(staleSearch);
+	while (i.hasNext()) {
+		DependencyGraph::Key key = i.next();
+		int row = DependencyGraph::row(key);
+		int column = DependencyGraph::column(key);
+		search.setText(row, column, searchText(row, column));
+		const Cell *c = store.cell(row, column);
+		if (!c || !c->isDirty())
+			i.remove();
+	}
+}
+
+//Decodes the rest of a mapped file and releases it. A running pass is
+//restarted on a snapshot that no longer shares the mapping.
+void SpreadsheetModel::loadAll() {
+	bool resume = interruptRecalculation();
+	store.loadAll();
+	if (resume)
+		backgroundRecalc->start(store.snapshot());
+}
+
+//Formulas decoded from a mapped file join the dependency graph.
+void SpreadsheetModel::cellLoaded(int row, int column, const Cell *cell) {
+	graph.setPrecedents(row, column, cell->references(), cell->rangeReferences());
+}
+
+void SpreadsheetModel::setAutoRecalculate(bool recalc) {
+	autoRecalc = recalc;
+	if (autoRecalc)
+		recalculate();
+}
+
+//Recomputes every cell in a worker thread against a snapshot.
+//The view shows pending markers until recalculationFinished() publishes.
+void SpreadsheetModel::recalculate() {
+	CellStore *stopped = backgroundRecalc->stop();//Everything is dirtied again anyway.
+	collectProfile(stopped);
+	delete stopped;
+	//Dirtying may copy the blocks being visited, so it comes after.
+	QVector<DependencyGraph::Key> formulas;
+	store.visitLoaded([&formulas](int row, int column, Cell *c) {
+		if (c && c->isFormula())
+			formulas.append(DependencyGraph::key(row, column));
+	});
+	foreach(DependencyGraph::Key key, formulas)
+		setDirty(DependencyGraph::row(key), DependencyGraph::column(key));
+	backgroundRecalc->start(store.snapshot());
+	emit dataChanged(index(0, 0), index(rowCount() - 1, columnCount() - 1));
+}
+
+bool SpreadsheetModel::isRecalculating() const {
+	return backgroundRecalc->isRunning();
+}
+
+//Blocks until the pass in flight is done and publishes it, for callers
+//without an event loop to hear recalculationFinished().
+void SpreadsheetModel::finishRecalculation() {
+	if (!backgroundRecalc->isRunning())
+		return;
+	backgroundRecalc->wait();
+	recalculationFinished();
+}
+
+void SpreadsheetModel::recalculationFinished() {
+	QVector<CellRef> cells;
+	CellStore *snapshot = backgroundRecalc->stop(&cells);
+	publish(snapshot, cells);
+	emit dataChanged(index(0, 0), index(rowCount() - 1, columnCount() - 1));
+}
+
+//Stops the pass in flight and keeps the cells it managed to compute,
+//so a stream of edits still makes progress. Returns whether one ran.
+bool SpreadsheetModel::interruptRecalculation() {
+	if (!backgroundRecalc->isRunning())
+		return false;
+	QVector<CellRef> cells;
+	CellStore *snapshot = backgroundRecalc->stop(&cells);
+	publish(snapshot, cells);
+	return true;
+}
+
+//The store hasn't changed since the snapshot was taken: every edit
+//interrupts the pass first. So positions still match one to one.
+//Only the cells the pass took on are looked at, not the whole sheet.
+void SpreadsheetModel::publish(CellStore *snapshot, const QVector<CellRef> &cells) {
+	if (!snapshot)
+		return;
+	foreach(const CellRef &ref, cells) {
+		const Cell *computed = snapshot->cell(ref.row, ref.column);
+		if (!computed || computed->isDirty())
+			continue;
+		Cell *c = store.cell(ref.row, ref.column);
+		if (c && c->isDirty()) {
+			store.writableCell(ref.row, ref.column)->setValue(computed->value(*snapshot));
+			updateSearch(ref.row, ref.column);
+		}
+	}
+	collectProfile(snapshot);
+	delete snapshot;
+}
+
+//Dirty only the cells that read (row, column), directly or through others.
+//The pass started after the edit computes them; meanwhile views show
+//them as pending. Returns whether any of them is a stale formula, so
+//an edit nothing reads starts no pass.
+bool SpreadsheetModel::recalculateDependents(int row, int column) {
+	QVector<DependencyGraph::Key> cone = graph.affectedCells(row, column);
+	if (cone.isEmpty())
+		return false;
+
+	bool stale = false;
+	int top = CellRef::MaxRows;
+	int left = CellRef::MaxColumns;
+	int bottom = -1;
+	int right = -1;
+	foreach(DependencyGraph::Key key, cone) {
+		int r = DependencyGraph::row(key);
+		int col = DependencyGraph::column(key);
+		if (store.cell(r, col)) {
+			setDirty(r, col);
+			stale = stale || isDirty(r, col);
+			top = qMin(top, r);
+			left = qMin(left, col);
+			bottom = qMax(bottom, r);
+			right = qMax(right, col);
+		}
+	}
+	if (bottom != -1)
+		emit dataChanged(index(top, left), index(bottom, right));
+	return stale;
+}
+
+//Marks a formula stale, and counts it for the profiler if it was fresh.
+//Its block is copied first if a snapshot shares it.
+void SpreadsheetModel::setDirty(int row, int column) {
+	const Cell *c = store.cell(row, column);
+	if (!c || !c->isFormula() || c->isDirty())
+		return;
+	if (EvalProfiler::isEnabled())
+		++profileEntry(row, column).redirtied;
+	store.writableCell(row, column)->setDirty();
+	if (searchBuilt)
+		staleSearch.insert(DependencyGraph::key(row, column));
+}
+
+//A formula waiting for a pass.
+bool SpreadsheetModel::isDirty(int row, int column) const {
+	const Cell *c = store.cell(row, column);
+	return c && c->isDirty();
+}
+
+bool SpreadsheetModel::isProfiling() const {
+	return EvalProfiler::isEnabled();
+}
+
+//Profiling is process-wide: samples of cells another sheet owns are
+//dropped when this one collects.
+void SpreadsheetModel::setProfiling(bool on) {
+	EvalProfiler::setEnabled(on);
+}
+
+//Every cell evaluated or made stale since profiling began or was reset,
+//costliest first. Samples of a pass still running come once it ends.
+QVector<CellProfile> SpreadsheetModel::profile() {
+	if (!backgroundRecalc->isRunning())
+		collectProfile(0);
+	QVector<CellProfile> result;
+	result.reserve(profileData.size());
+	foreach(const CellProfile &entry, profileData)
+		result.append(entry);
+	std::sort(result.begin(), result.end(), [](const CellProfile &a, const CellProfile &b) {
+		return a.exclusiveNsecs > b.exclusiveNsecs;
+	});
+	return result;
+}
+
+void SpreadsheetModel::resetProfile() {
+	if (!backgroundRecalc->isRunning())
+		EvalProfiler::take();
+	profileData.clear();
+}
+
+CellProfile &SpreadsheetModel::profileEntry(int row, int column) {
+	CellProfile &entry = profileData[DependencyGraph::key(row, column)];
+	entry.row = row;
+	entry.column = column;
+	return entry;
+}
+
+//Samples are kept per Cell, and cells only know their position through
+//the store holding them: those of snapshot's cells are mapped through
+//it, the rest through the live store. No pass may be running.
+void SpreadsheetModel::collectProfile(const CellStore *snapshot) {
+	QHash<const Cell *, EvalProfiler::Sample> samples = EvalProfiler::take();
+	if (samples.isEmpty())
+		return;
+	auto assign = [this, &samples](int row, int column, const Cell *c) {
+		QHash<const Cell *, EvalProfiler::Sample>::iterator sample = samples.find(c);
+		if (!c || sample == samples.end())
+			return;
+		CellProfile &entry = profileEntry(row, column);
+		entry.evaluations += sample->evaluations;
+		entry.inclusiveNsecs += sample->inclusiveNsecs;
+		entry.exclusiveNsecs += sample->exclusiveNsecs;
+		samples.erase(sample);
+	};
+	if (snapshot)
+		snapshot->visitLoaded(assign);
+	if (!samples.isEmpty())
+		store.visitLoaded(assign);
+}
+
+//The cells of the old sheet are gone, and so are their samples.
+void SpreadsheetModel::discardProfile() {
+	EvalProfiler::take();
+	profileData.clear();
+}
@@ -0,0 +1,141 @@
+#ifndef SPREADSHEETMODEL_H
+#define SPREADSHEETMODEL_H
+
+#include <qabstractitemmodel.h>
+#include <qfuturewatcher.h>
+#include <qset.h>
+
+#include "cellstore.h"
+#include "dependencygraph.h"
+#include "evalprofiler.h"
+#include "searchindex.h"
+#include "undolog.h"
+
+class BackgroundRecalc;
+class Cell;
+class QSaveFile;
+class SpreadsheetCompare;
+
+//The sheet behind Spreadsheet: a sparse CellStore, the dependency graph
+//between its formulas and the recalculation policy.
+//Views only ever ask for the cells they show.
+//Bulk edits go between beginBatch() and commitBatch(): cells are then
+//written straight to the store, and views, dependents and listeners
+//hear about them once, at the commit.
+//Whole files are written from a snapshot in a worker thread, so the
+//sheet can be edited while a large one is saved.
+class SpreadsheetModel : public QAbstractTableModel, private CellStoreListener
+{
+	Q_OBJECT;
+
+public:
+	SpreadsheetModel(QObject *parent = 0);
+	~SpreadsheetModel();
+
+	int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+	int columnCount(const QModelIndex &parent = QModelIndex()) const override;
+	QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+	bool setData(const QModelIndex &index, const QVariant &value,
+		int role = Qt::EditRole) override;
+	Qt::ItemFlags flags(const QModelIndex &index) const override;
+	QVariant headerData(int section, Qt::Orientation orientation,
+		int role = Qt::DisplayRole) const override;
+
+	const CellStore &cells() const { return store; }
+	QString formula(int row, int column) const;
+	QString text(int row, int column) const;
+	QString valueText(int row, int column) const;
+	void setFormula(int row, int column, const QString &formula);
+	void setNumber(int row, int column, double number);
+	void removeCell(int row, int column);
+	void permuteRows(const CellRange &range, const QVector<int> &order);
+	void sort(const CellRange &range, const SpreadsheetCompare &compare);
+	void clear();
+	bool readFile(const QString &fileName, QString *error = 0);
+	bool writeFile(const QString &fileName, QString *error = 0);
+	bool startWriteFile(const QString &fileName, QString *error = 0);
+	bool isWriting() const { return writing != 0; }
+	bool finishWriting(QString *error = 0);
+	void loadAll();
+	const SearchIndex &searchIndex();
+
+	bool canUndo() const { return undoLog.canUndo(); }
+	bool canRedo() const { return undoLog.canRedo(); }
+	void undo();
+	void redo();
+	void setUndoMemoryLimit(qint64 bytes) { undoLog.setMemoryLimit(bytes); }
+	void suspendUndo();
+	void resumeUndo();
+
+	void beginBatch();
+	void commitBatch();
+
+	bool autoRecalculate() const { return autoRecalc; }
+	void setAutoRecalculate(bool recalc);
+	void recalculate();
+	bool isRecalculating() const;
+	void finishRecalculation();
+
+	bool isProfiling() const;
+	void setProfiling(bool on);
+	QVector<CellProfile> profile();
+	void resetProfile();
+
+signals:
+	void modified();
+	void recalculationProgress(int done, int total);
+	void fileWritten(bool ok, const QString &error);
+
+private slots:
+	void recalculationFinished();
+	void writerFinished();
+
+private:
+	void cellLoaded(int row, int column, const Cell *cell) override;
+	bool openMapped(const QString &fileName);
+	QVector<CellRef> unsavedCells() const;
+	void markSaved();
+	void writeSnapshot(QSaveFile *file);
+	void storeFormula(int row, int column, const QString &formula);
+	QString searchText(int row, int column) const;
+	void recordUndo(int row, int column);
+	void restore(int row, int column, const UndoValue &value);
+	void updateSearch(int row, int column);
+	void reindexStale();
+	bool recalculateDependents(int row, int column);
+	void setDirty(int row, int column);
+	bool isDirty(int row, int column) const;
+	CellProfile &profileEntry(int row, int column);
+	void collectProfile(const CellStore *snapshot);
+	void discardProfile();
+	bool interruptRecalculation();
+	void publish(CellStore *snapshot, const QVector<CellRef> &cells);
+
+	CellStore store;
+	DependencyGraph graph;
+	BackgroundRecalc *backgroundRecalc;
+	bool autoRecalc;
+	int batchDepth;
+	bool batchResume;//A pass was interrupted by beginBatch().
+	QSet<DependencyGraph::Key> batchChanged;
+	QSet<DependencyGraph::Key> unsaved;//Cells changed since the last save.
+	UndoLog undoLog;
+	int undoSuspended;//Edits made while above 0 aren't recorded.
+	SearchIndex search;
+	bool searchBuilt;//The index is built on the first search.
+	QSet<DependencyGraph::Key> staleSearch;//Dirtied formulas the index may not show the value of.
+	QHash<DependencyGraph::Key, CellProfile> profileData;
+	QString journalFile;//The version 2 file the sheet was last read from or written to.
+	QFutureWatcher<bool> writer;
+	QSaveFile *writing;//The file being written in the background, or 0.
+	QString writingFile;//Becomes journalFile if the write succeeds.
+	QSet<DependencyGraph::Key> writingCells;//Unsaved again if it fails.
+	bool writeOk;//How the last background write ended.
+	QString writeError;
+	const quint32 MagicNumber = 0x7F51C883;//quint16 row and column.
+	const quint32 WideMagicNumber = 0x7F51C884;//quint32 row and column.
+	const qint64 MinJournalLimit = 1024 * 1024;//Bytes of journal always allowed before compacting.
+	const qint64 SlowDataNsecs = 100000;//Faster data() calls go untraced.
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "stringpool.h"
+
+StringPool::StringPool() {
+	next = 0;
+	textBytes = 0;
+}
+
+StringPool::~StringPool() {
+	for (int c = 0; c < MaxChunks; ++c)
+		delete[] chunks[c].load();
+}
+
+//The id of text, added the first time it is seen, with a reference the
+//caller owns. The string is in place before its id is returned, so
+//readers never see a hole. NoId once every id is in use.
+quint32 StringPool::intern(const QString &text) {
+	QMutexLocker locker(&mutex);
+	QHash<QString, quint32>::const_iterator found = ids.constFind(text);
+	if (found != ids.constEnd()) {
+		++refs[found.value()];
+		return found.value();
+	}
+
+	quint32 id;
+	if (!freeIds.isEmpty()) {
+		id = freeIds.takeLast();
+	}
+	else if (next < quint32(MaxChunks) * ChunkSize) {
+		id = next++;
+		refs.append(0);
+	}
+	else {
+		return NoId;
+	}
+	QString *chunk = chunks[id >> ChunkBits].load();
+	if (!chunk) {
+		chunk = new QString[ChunkSize];
+		chunks[id >> ChunkBits].storeRelease(chunk);
+	}
+	chunk[id & (ChunkSize - 1)] = text;
+	ids.insert(text, id);
+	refs[id] = 1;
+	textBytes += textSize(text);
+	return id;
+}
+
+//Another slot takes the id, e.g. in a copied block.
+void StringPool::retain(quint32 id) {
+	QMutexLocker locker(&mutex);
+	Q_ASSERT(id < next && refs[id] > 0);
+	++refs[id];
+}
+
+//The slot holding the id no longer does; the last one frees the text.
+void StringPool::release(quint32 id) {
+	QMutexLocker locker(&mutex);
+	Q_ASSERT(id < next && refs[id] > 0);
+	if (--refs[id] > 0)
+		return;
+	QString &text = chunks[id >> ChunkBits].load()[id & (ChunkSize - 1)];
+	textBytes -= textSize(text);
+	ids.remove(text);
+	text = QString();
+	freeIds.append(id);
+}
+
+int StringPool::count() const {
+	QMutexLocker locker(&mutex);
+	return ids.size();
+}
+
+//The chunks, their strings' data and the hash that finds them again.
+qint64 StringPool::bytes() const {
+	QMutexLocker locker(&mutex);
+	qint64 chunkCount = (next + ChunkSize - 1) / ChunkSize;
+	return qint64(sizeof(*this)) + chunkCount * ChunkSize * sizeof(QString) + textBytes
+		+ qint64(refs.capacity() + freeIds.capacity()) * sizeof(quint32)
+		+ qint64(ids.capacity()) * (sizeof(void *) + 32);//A QHash node, roughly.
+}
+
+int StringPool::allocations() const {
+	QMutexLocker locker(&mutex);
+	return int((next + ChunkSize - 1) / ChunkSize) + 2 * ids.size() + 3;//Chunks, texts, nodes, buckets, vectors.
+}
@@ -0,0 +1,59 @@
+#ifndef STRINGPOOL_H
+#define STRINGPOOL_H
+
+#include <qatomic.h>
+#include <qhash.h>
+#include <qmutex.h>
+#include <qstring.h>
+#include <qvector.h>
+
+//Interns the texts of a sheet: each distinct text is kept once and
+//cells refer to it by a 32-bit id, so a column of repeated labels
+//costs one string, not one per cell.
+//Strings live in fixed chunks that never move, so any thread can read
+//an id it was handed without a lock; interning takes a mutex, as
+//mapped blocks are decoded on the thread pool.
+//Every slot holding an id holds a reference to it. The text goes once
+//the last is released, and its id is handed out again. When every id
+//is taken intern() returns NoId, and the caller keeps the text itself.
+class StringPool
+{
+public:
+	enum { NoId = 0xFFFFFFFF };
+
+	StringPool();
+	~StringPool();
+
+	quint32 intern(const QString &text);
+	void retain(quint32 id);
+	void release(quint32 id);
+	const QString &text(quint32 id) const {
+		return chunks[id >> ChunkBits].loadAcquire()[id & (ChunkSize - 1)];
+	}
+	int count() const;
+	qint64 bytes() const;
+	int allocations() const;
+
+private:
+	enum {
+		ChunkBits = 16,
+		ChunkSize = 1 << ChunkBits,
+		MaxChunks = 4096
+	};
+
+	Q_DISABLE_COPY(StringPool)
+
+	static qint64 textSize(const QString &text) {
+		return 24 + (text.size() + 1) * sizeof(QChar);//With its QArrayData header.
+	}
+
+	QAtomicPointer<QString> chunks[MaxChunks];
+	QHash<QString, quint32> ids;
+	QVector<quint32> refs;//By id; 0 for a free one.
+	QVector<quint32> freeIds;
+	quint32 next;
+	qint64 textBytes;
+	mutable QMutex mutex;
+};
+
+#endif
@@ -0,0 +1,141 @@
+#include <qthread.h>
+#include <qtconcurrentmap.h>
+
+#include "cellref.h"
+#include "spreadsheetmodel.h"
+#include "tabseparatedtext.h"
+
+namespace {
+
+//A field of the text, found in place. Numbers in the form the store
+//keeps them in are parsed here, off the GUI thread.
+struct PasteField
+{
+	int offset;
+	int length;
+	double number;
+	bool isNumber;
+};
+
+//A run of pasted rows, tokenized by one worker.
+struct PasteSlice
+{
+	const QString *text;
+	const int *starts;//Offset of each row's first character.
+	const int *ends;//Offset of each row's '\n', or the text's end.
+	int count;
+	int columns;
+	QVector<PasteField> fields;//columns per row; missing ones are empty.
+};
+
+}
+
+static void tokenizePasteSlice(PasteSlice &slice) {
+	const QChar *data = slice.text->constData();
+	slice.fields.resize(slice.count * slice.columns);
+	for (int r = 0; r < slice.count; ++r) {
+		int p = slice.starts[r];
+		int end = slice.ends[r];
+		if (end > p && data[end - 1] == '\r')
+			--end;
+		for (int j = 0; j < slice.columns; ++j) {
+			PasteField &field = slice.fields[r * slice.columns + j];
+			int stop = p;
+			while (stop < end && data[stop] != '\t')
+				++stop;
+			field.offset = p;
+			field.length = stop - p;
+			field.number = 0.0;
+			field.isNumber = false;
+
+			QChar first = field.length > 0 ? data[p] : QChar();
+			if (first.isDigit() || first == '-' || first == '+' || first == '.') {
+				QStringRef ref(slice.text, p, field.length);
+				bool ok;
+				double number = ref.toDouble(&ok);
+				field.isNumber = ok && QString::number(number, 'g', 15) == ref;
+				field.number = number;
+			}
+			p = qMin(stop + 1, end);
+		}
+	}
+}
+
+//A trailing newline, which other tools end the last row with, makes no
+//extra row.
+TabSeparatedText::TabSeparatedText(const QString &text)
+	: text(text), starts(1, 0) {
+	if (this->text.endsWith('\n'))
+		this->text.chop(1);
+	if (this->text.endsWith('\r'))
+		this->text.chop(1);
+
+	const QChar *data = this->text.constData();
+	int size = this->text.size();
+	for (int i = 0; i < size; ++i) {
+		if (data[i] == '\n') {
+			ends.append(i);
+			starts.append(i + 1);
+		}
+	}
+	ends.append(size);
+
+	columns = 1;
+	for (int i = 0; i < ends[0]; ++i) {
+		if (data[i] == '\t')
+			++columns;
+	}
+}
+
+//Writes the rows with their top left corner at (top, left). What falls
+//off the grid is dropped; empty fields remove their cells.
+void TabSeparatedText::paste(SpreadsheetModel &model, int top, int left) const {
+	int numRows = starts.size();
+	int fieldColumns = qMin(columns, CellRef::MaxColumns - left);
+	int sliceCount = qMax(1, QThread::idealThreadCount()) * 4;
+	QVector<PasteSlice> slices;
+	model.beginBatch();
+	for (int first = 0; first < numRows && top + first < CellRef::MaxRows;
+		first += ChunkRows) {
+		int chunkRows = qMin(qMin(int(ChunkRows), numRows - first),
+			CellRef::MaxRows - top - first);
+		int perSlice = (chunkRows + sliceCount - 1) / sliceCount;
+		slices.clear();
+		for (int r = 0; r < chunkRows; r += perSlice) {
+			PasteSlice slice;
+			slice.text = &text;
+			slice.starts = starts.constData() + first + r;
+			slice.ends = ends.constData() + first + r;
+			slice.count = qMin(perSlice, chunkRows - r);
+			slice.columns = fieldColumns;
+			slices.append(slice);
+		}
+		if (chunkRows >= ParallelRows) {
+			QtConcurrent::blockingMap(slices, tokenizePasteSlice);
+		}
+		else {
+			for (int s = 0; s < slices.size(); ++s)
+				tokenizePasteSlice(slices[s]);
+		}
+
+		int row = top + first;
+		foreach(const PasteSlice &slice, slices) {
+			for (int r = 0; r < slice.count; ++r, ++row) {
+				for (int j = 0; j < fieldColumns; ++j) {
+					const PasteField &field = slice.fields[r * fieldColumns + j];
+					int column = left + j;
+					if (field.isNumber) {
+						model.setNumber(row, column, field.number);
+					}
+					else if (field.length == 0) {
+						model.removeCell(row, column);
+					}
+					else {
+						model.setFormula(row, column, text.mid(field.offset, field.length));
+					}
+				}
+			}
+		}
+	}
+	model.commitBatch();
+}
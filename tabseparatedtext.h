@@ -0,0 +1,35 @@
+#ifndef TABSEPARATEDTEXT_H
+#define TABSEPARATEDTEXT_H
+
+#include <qstring.h>
+#include <qvector.h>
+
+class SpreadsheetModel;
+
+//Tab-separated rows, as the clipboard carries them. Row boundaries are
+//found in one pass on construction; paste() then tokenizes the rows in
+//place, in parallel for big payloads, and writes them through one
+//model batch. Rows go in chunks so the tokens of only one chunk are
+//held at a time.
+class TabSeparatedText
+{
+public:
+	TabSeparatedText(const QString &text);
+
+	int rowCount() const { return starts.size(); }
+	int columnCount() const { return columns; }
+	void paste(SpreadsheetModel &model, int top, int left) const;
+
+private:
+	enum {
+		ChunkRows = 65536,
+		ParallelRows = 4096//Smaller chunks are tokenized on the calling thread.
+	};
+
+	QString text;
+	QVector<int> starts;//Offset of each row's first character.
+	QVector<int> ends;//Offset of each row's '\n', or the text's end.
+	int columns;//In the first row.
+};
+
+#endif
@@ -0,0 +1,133 @@
+#include <qbuffer.h>
+#include <qtest.h>
+
+#include "delimitedfile.h"
+#include "spreadsheetmodel.h"
+
+//CSV and TSV import and export: record boundaries, quoting, numbers.
+class TestDelimitedFile : public QObject
+{
+	Q_OBJECT;
+
+private slots:
+	void quotedFields();
+	void lineEndings();
+	void strayQuotes();
+	void numbers();
+	void tabs();
+	void roundTrip();
+
+private:
+	static void read(const QByteArray &text, char delimiter, SpreadsheetModel &model);
+};
+
+void TestDelimitedFile::read(const QByteArray &text, char delimiter,
+	SpreadsheetModel &model) {
+	QByteArray bytes = text;
+	QBuffer buffer(&bytes);
+	QVERIFY(buffer.open(QIODevice::ReadOnly));
+	model.setAutoRecalculate(false);
+	DelimitedFile::read(buffer, delimiter, model);
+}
+
+//Quoted fields may hold delimiters, doubled quotes and line breaks.
+void TestDelimitedFile::quotedFields() {
+	SpreadsheetModel model;
+	read("a,\"b,c\",\"d\"\"e\",\"multi\nline\"\n1,2.5,=A2+B2\n", ',', model);
+	QCOMPARE(model.formula(0, 0), QString("a"));
+	QCOMPARE(model.formula(0, 1), QString("b,c"));
+	QCOMPARE(model.formula(0, 2), QString("d\"e"));
+	QCOMPARE(model.formula(0, 3), QString("multi\nline"));
+	QCOMPARE(model.formula(1, 0), QString("1"));
+	QCOMPARE(model.formula(1, 1), QString("2.5"));
+	QCOMPARE(model.formula(1, 2), QString("=A2+B2"));
+	QCOMPARE(model.cells().count(), 7);
+}
+
+//CRLF ends a record like LF, and the last record needs no line end.
+void TestDelimitedFile::lineEndings() {
+	SpreadsheetModel model;
+	read("x,y\r\nz,w", ',', model);
+	QCOMPARE(model.formula(0, 1), QString("y"));
+	QCOMPARE(model.formula(1, 0), QString("z"));
+	QCOMPARE(model.formula(1, 1), QString("w"));
+}
+
+//A quote inside an unquoted field is text, and quotes nothing: the
+//records after it stay records, in both the vector and the byte scan.
+void TestDelimitedFile::strayQuotes() {
+	QByteArray text = "5\" screen,size\nnext,row\nx\"y\"z,\"a\"\"b\"\n";
+	for (int row = 0; row < 40; ++row)
+		text += "tv 32\" wide,\"ok\"\n";
+	SpreadsheetModel model;
+	read(text, ',', model);
+	QCOMPARE(model.formula(0, 0), QString("5\" screen"));
+	QCOMPARE(model.formula(0, 1), QString("size"));
+	QCOMPARE(model.formula(1, 0), QString("next"));
+	QCOMPARE(model.formula(2, 0), QString("x\"y\"z"));
+	QCOMPARE(model.formula(2, 1), QString("a\"b"));
+	QCOMPARE(model.formula(42, 0), QString("tv 32\" wide"));
+	QCOMPARE(model.formula(42, 1), QString("ok"));
+	QVERIFY(!model.cells().contains(43, 0));
+}
+
+//Only fields a number writes back unchanged are read as numbers; the
+//others keep their text, as they would when typed.
+void TestDelimitedFile::numbers() {
+	SpreadsheetModel model;
+	read("01234,1.10, 5,nan,inf,-2.5,1e+20\n", ',', model);
+	QCOMPARE(model.formula(0, 0), QString("01234"));
+	QCOMPARE(model.formula(0, 1), QString("1.10"));
+	QCOMPARE(model.formula(0, 2), QString(" 5"));
+	QCOMPARE(model.formula(0, 3), QString("nan"));
+	QCOMPARE(model.formula(0, 4), QString("inf"));
+	QVERIFY(!model.cells().isNumber(0, 0));
+	QVERIFY(!model.cells().isNumber(0, 1));
+	QVERIFY(model.cells().isNumber(0, 5));
+	QVERIFY(model.cells().value(0, 5).toDouble() == -2.5);
+	QVERIFY(model.cells().isNumber(0, 6));
+}
+
+//Enough records to fill the vector scan, with a tab delimiter.
+void TestDelimitedFile::tabs() {
+	QByteArray text;
+	for (int row = 0; row < 1000; ++row)
+		text += "r" + QByteArray::number(row) + "\t\"q\tq\"\t" + QByteArray::number(row) + "\n";
+	SpreadsheetModel model;
+	read(text, '\t', model);
+	QCOMPARE(model.formula(999, 0), QString("r999"));
+	QCOMPARE(model.formula(500, 1), QString("q\tq"));
+	QCOMPARE(model.formula(999, 2), QString("999"));
+	QVERIFY(!model.cells().contains(1000, 0));
+}
+
+//What the exporter writes, the importer reads back as it was.
+void TestDelimitedFile::roundTrip() {
+	SpreadsheetModel model;
+	model.setAutoRecalculate(false);
+	model.setFormula(0, 0, "plain");
+	model.setFormula(0, 2, "with,comma");
+	model.setFormula(1, 1, "with \"quotes\"");
+	model.setFormula(2, 0, "two\nlines");
+	model.setFormula(2, 3, "=A1");
+	model.setFormula(3, 0, "0.1");
+
+	QByteArray bytes;
+	QBuffer out(&bytes);
+	QVERIFY(out.open(QIODevice::WriteOnly));
+	QVERIFY(DelimitedFile::write(out, ',', model, DelimitedFile::Formulas));
+	out.close();
+
+	SpreadsheetModel loaded;
+	read(bytes, ',', loaded);
+	QCOMPARE(loaded.cells().count(), model.cells().count());
+	QCOMPARE(loaded.formula(0, 0), QString("plain"));
+	QCOMPARE(loaded.formula(0, 2), QString("with,comma"));
+	QCOMPARE(loaded.formula(1, 1), QString("with \"quotes\""));
+	QCOMPARE(loaded.formula(2, 0), QString("two\nlines"));
+	QCOMPARE(loaded.formula(2, 3), QString("=A1"));
+	QCOMPARE(loaded.formula(3, 0), QString("0.1"));
+}
+
+QTEST_GUILESS_MAIN(TestDelimitedFile)
+#include "tst_delimitedfile.moc"
@@ -0,0 +1,72 @@
+#include <algorithm>
+
+#include <qtest.h>
+
+#include "dependencygraph.h"
+
+//Dependents through single references and through ranges, small and wide.
+class TestDependencyGraph : public QObject
+{
+	Q_OBJECT;
+
+private slots:
+	void rangesAcrossBuckets();
+	void wideRanges();
+	void removedRangesAreForgotten();
+};
+
+static QVector<DependencyGraph::Key> sorted(QVector<DependencyGraph::Key> keys) {
+	std::sort(keys.begin(), keys.end());
+	return keys;
+}
+
+static CellRange range(int top, int left, int bottom, int right) {
+	CellRange r = { top, left, bottom, right };
+	return r;
+}
+
+//A cell read both directly and through two ranges is listed once.
+void TestDependencyGraph::rangesAcrossBuckets() {
+	DependencyGraph graph;
+	QVector<CellRef> refs;
+	CellRef a1 = { 0, 0 };
+	refs.append(a1);
+	QVector<CellRange> ranges;
+	ranges.append(range(0, 0, 2000, 20));
+	ranges.append(range(0, 0, 5, 0));
+	graph.setPrecedents(0, 30, refs, ranges);
+	graph.setPrecedents(1, 30, QVector<CellRef>(), QVector<CellRange>(1, range(1500, 17, 1600, 17)));
+
+	QCOMPARE(graph.dependents(0, 0), QVector<DependencyGraph::Key>(1, DependencyGraph::key(0, 30)));
+	QCOMPARE(sorted(graph.dependents(1550, 17)),
+		sorted(QVector<DependencyGraph::Key>() << DependencyGraph::key(0, 30) << DependencyGraph::key(1, 30)));
+	QVERIFY(graph.dependents(2001, 0).isEmpty());
+	QVERIFY(graph.dependents(0, 21).isEmpty());
+}
+
+void TestDependencyGraph::wideRanges() {
+	DependencyGraph graph;
+	graph.setPrecedents(0, 0, QVector<CellRef>(),
+		QVector<CellRange>(1, range(0, 1, CellRef::MaxRows - 1, 1)));
+	QCOMPARE(graph.dependents(1000000, 1), QVector<DependencyGraph::Key>(1, DependencyGraph::key(0, 0)));
+	QVERIFY(graph.dependents(1000000, 2).isEmpty());
+	QCOMPARE(graph.affectedCells(5, 1).size(), 1);
+}
+
+void TestDependencyGraph::removedRangesAreForgotten() {
+	DependencyGraph graph;
+	QVector<CellRange> ranges;
+	ranges.append(range(0, 0, 100, 0));
+	ranges.append(range(0, 0, 100, 0));
+	ranges.append(range(0, 0, CellRef::MaxRows - 1, 3));
+	graph.setPrecedents(0, 5, QVector<CellRef>(), ranges);
+	graph.setPrecedents(0, 6, QVector<CellRef>(), QVector<CellRange>(1, range(50, 0, 60, 0)));
+	graph.removePrecedents(0, 5);
+	QCOMPARE(graph.dependents(55, 0), QVector<DependencyGraph::Key>(1, DependencyGraph::key(0, 6)));
+	QVERIFY(graph.dependents(500000, 2).isEmpty());
+	graph.removePrecedents(0, 6);
+	QVERIFY(graph.dependents(55, 0).isEmpty());
+}
+
+QTEST_GUILESS_MAIN(TestDependencyGraph)
+#include "tst_dependencygraph.moc"
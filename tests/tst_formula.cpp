@@ -0,0 +1,122 @@
+#include <qhash.h>
+#include <qtest.h>
+
+#include "aggregate.h"
+#include "formula.h"
+
+namespace {
+
+//Cells in a hash; empty ones read as 0.
+class GridContext : public FormulaContext
+{
+public:
+	QVariant cellValue(int row, int column) const override {
+		return cells.value(key(row, column), 0.0);
+	}
+
+	bool number(int row, int column, double &value) const override {
+		QVariant v = cellValue(row, column);
+		if (v.type() != QVariant::Double)
+			return false;
+		value = v.toDouble();
+		return true;
+	}
+
+	void aggregate(const CellRange &, Accumulator &) const override {}
+
+	void set(int row, int column, const QVariant &value) {
+		cells.insert(key(row, column), value);
+	}
+
+private:
+	static qint64 key(int row, int column) { return (qint64(row) << 32) | column; }
+
+	QHash<qint64, QVariant> cells;
+};
+
+}
+
+//The compiled programs, and lane evaluation against one cell at a time.
+class TestFormula : public QObject
+{
+	Q_OBJECT;
+
+private slots:
+	void relativeReferences();
+	void lanesMatchScalar();
+	void lanesLeaveOddCellsToScalar();
+};
+
+//References are kept as offsets, so one program serves a filled-down column.
+void TestFormula::relativeReferences() {
+	Formula formula = Formula::compile("A1*B1", 0, 2);
+	QVERIFY(formula.isValid());
+	QVector<CellRef> refs = formula.references(9, 2);
+	QCOMPARE(refs.size(), 2);
+	QCOMPARE(refs[0].row, 9);
+	QCOMPARE(refs[0].column, 0);
+	QCOMPARE(refs[1].row, 9);
+	QCOMPARE(refs[1].column, 1);
+}
+
+void TestFormula::lanesMatchScalar() {
+	GridContext context;
+	const int count = Formula::Lanes;
+	int rows[count];
+	int columns[count];
+	for (int l = 0; l < count; ++l) {
+		rows[l] = l;
+		columns[l] = 3;
+		context.set(l, 0, l * 0.25 - 7.0);
+		context.set(l, 1, 1.0 / (l + 1));
+		context.set(l, 2, double(l % 5) + 2.0);
+	}
+
+	Formula formula = Formula::compile("A1*B1+(C1-1.5)/-C1-2", 0, 3);
+	QVERIFY(formula.isArithmetic());
+	double results[count];
+	bool done[count];
+	formula.evaluateLanes(context, rows, columns, count, results, done);
+	for (int l = 0; l < count; ++l) {
+		QVERIFY(done[l]);
+		QVariant scalar = formula.evaluate(context, rows[l], columns[l]);
+		QCOMPARE(scalar.type(), QVariant::Double);
+		QVERIFY(results[l] == scalar.toDouble());
+	}
+}
+
+//Text operands and division by zero aren't finished in lanes; every
+//lane that is finished still agrees with evaluate().
+void TestFormula::lanesLeaveOddCellsToScalar() {
+	GridContext context;
+	const int count = 40;
+	int rows[count];
+	int columns[count];
+	for (int l = 0; l < count; ++l) {
+		rows[l] = l;
+		columns[l] = 2;
+		if (l % 7 == 3) {
+			context.set(l, 0, QString("text"));
+		}
+		else {
+			context.set(l, 0, double(l));
+		}
+		context.set(l, 1, double(l % 4));
+	}
+
+	Formula formula = Formula::compile("A1/B1", 0, 2);
+	double results[count];
+	bool done[count];
+	formula.evaluateLanes(context, rows, columns, count, results, done);
+	for (int l = 0; l < count; ++l) {
+		if (l % 7 == 3 || l % 4 == 0) {
+			QVERIFY(!done[l]);
+			continue;
+		}
+		QVERIFY(done[l]);
+		QVERIFY(results[l] == formula.evaluate(context, rows[l], columns[l]).toDouble());
+	}
+}
+
+QTEST_GUILESS_MAIN(TestFormula)
+#include "tst_formula.moc"
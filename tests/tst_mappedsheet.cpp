@@ -0,0 +1,146 @@
+#include <qfileinfo.h>
+#include <qsharedpointer.h>
+#include <qtemporaryfile.h>
+#include <qtest.h>
+
+#include "cellstore.h"
+#include "mappedsheet.h"
+#include "spreadsheetmodel.h"
+
+//The version 3 file: the base image, its checksums and the journal.
+class TestMappedSheet : public QObject
+{
+	Q_OBJECT;
+
+private slots:
+	void roundTrip();
+	void damagedBlockReadsEmpty();
+	void journalReplay();
+	void journalKeepsNumberBits();
+
+private:
+	static bool writeStore(QTemporaryFile &file, const CellStore &store);
+};
+
+bool TestMappedSheet::writeStore(QTemporaryFile &file, const CellStore &store) {
+	return file.open() && MappedSheet::write(file, store) && file.flush();
+}
+
+//Numbers come back bit for bit, texts and formulas as typed, in any
+//block of any column.
+void TestMappedSheet::roundTrip() {
+	CellStore store;
+	store.setNumber(0, 0, 0.1 + 0.2);
+	store.setNumber(300, 0, -1e300);
+	store.setNumber(70000, 2, 1.0 / 3.0);
+	store.setFormula(1, 0, "hello");
+	store.setFormula(2, 0, "'12");
+	store.setFormula(3, 0, "1.50");
+	store.setFormula(4, 1, "=A1+1");
+	store.setFormula(5, 1, "=SUM(A1:A4)");
+
+	QTemporaryFile file;
+	QVERIFY(writeStore(file, store));
+
+	QSharedPointer<MappedSheet> sheet(new MappedSheet);
+	QVERIFY(sheet->open(file.fileName()));
+	QCOMPARE(sheet->cellCount(), qint64(store.count()));
+
+	CellStore loaded;
+	loaded.map(sheet);
+	QCOMPARE(loaded.count(), store.count());
+	QVERIFY(loaded.value(0, 0).toDouble() == 0.1 + 0.2);
+	QVERIFY(loaded.value(300, 0).toDouble() == -1e300);
+	QVERIFY(loaded.value(70000, 2).toDouble() == 1.0 / 3.0);
+	QCOMPARE(loaded.formula(1, 0), QString("hello"));
+	QCOMPARE(loaded.formula(2, 0), QString("'12"));
+	QCOMPARE(loaded.formula(3, 0), QString("1.50"));
+	QCOMPARE(loaded.formula(4, 1), QString("=A1+1"));
+	QCOMPARE(loaded.formula(5, 1), QString("=SUM(A1:A4)"));
+	QVERIFY(!loaded.contains(6, 0));
+}
+
+//A block whose bytes don't match their CRC is dropped, not decoded.
+void TestMappedSheet::damagedBlockReadsEmpty() {
+	CellStore store;
+	for (int row = 0; row < 10; ++row)
+		store.setNumber(row, 0, row);
+	store.setNumber(0, 1, 42);
+
+	QTemporaryFile file;
+	QVERIFY(writeStore(file, store));
+	const qint64 firstBlock = 40;//Right after the header.
+	QVERIFY(file.seek(firstBlock + 12));
+	char byte;
+	QVERIFY(file.getChar(&byte));
+	QVERIFY(file.seek(firstBlock + 12));
+	QVERIFY(file.putChar(char(byte ^ 0x5A)));
+	QVERIFY(file.flush());
+
+	QSharedPointer<MappedSheet> sheet(new MappedSheet);
+	QVERIFY(sheet->open(file.fileName()));
+	CellStore loaded;
+	loaded.map(sheet);
+	QVERIFY(!loaded.contains(0, 0));
+	QVERIFY(!loaded.contains(9, 0));
+	QVERIFY(loaded.value(0, 1).toDouble() == 42.0);
+}
+
+//A save back to the same file appends a journal segment, and reading
+//the file replays it over the base image.
+void TestMappedSheet::journalReplay() {
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	QString fileName = file.fileName();
+	file.close();
+
+	SpreadsheetModel model;
+	model.setFormula(0, 0, "1");
+	model.setFormula(1, 0, "2");
+	model.setFormula(2, 0, "=A1+A2");
+	model.setFormula(3, 0, "text");
+	QVERIFY(model.writeFile(fileName));
+	qint64 baseSize = QFileInfo(fileName).size();
+
+	model.setFormula(1, 0, "5");
+	model.removeCell(3, 0);
+	model.setFormula(0, 1, "added");
+	QVERIFY(model.writeFile(fileName));
+	QVERIFY(QFileInfo(fileName).size() > baseSize);
+
+	SpreadsheetModel loaded;
+	QVERIFY(loaded.readFile(fileName));
+	QCOMPARE(loaded.formula(0, 0), QString("1"));
+	QCOMPARE(loaded.formula(1, 0), QString("5"));
+	QCOMPARE(loaded.formula(2, 0), QString("=A1+A2"));
+	QCOMPARE(loaded.formula(3, 0), QString(""));
+	QCOMPARE(loaded.formula(0, 1), QString("added"));
+	loaded.finishRecalculation();
+	QCOMPARE(loaded.valueText(2, 0), QString("6"));
+}
+
+//A number no 15-digit text reproduces comes back bit for bit from the
+//journal as it does from the base image.
+void TestMappedSheet::journalKeepsNumberBits() {
+	QTemporaryFile file;
+	QVERIFY(file.open());
+	QString fileName = file.fileName();
+	file.close();
+
+	const double third = 1.0 / 3.0;
+	SpreadsheetModel model;
+	model.setNumber(0, 0, 1.0);
+	QVERIFY(model.writeFile(fileName));
+	model.setNumber(0, 0, third);
+	model.setNumber(1, 0, 0.1 + 0.2);
+	QVERIFY(model.writeFile(fileName));
+
+	SpreadsheetModel loaded;
+	QVERIFY(loaded.readFile(fileName));
+	QVERIFY(loaded.cells().isNumber(0, 0));
+	QVERIFY(loaded.cells().value(0, 0).toDouble() == third);
+	QVERIFY(loaded.cells().value(1, 0).toDouble() == 0.1 + 0.2);
+}
+
+QTEST_GUILESS_MAIN(TestMappedSheet)
+#include "tst_mappedsheet.moc"
@@ -0,0 +1,89 @@
+#include <qtest.h>
+
+#include "cellstore.h"
+#include "spreadsheetcompare.h"
+
+//Sort orders: radix sorted numeric keys, merge sorted mixed ones.
+class TestSpreadsheetCompare : public QObject
+{
+	Q_OBJECT;
+
+private slots:
+	void numericKeysWithEmptyCells();
+	void descendingKeepsEmptyCellsLast();
+	void mixedKinds();
+	void parallelMerge();
+};
+
+static QVector<int> expected(std::initializer_list<int> rows) {
+	return QVector<int>(rows);
+}
+
+//Two keys, the second descending; empty cells go last under each key.
+void TestSpreadsheetCompare::numericKeysWithEmptyCells() {
+	CellStore store;
+	store.setNumber(0, 0, 2);
+	store.setNumber(1, 0, 1);
+	store.setNumber(2, 0, 2);
+	store.setNumber(4, 0, 1);
+	store.setNumber(0, 1, 5);
+	store.setNumber(1, 1, 3);
+	store.setNumber(2, 1, 4);
+	store.setNumber(3, 1, 1);
+
+	SpreadsheetCompare compare;
+	compare.addKey(0, true);
+	compare.addKey(1, false);
+	CellRange range = { 0, 0, 4, 1 };
+	QCOMPARE(compare.sortedRows(store, range), expected({ 1, 4, 0, 2, 3 }));
+}
+
+void TestSpreadsheetCompare::descendingKeepsEmptyCellsLast() {
+	CellStore store;
+	store.setNumber(0, 0, 1);
+	store.setNumber(2, 0, 3);
+	store.setNumber(3, 0, 2);
+	store.setNumber(4, 0, -0.5);
+
+	SpreadsheetCompare compare;
+	compare.addKey(0, false);
+	CellRange range = { 0, 0, 4, 0 };
+	QCOMPARE(compare.sortedRows(store, range), expected({ 2, 3, 0, 4, 1 }));
+}
+
+//Numbers before text; equal keys keep their order.
+void TestSpreadsheetCompare::mixedKinds() {
+	CellStore store;
+	store.setFormula(0, 0, "b");
+	store.setNumber(1, 0, 3);
+	store.setFormula(2, 0, "a");
+	store.setNumber(4, 0, 1);
+	store.setFormula(5, 0, "a");
+
+	SpreadsheetCompare compare;
+	compare.addKey(0, true);
+	CellRange range = { 0, 0, 5, 0 };
+	QCOMPARE(compare.sortedRows(store, range), expected({ 4, 1, 2, 5, 0, 3 }));
+}
+
+//Big enough to be sorted in chunks on the thread pool and merged.
+void TestSpreadsheetCompare::parallelMerge() {
+	const int rows = 70000;
+	CellStore store;
+	for (int row = 0; row < rows; ++row)
+		store.setFormula(row, 0, QString("k%1").arg((row * 7919) % 1000, 3, 10, QChar('0')));
+
+	SpreadsheetCompare compare;
+	compare.addKey(0, true);
+	CellRange range = { 0, 0, rows - 1, 0 };
+	QVector<int> order = compare.sortedRows(store, range);
+	QCOMPARE(order.size(), rows);
+	for (int i = 1; i < rows; ++i) {
+		QString previous = store.formula(order[i - 1], 0);
+		QString current = store.formula(order[i], 0);
+		QVERIFY(previous < current || (previous == current && order[i - 1] < order[i]));
+	}
+}
+
+QTEST_GUILESS_MAIN(TestSpreadsheetCompare)
+#include "tst_spreadsheetcompare.moc"
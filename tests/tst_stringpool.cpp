@@ -0,0 +1,80 @@
+#include <qtest.h>
+
+#include "cellstore.h"
+#include "formulapool.h"
+#include "stringpool.h"
+
+//The sheet's pools: texts and formulas go when the last cell holding
+//them does.
+class TestStringPool : public QObject
+{
+	Q_OBJECT;
+
+private slots:
+	void textsAreCounted();
+	void freedIdsAreReused();
+	void formulasAreCounted();
+	void storeReleasesTexts();
+};
+
+void TestStringPool::textsAreCounted() {
+	StringPool pool;
+	quint32 id = pool.intern("label");
+	QCOMPARE(pool.intern("label"), id);
+	pool.retain(id);
+	QCOMPARE(pool.count(), 1);
+	pool.release(id);
+	pool.release(id);
+	QCOMPARE(pool.text(id), QString("label"));
+	pool.release(id);
+	QCOMPARE(pool.count(), 0);
+}
+
+void TestStringPool::freedIdsAreReused() {
+	StringPool pool;
+	quint32 first = pool.intern("a");
+	pool.intern("b");
+	pool.release(first);
+	quint32 reused = pool.intern("c");
+	QCOMPARE(reused, first);
+	QCOMPARE(pool.text(reused), QString("c"));
+	QVERIFY(pool.intern("a") != first);
+}
+
+void TestStringPool::formulasAreCounted() {
+	FormulaPool pool;
+	const SharedFormula *c1 = pool.intern("=A1*B1", 0, 2);
+	const SharedFormula *c2 = pool.intern("=A2*B2", 1, 2);
+	QCOMPARE(c1, c2);
+	QCOMPARE(pool.count(), 1);
+	c1->release();
+	QCOMPARE(pool.count(), 1);
+	c2->release();
+	QCOMPARE(pool.count(), 0);
+}
+
+//Overwritten and removed texts, and those of a snapshot's copied
+//blocks, are given back, so a sheet whose texts keep changing doesn't
+//keep growing.
+void TestStringPool::storeReleasesTexts() {
+	CellStore store;
+	store.setFormula(0, 2, "=B1");
+	for (int row = 0; row < 1000; ++row)
+		store.setFormula(row, 1, QString("text %1").arg(row));
+	qint64 filled = store.usage().bytes;
+
+	CellStore *snapshot = store.snapshot();
+	for (int row = 0; row < 500; ++row)
+		store.setNumber(row, 1, row);
+	for (int row = 500; row < 1000; ++row)
+		store.remove(row, 1);
+	delete snapshot;
+	QCOMPARE(store.count(), 501);
+
+	for (int row = 0; row < 1000; ++row)
+		store.setFormula(row, 1, QString("word %1").arg(row));
+	QVERIFY(store.usage().bytes <= filled + 1024);
+}
+
+QTEST_GUILESS_MAIN(TestStringPool)
+#include "tst_stringpool.moc"
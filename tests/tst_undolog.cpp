@@ -0,0 +1,66 @@
+#include <qtest.h>
+
+#include "spreadsheetmodel.h"
+
+//Undo and redo through the model, in memory and spilled to disk.
+class TestUndoLog : public QObject
+{
+	Q_OBJECT;
+
+private slots:
+	void numbersKeepTheirBits();
+	void spilledCommandsSurviveCompaction();
+};
+
+void TestUndoLog::numbersKeepTheirBits() {
+	const double third = 1.0 / 3.0;
+	SpreadsheetModel model;
+	model.setAutoRecalculate(false);
+	model.setNumber(0, 0, third);
+	model.setNumber(0, 0, 0.1 + 0.2);
+
+	model.undo();
+	QVERIFY(model.cells().isNumber(0, 0));
+	QVERIFY(model.cells().value(0, 0).toDouble() == third);
+	model.redo();
+	QVERIFY(model.cells().value(0, 0).toDouble() == 0.1 + 0.2);
+	model.undo();
+	model.undo();
+	QVERIFY(!model.cells().contains(0, 0));
+}
+
+//Every command goes to the spill file. Undoing most of them and then
+//editing drops them, which leaves enough dead bytes to compact the
+//file; the commands left must still undo right.
+void TestUndoLog::spilledCommandsSurviveCompaction() {
+	const int edits = 30;
+	const int kept = 5;
+	QStringList texts;
+	for (int i = 0; i < edits; ++i)
+		texts.append(QString(300000, QChar('a' + i % 26)) + QString::number(i));
+
+	SpreadsheetModel model;
+	model.setAutoRecalculate(false);
+	model.setUndoMemoryLimit(1);
+	foreach(const QString &text, texts)
+		model.setFormula(0, 0, text);
+
+	for (int i = edits - 1; i >= kept; --i)
+		model.undo();
+	QCOMPARE(model.formula(0, 0), texts[kept - 1]);
+	model.setFormula(1, 0, "new");
+	QVERIFY(!model.canRedo());
+
+	model.undo();
+	QCOMPARE(model.formula(1, 0), QString(""));
+	for (int i = kept - 1; i > 0; --i) {
+		model.undo();
+		QCOMPARE(model.formula(0, 0), texts[i - 1]);
+	}
+	model.undo();
+	QVERIFY(!model.cells().contains(0, 0));
+	QVERIFY(!model.canUndo());
+}
+
+QTEST_GUILESS_MAIN(TestUndoLog)
+#include "tst_undolog.moc"
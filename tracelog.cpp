@@ -0,0 +1,116 @@
+#include <qatomic.h>
+#include <qcoreapplication.h>
+#include <qelapsedtimer.h>
+#include <qmutex.h>
+#include <qthread.h>
+#include <qvector.h>
+
+#include "tracelog.h"
+
+namespace {
+
+enum { RingSize = 1 << 15 };//Spans kept per thread.
+
+//Written by its thread only. head counts the spans ever recorded; the
+//writer fills a slot before publishing it, so a reader sees whole
+//spans up to head, less the ones the writer overtook meanwhile.
+struct Ring
+{
+	int id;
+	QByteArray threadName;
+	QAtomicInteger<quint64> head;
+	TraceLog::Event events[RingSize];
+};
+
+//Rings outlive their threads, so the spans of a pool thread that has
+//since exited still show.
+QMutex ringsMutex;
+QVector<Ring *> rings;
+thread_local Ring *localRing = 0;
+
+Ring *newRing() {
+	Ring *ring = new Ring;
+	ring->head.store(0);
+	QMutexLocker locker(&ringsMutex);
+	ring->id = rings.size() + 1;
+	QCoreApplication *app = QCoreApplication::instance();
+	if (app && QThread::currentThread() == app->thread()) {
+		ring->threadName = "GUI";
+	}
+	else {
+		ring->threadName = "Worker " + QByteArray::number(ring->id);
+	}
+	rings.append(ring);
+	return ring;
+}
+
+QElapsedTimer startedClock() {
+	QElapsedTimer clock;
+	clock.start();
+	return clock;
+}
+
+QByteArray micros(qint64 nsecs) {
+	return QByteArray::number(nsecs / 1000.0, 'f', 3);
+}
+
+}
+
+qint64 TraceLog::now() {
+	static const QElapsedTimer clock = startedClock();
+	return clock.nsecsElapsed();
+}
+
+void TraceLog::record(const char *name, qint64 start, qint64 duration) {
+	if (!localRing)
+		localRing = newRing();
+	quint64 head = localRing->head.load();
+	Event &event = localRing->events[head % RingSize];
+	event.name = name;
+	event.start = start;
+	event.duration = duration;
+	localRing->head.storeRelease(head + 1);
+}
+
+//The Trace Event Format: one complete ("X") event per span, plus the
+//name of each thread.
+QByteArray TraceLog::toJson() {
+	QByteArray pid = QByteArray::number(QCoreApplication::applicationPid());
+	QByteArray json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool first = true;
+	auto begin = [&](int tid) {
+		json += first ? "\n" : ",\n";
+		first = false;
+		json += "{\"pid\":" + pid + ",\"tid\":" + QByteArray::number(tid) + ',';
+	};
+
+	QMutexLocker locker(&ringsMutex);
+	foreach(Ring *ring, rings) {
+		begin(ring->id);
+		json += "\"ph\":\"M\",\"name\":\"thread_name\",\"args\":{\"name\":\""
+			+ ring->threadName + "\"}}";
+
+		quint64 head = ring->head.loadAcquire();
+		quint64 from = head > RingSize ? head - RingSize : 0;
+		QVector<Event> events;
+		events.reserve(int(head - from));
+		for (quint64 i = from; i < head; ++i)
+			events.append(ring->events[i % RingSize]);
+
+		//Slots the writer reused while they were copied are dropped,
+		//along with the one it may be filling now.
+		quint64 overtaken = ring->head.loadAcquire() + 1;
+		quint64 valid = overtaken > RingSize ? overtaken - RingSize : 0;
+		for (int i = 0; i < events.size(); ++i) {
+			if (from + i < valid)
+				continue;
+			const Event &event = events[i];
+			begin(ring->id);
+			json += "\"ph\":\"X\",\"name\":\"" + QByteArray(event.name)
+				+ "\",\"ts\":" + micros(event.start)
+				+ ",\"dur\":" + micros(event.duration) + '}';
+		}
+	}
+	json += "\n]}\n";
+	return json;
+}
@@ -0,0 +1,48 @@
+#ifndef TRACELOG_H
+#define TRACELOG_H
+
+#include <qbytearray.h>
+#include <qglobal.h>
+
+//The latest timed spans of every thread, for chrome://tracing or
+//Perfetto. Each thread writes a ring of its own without locking, so
+//recording is always on: a span costs two clock reads and a store.
+//Once a ring is full its oldest spans give way.
+class TraceLog
+{
+public:
+	struct Event
+	{
+		const char *name;//A literal; only the pointer is kept.
+		qint64 start;//Nanoseconds since the first span.
+		qint64 duration;
+	};
+
+	static qint64 now();
+	static void record(const char *name, qint64 start, qint64 duration);
+	static QByteArray toJson();
+};
+
+//Records the time from its construction to its destruction. Spans
+//shorter than minNsecs are dropped, so calls made thousands of times
+//per frame only show when one of them stalls.
+class TraceSpan
+{
+public:
+	explicit TraceSpan(const char *name, qint64 minNsecs = 0)
+		: name(name), minNsecs(minNsecs), start(TraceLog::now()) {}
+	~TraceSpan() {
+		qint64 duration = TraceLog::now() - start;
+		if (duration >= minNsecs)
+			TraceLog::record(name, start, duration);
+	}
+
+private:
+	Q_DISABLE_COPY(TraceSpan)
+
+	const char *name;
+	qint64 minNsecs;
+	qint64 start;
+};
+
+#endif
@@ -0,0 +1,293 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include <qdatastream.h>
+
+#include "cellstore.h"
+#include "undolog.h"
+
+UndoLog::UndoLog(const CellStore &store)
+	: store(store) {
+	current = 0;
+	inMemory = 0;
+	memoryLimit = DefaultMemoryLimit;
+	spilled = 0;
+}
+
+//Numbers compare by their bits, so 0.0 and -0.0 differ and so do NaNs
+//that print alike.
+bool UndoValue::operator==(const UndoValue &other) const {
+	if (isNumber != other.isNumber)
+		return false;
+	if (isNumber)
+		return memcmp(&number, &other.number, sizeof(number)) == 0;
+	return formula == other.formula;
+}
+
+static QDataStream &operator<<(QDataStream &out, const UndoValue &value) {
+	out << quint8(value.isNumber);
+	if (value.isNumber) {
+		out << value.number;
+	}
+	else {
+		out << value.formula;
+	}
+	return out;
+}
+
+static QDataStream &operator>>(QDataStream &in, UndoValue &value) {
+	quint8 isNumber = 0;
+	in >> isNumber;
+	value.isNumber = isNumber != 0;
+	value.number = 0.0;
+	if (value.isNumber) {
+		in >> value.number;
+	}
+	else {
+		in >> value.formula;
+	}
+	return in;
+}
+
+//A plain number is kept as a double, not as the text formula() gives it.
+UndoValue UndoLog::valueAt(int row, int column) const {
+	UndoValue value;
+	value.isNumber = store.isNumber(row, column);
+	value.number = value.isNumber ? store.value(row, column).toDouble() : 0.0;
+	if (!value.isNumber)
+		value.formula = store.formula(row, column);
+	return value;
+}
+
+//Keeps the value the cell had when the command first touched it.
+void UndoLog::touch(int row, int column) {
+	DependencyGraph::Key key = DependencyGraph::key(row, column);
+	if (touched.contains(key))
+		return;
+	touched.insert(key, touchedCells.size());
+	TouchedCell cell = { row, column, valueAt(row, column) };
+	touchedCells.append(cell);
+}
+
+//The rows of range were put in order; undoing applies the inverse.
+void UndoLog::addRowOrder(const CellRange &range, const QVector<int> &order) {
+	bool moved = false;
+	for (int i = 0; i < order.size() && !moved; ++i)
+		moved = order[i] != i;
+	if (!moved)
+		return;
+
+	endCellStep();
+	UndoStep step;
+	step.kind = UndoStep::Rows;
+	step.range = range;
+	step.order = order;
+	steps.append(step);
+}
+
+//Reads the touched cells' new values and keeps those that changed.
+void UndoLog::endCellStep() {
+	if (touchedCells.isEmpty())
+		return;
+	UndoStep step;
+	step.kind = UndoStep::Cells;
+	foreach(const TouchedCell &cell, touchedCells) {
+		UndoValue after = valueAt(cell.row, cell.column);
+		if (after == cell.before)
+			continue;
+		CellRef ref = { cell.row, cell.column };
+		step.cells.append(ref);
+		step.before.append(cell.before);
+		step.after.append(after);
+	}
+	if (!step.cells.isEmpty())
+		steps.append(step);
+	touched.clear();
+	touchedCells.clear();
+}
+
+//Ends the command being recorded and packs it. Commands that were
+//undone can't be redone past a new one, and are dropped.
+void UndoLog::commit() {
+	endCellStep();
+	if (steps.isEmpty())
+		return;
+
+	Command command;
+	QDataStream out(&command.data, QIODevice::WriteOnly);
+	out << quint32(steps.size());
+	foreach(const UndoStep &step, steps) {
+		out << quint8(step.kind);
+		if (step.kind == UndoStep::Cells) {
+			out << quint32(step.cells.size());
+			for (int i = 0; i < step.cells.size(); ++i) {
+				out << qint32(step.cells[i].row) << qint32(step.cells[i].column)
+					<< step.before[i] << step.after[i];
+			}
+		}
+		else {
+			out << qint32(step.range.top) << qint32(step.range.left)
+				<< qint32(step.range.bottom) << qint32(step.range.right) << step.order;
+		}
+	}
+	steps.clear();
+	command.offset = 0;
+	command.size = command.data.size();
+
+	while (commands.size() > current)
+		drop(commands.takeLast());
+	if (commands.isEmpty() && spillFile.isOpen())
+		spillFile.resize(0);
+	commands.append(command);
+	inMemory += command.size;
+	++current;
+	if (commands.size() > CommandLimit) {
+		drop(commands.first());
+		commands.removeFirst();
+		--current;
+	}
+	spill();
+	compactSpill();
+}
+
+//Forgets a command taken out of the log; its spill bytes are dead.
+void UndoLog::drop(const Command &command) {
+	if (command.data.isEmpty()) {
+		spilled -= command.size;
+	}
+	else {
+		inMemory -= command.size;
+	}
+}
+
+//Writes the oldest commands out until the rest fit the limit. The
+//latest command always stays in memory.
+void UndoLog::spill() {
+	for (int i = 0; i + 1 < commands.size() && inMemory > memoryLimit; ++i) {
+		Command &command = commands[i];
+		if (command.data.isEmpty())
+			continue;
+		if (!spillFile.isOpen() && !spillFile.open())
+			return;
+		qint64 offset = spillFile.size();
+		if (!spillFile.seek(offset) || spillFile.write(command.data) != command.size)
+			return;//Kept in memory, then.
+		command.offset = offset;
+		command.data.clear();
+		inMemory -= command.size;
+		spilled += command.size;
+	}
+}
+
+//Moves the spilled commands still in the log down over the dead bytes
+//of dropped ones and cuts the file short, once the dead part is both
+//big and larger than the live one. Commands are copied down one at a
+//time in the order they lie in the file, which isn't always log order:
+//one that can't be moved is taken back into memory, and may be spilled
+//again at the end, after newer ones.
+void UndoLog::compactSpill() {
+	if (!spillFile.isOpen())
+		return;
+	qint64 dead = spillFile.size() - spilled;
+	if (dead < MinCompactBytes || dead < spilled)
+		return;
+
+	QVector<int> order;
+	for (int i = 0; i < commands.size(); ++i) {
+		if (commands[i].data.isEmpty())
+			order.append(i);
+	}
+	std::sort(order.begin(), order.end(), [this](int a, int b) {
+		return commands[a].offset < commands[b].offset;
+	});
+
+	qint64 end = 0;
+	foreach(int i, order) {
+		Command &command = commands[i];
+		if (command.offset != end) {
+			QByteArray data;
+			if (spillFile.seek(command.offset))
+				data = spillFile.read(command.size);
+			if (data.size() != command.size)
+				return;//Unreadable; what is already moved stays valid.
+			if (!spillFile.seek(end) || spillFile.write(data) != command.size) {
+				command.data = data;
+				inMemory += command.size;
+				spilled -= command.size;
+				continue;
+			}
+			command.offset = end;
+		}
+		end += command.size;
+	}
+	spillFile.resize(end);
+}
+
+QVector<UndoStep> UndoLog::load(int index) {
+	const Command &command = commands[index];
+	QByteArray data = command.data;
+	if (data.isEmpty() && spillFile.seek(command.offset))
+		data = spillFile.read(command.size);
+
+	QVector<UndoStep> result;
+	QDataStream in(data);
+	quint32 count = 0;
+	in >> count;
+	for (quint32 s = 0; s < count && in.status() == QDataStream::Ok; ++s) {
+		UndoStep step;
+		quint8 kind;
+		in >> kind;
+		step.kind = UndoStep::Kind(kind);
+		if (step.kind == UndoStep::Cells) {
+			quint32 cells = 0;
+			in >> cells;
+			for (quint32 i = 0; i < cells && in.status() == QDataStream::Ok; ++i) {
+				qint32 row, column;
+				UndoValue before, after;
+				in >> row >> column >> before >> after;
+				CellRef ref = { row, column };
+				step.cells.append(ref);
+				step.before.append(before);
+				step.after.append(after);
+			}
+		}
+		else {
+			qint32 top, left, bottom, right;
+			in >> top >> left >> bottom >> right >> step.order;
+			CellRange range = { top, left, bottom, right };
+			step.range = range;
+		}
+		result.append(step);
+	}
+	return result;
+}
+
+//The steps of the command to undo, in the order they were done.
+bool UndoLog::undo(QVector<UndoStep> &result) {
+	if (!canUndo())
+		return false;
+	--current;
+	result = load(current);
+	return true;
+}
+
+bool UndoLog::redo(QVector<UndoStep> &result) {
+	if (!canRedo())
+		return false;
+	result = load(current);
+	++current;
+	return true;
+}
+
+void UndoLog::clear() {
+	commands.clear();
+	current = 0;
+	inMemory = 0;
+	touched.clear();
+	touchedCells.clear();
+	steps.clear();
+	spilled = 0;
+	if (spillFile.isOpen())
+		spillFile.resize(0);
+}
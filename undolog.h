@@ -0,0 +1,111 @@
+#ifndef UNDOLOG_H
+#define UNDOLOG_H
+
+#include <qbytearray.h>
+#include <qhash.h>
+#include <qstringlist.h>
+#include <qtemporaryfile.h>
+#include <qvector.h>
+
+#include "cellref.h"
+#include "dependencygraph.h"
+
+class CellStore;
+
+//What a cell held: a plain number, kept exactly, or its formula.
+struct UndoValue
+{
+	bool isNumber;
+	double number;
+	QString formula;//Empty for a cell that didn't exist.
+
+	bool operator==(const UndoValue &other) const;
+	bool operator!=(const UndoValue &other) const { return !(*this == other); }
+};
+
+//One step of an undoable command: a set of cells that changed, with
+//their values before and after, or a reordering of rows.
+struct UndoStep
+{
+	enum Kind { Cells, Rows };
+
+	Kind kind;
+	QVector<CellRef> cells;
+	QVector<UndoValue> before;
+	QVector<UndoValue> after;
+	CellRange range;
+	QVector<int> order;//As SpreadsheetModel::permuteRows() takes it.
+};
+
+//The undo and redo history of a sheet, as a log of commands.
+//A command is recorded while it runs: the first time a cell is touched
+//its old value is kept, and when the command ends the new values are
+//read back and the cells that really changed are packed into one
+//byte array, strings and all. A sort is kept as its row permutation.
+//Once the packed commands outgrow the memory limit the oldest are
+//moved to a temporary file and read back if they are undone. The file
+//is compacted once the commands dropped from the log fill most of it.
+class UndoLog
+{
+public:
+	UndoLog(const CellStore &store);
+
+	void setMemoryLimit(qint64 bytes) { memoryLimit = bytes; spill(); }
+	qint64 memoryUsed() const { return inMemory; }
+
+	bool isTouched(int row, int column) const {
+		return touched.contains(DependencyGraph::key(row, column));
+	}
+	void touch(int row, int column);
+	void addRowOrder(const CellRange &range, const QVector<int> &order);
+	void commit();
+	void clear();
+
+	bool canUndo() const { return current > 0; }
+	bool canRedo() const { return current < commands.size(); }
+	bool undo(QVector<UndoStep> &result);
+	bool redo(QVector<UndoStep> &result);
+
+private:
+	enum {
+		CommandLimit = 1000,
+		DefaultMemoryLimit = 64 * 1024 * 1024,
+		MinCompactBytes = 16 * 1024 * 1024//Dead spill bytes tolerated at least.
+	};
+
+	struct Command
+	{
+		QByteArray data;//Empty once spilled.
+		qint64 offset;//In the spill file.
+		int size;
+	};
+
+	struct TouchedCell
+	{
+		int row;
+		int column;
+		UndoValue before;
+	};
+
+	UndoValue valueAt(int row, int column) const;
+	void endCellStep();
+	void drop(const Command &command);
+	void spill();
+	void compactSpill();
+	QVector<UndoStep> load(int index);
+
+	const CellStore &store;
+	QVector<Command> commands;
+	int current;//Commands before this one are done, the rest undone.
+	qint64 inMemory;
+	qint64 memoryLimit;
+	QTemporaryFile spillFile;
+	qint64 spilled;//Bytes of the spill file commands still in the log use.
+
+	//The command being recorded.
+	QHash<DependencyGraph::Key, int> touched;
+	QVector<TouchedCell> touchedCells;
+	QVector<UndoStep> steps;
+};
+
+#endif